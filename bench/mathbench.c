@@ -0,0 +1,175 @@
+/* mathbench.c - math kernel microbenchmark
+ * Times the SIMD matrix and batched vector kernels against their
+ * scalar reference versions and checks that both agree
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <gl3/gl3.h>
+
+#define ITERATIONS 5000000
+#define BATCH 4096
+
+static volatile float sink;
+
+/* Log handlers
+ */
+void _log_std_output(const char *msg) {
+    fprintf(stdout, "SG3: %s", msg);
+    fflush(stdout);
+}
+
+void _log_err_output(const char *msg) {
+    fprintf(stderr, "SG3: ERROR: %s", msg);
+    fflush(stderr);
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+/* Print per-op times and throughput; a scalar time of 0 means there is
+ * no reference version to compare with.
+ */
+static void report(const char *name, double scalar, double simd) {
+    if (scalar > 0.0)
+        printf("%-24s %8.2f ns %8.2f ns %6.2fx %8.1f Mops/s\n", name,
+               scalar*1e9/ITERATIONS, simd*1e9/ITERATIONS, scalar/simd, ITERATIONS/simd/1e6);
+    else
+        printf("%-24s %11s %8.2f ns %7s %8.1f Mops/s\n", name, "-",
+               simd*1e9/ITERATIONS, "-", ITERATIONS/simd/1e6);
+}
+
+static int matrices_agree(const float *a, const float *b, float tolerance) {
+    int i;
+    for (i=0; i<16; i++)
+        if (fabsf(a[i]-b[i]) > tolerance*(1.0f+fabsf(a[i])))
+            return FALSE;
+    return TRUE;
+}
+
+static void random_matrix(float *m) {
+    int i;
+    for (i=0; i<16; i++)
+        m[i] = (float)rand()/RAND_MAX*2.0f-1.0f;
+}
+
+static void random_vectors(Number3D *v, int count) {
+    int i;
+    for (i=0; i<count; i++)
+        v[i] = (Number3D){ (float)rand()/RAND_MAX-0.5f, (float)rand()/RAND_MAX-0.5f, (float)rand()/RAND_MAX-0.5f };
+}
+
+static int check() {
+    ALIGNED_MATRIX(a);
+    ALIGNED_MATRIX(b);
+    ALIGNED_MATRIX(v);
+    int i, ok = TRUE;
+    for (i=0; i<1000; i++) {
+        random_matrix(a);
+        random_matrix(v);
+        dupmx(b, a);
+        mulmx(a, v);
+        mulmx_scalar(b, v);
+        ok = ok && matrices_agree(a, b, 1e-5f);
+        random_matrix(a);
+        dupmx(b, a);
+        invmx(a);
+        invmx_scalar(b);
+        ok = ok && matrices_agree(a, b, 1e-3f);
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    ALIGNED_MATRIX(m);
+    ALIGNED_MATRIX(r);
+    Camera *camera = camera_create();
+    double start, scalar;
+    int i;
+
+#if SG3_SIMD_SSE
+    printf("backend: SSE\n");
+#elif SG3_SIMD_NEON
+    printf("backend: NEON\n");
+#else
+    printf("backend: scalar\n");
+#endif
+    if (!check()) {
+        printf("SIMD and scalar results differ\n");
+        return 1;
+    }
+    printf("%-24s %11s %11s %7s\n", "", "scalar", "current", "speedup");
+
+    // rotations keep the chained products bounded
+    idmx(r);
+    rotmx(r, (Number3D){0.0f, 0.6f, 0.8f}, 0.01f);
+    idmx(m);
+    start = now();
+    for (i=0; i<ITERATIONS; i++) mulmx_scalar(m, r);
+    scalar = now()-start;
+    idmx(m);
+    start = now();
+    for (i=0; i<ITERATIONS; i++) mulmx(m, r);
+    report("mulmx", scalar, now()-start);
+
+    start = now();
+    for (i=0; i<ITERATIONS; i++) invmx_scalar(m);
+    scalar = now()-start;
+    start = now();
+    for (i=0; i<ITERATIONS; i++) invmx(m);
+    report("invmx", scalar, now()-start);
+
+    camera_reshape_viewport(camera, 800, 600);
+    dupmx(camera->model_view_matrix, r);
+    rotmx(camera->projection_matrix, (Number3D){1.0f, 0.0f, 0.0f}, 0.5f);
+    start = now();
+    for (i=0; i<ITERATIONS; i++) {
+        camera->model_view_matrix[M30] += 1e-6f;
+        camera_extract_frustum(camera);
+    }
+    report("camera_extract_frustum", 0.0, now()-start);
+
+    // batched kernels against the per-vector functions, ITERATIONS vectors each
+    Number3D *v = malloc(sizeof(Number3D)*BATCH);
+    Number3D min, max;
+    int j;
+    random_vectors(v, BATCH);
+    start = now();
+    for (i=0; i<ITERATIONS; i+=BATCH)
+        for (j=0; j<BATCH; j++) trmx3d(&v[j], r);
+    scalar = now()-start;
+    start = now();
+    for (i=0; i<ITERATIONS; i+=BATCH) trmx3dv(v, BATCH, r);
+    report("trmx3dv", scalar, now()-start);
+
+    start = now();
+    for (i=0; i<ITERATIONS; i+=BATCH)
+        for (j=0; j<BATCH; j++) norm3d(&v[j]);
+    scalar = now()-start;
+    start = now();
+    for (i=0; i<ITERATIONS; i+=BATCH) norm3dv(v, BATCH);
+    report("norm3dv", scalar, now()-start);
+
+    start = now();
+    for (i=0; i<ITERATIONS; i+=BATCH) {
+        min = max = v[0];
+        for (j=1; j<BATCH; j++) {
+            min.x = fminf(min.x, v[j].x); min.y = fminf(min.y, v[j].y); min.z = fminf(min.z, v[j].z);
+            max.x = fmaxf(max.x, v[j].x); max.y = fmaxf(max.y, v[j].y); max.z = fmaxf(max.z, v[j].z);
+        }
+    }
+    scalar = now()-start;
+    start = now();
+    for (i=0; i<ITERATIONS; i+=BATCH) bounds3dv(v, BATCH, &min, &max);
+    report("bounds3dv", scalar, now()-start);
+
+    sink = m[0]+camera->frustum[0][0]+v[0].x+min.x+max.x;
+    free(v);
+    camera_destroy(camera);
+    return 0;
+}
@@ -14,6 +14,9 @@ CPPFLAGS += -I../
 ifneq ($(NOTMCB),1)
 CPPFLAGS += -include ../tmcb/tmcb_inc.h
 endif
+ifneq ($(SG3_LOG_LEVEL),)
+CPPFLAGS += -DSG3_LOG_LEVEL=$(SG3_LOG_LEVEL)
+endif
 ifeq ($(DEBUG),1)
 	CFLAGS := $(CFLAGS) -Wall -g3 -O0 -fmessage-length=0 
 else
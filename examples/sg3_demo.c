@@ -92,7 +92,7 @@ int demo_init() {
     sun->fixed_proximity = TRUE;
     scene_add_background_object(scene, OBJ3D(sun));
 
-    scene->lights->light->position = OBJ3D(sun)->position;
+    HANDLES_ITEM(scene->lights, Light, 0)->position = OBJ3D(sun)->position;
 
     m = model_create(RESOURCE_DIR, "trainer1");
     if (m != NULL) {
@@ -335,10 +335,12 @@ static void *update_thread_proc(void *arg) {
         norm3d(&scene->camera->up);
         
         
-        SET3D(OBJ3D(c)->position, 0.0f, 20.0f, 0.0f);
-        rotz3d(&OBJ3D(c)->position, DEG2RAD(rotate));
+        Number3D orbit = NUM3D(0.0f, 20.0f, 0.0f);
+        rotz3d(&orbit, DEG2RAD(rotate));
+        object3d_set_position(OBJ3D(c), orbit);
         
         scene_update(scene);
+        scene_publish(scene);
 
         float el = get_elapsed_time();
         accum += el;
@@ -372,8 +374,6 @@ void demo_render() {
     static int count = 0;
     static char avgtext[32];
     
-    pthread_mutex_lock(&scene_mutex);
-    
     get_elapsed_time();
 
     if (scene) scene_render(scene);
@@ -388,8 +388,6 @@ void demo_render() {
         sprintf(avgtext, "R:%f", avg);
         overlaytext_set_text(avg_render_time, avgtext);
     }
-    
-    pthread_mutex_unlock(&scene_mutex);
 }
 
 void demo_up(int state) {
@@ -0,0 +1,152 @@
+/* alloc.c - allocators
+ * Slab pools for fixed-size nodes and single-block arenas for the arrays
+ * belonging to one object
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <log/log.h>
+#include "types.h"
+#include "alloc.h"
+
+// Blocks are charged to the caller's file and line when tmcb is in use
+#ifdef TMCB_INC_H_
+#define ALLOC_AT(file, line, size) tmalloc(file, line, size)
+#else
+#define ALLOC_AT(file, line, size) malloc(size)
+#endif
+
+typedef struct _PoolSlab {
+    struct _PoolSlab *next;
+} PoolSlab;
+
+#define SLAB_HEADER ARENA_SIZE(sizeof(PoolSlab))
+#define ARENA_HEADER ARENA_SIZE(sizeof(Arena))
+
+static Pool *pools = NULL;
+static ArenaStats arena_stats;
+
+static void pool_register(Pool *pool) {
+    if (!pool->registered) {
+        pool->registered = TRUE;
+        pool->next = pools;
+        pools = pool;
+    }
+}
+
+#if !SG3_POOL_PASSTHROUGH
+// room for the free-list link, rounded to keep items aligned
+static size_t pool_item_size(const Pool *pool) {
+    size_t size = pool->item_size < sizeof(void*) ? sizeof(void*) : pool->item_size;
+    return (size+sizeof(void*)-1)&~(sizeof(void*)-1);
+}
+
+static void pool_add_slab(Pool *pool, const char *file, int line) {
+    size_t size = pool_item_size(pool);
+    PoolSlab *slab = ALLOC_AT(file, line, SLAB_HEADER+size*POOL_SLAB_ITEMS);
+    char *item = (char*)slab+SLAB_HEADER;
+    int i;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->stats.slabs++;
+    for (i=0; i<POOL_SLAB_ITEMS; i++, item+=size) {
+        *(void**)item = pool->free_items;
+        pool->free_items = item;
+    }
+}
+#endif
+
+/* An uninitialized item, from the free list or a new slab.
+ */
+void *pool_alloc_at(Pool *pool, const char *file, int line) {
+    void *item;
+    pool_register(pool);
+#if SG3_POOL_PASSTHROUGH
+    item = ALLOC_AT(file, line, pool->item_size);
+#else
+    if (pool->free_items == NULL)
+        pool_add_slab(pool, file, line);
+    item = pool->free_items;
+    pool->free_items = *(void**)item;
+#endif
+    pool->stats.allocs++;
+    if (++pool->stats.live > pool->stats.peak)
+        pool->stats.peak = pool->stats.live;
+    return item;
+}
+
+void pool_free(Pool *pool, void *item) {
+    if (item == NULL)
+        return;
+    pool->stats.frees++;
+#if SG3_POOL_PASSTHROUGH
+    pool->stats.live--;
+    free(item);
+#else
+    *(void**)item = pool->free_items;
+    pool->free_items = item;
+    if (--pool->stats.live == 0) {
+        while (pool->slabs) {
+            PoolSlab *slab = pool->slabs;
+            pool->slabs = slab->next;
+            free(slab);
+        }
+        pool->free_items = NULL;
+        pool->stats.slabs = 0;
+    }
+#endif
+}
+
+/* A zeroed arena of size bytes, in one block with its header.
+ */
+Arena *arena_create_at(size_t size, const char *file, int line) {
+    Arena *arena = ALLOC_AT(file, line, ARENA_HEADER+size);
+    memset((char*)arena+ARENA_HEADER, 0, size);
+    arena->size = size;
+    arena->used = 0;
+    arena_stats.creates++;
+    arena_stats.live++;
+    arena_stats.live_bytes += size;
+    return arena;
+}
+
+/* The next size bytes of the arena, aligned to ARENA_ALIGN, or NULL if
+ * the arena was made too small.
+ */
+void *arena_alloc(Arena *arena, size_t size) {
+    void *p;
+    size = ARENA_SIZE(size);
+    if (arena->used+size > arena->size) {
+        LOGERR("arena of %d bytes exhausted\n", (int)arena->size);
+        return NULL;
+    }
+    p = (char*)arena+ARENA_HEADER+arena->used;
+    arena->used += size;
+    return p;
+}
+
+void arena_destroy(Arena *arena) {
+    if (arena == NULL)
+        return;
+    arena_stats.destroys++;
+    arena_stats.live--;
+    arena_stats.live_bytes -= arena->size;
+    free(arena);
+}
+
+void alloc_arena_stats(ArenaStats *stats) {
+    *stats = arena_stats;
+}
+
+/* Log the counts of every pool used so far and of the arenas.
+ */
+void alloc_log_stats() {
+    Pool *pool;
+    for (pool=pools; pool; pool=pool->next) {
+        LOG("pool %s: %ld allocs, %ld frees, %d live (peak %d), %d slabs\n", pool->name,
+            pool->stats.allocs, pool->stats.frees, pool->stats.live, pool->stats.peak, pool->stats.slabs);
+    }
+    LOG("arenas: %ld created, %ld destroyed, %d live (%d bytes)\n", arena_stats.creates,
+        arena_stats.destroys, arena_stats.live, (int)arena_stats.live_bytes);
+}
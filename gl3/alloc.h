@@ -0,0 +1,71 @@
+/* alloc.h - allocators
+ * Slab pools for fixed-size nodes and single-block arenas for the arrays
+ * belonging to one object
+ * Copyright 2012 Keath Milligan
+ */
+
+#ifndef ALLOC_H_
+#define ALLOC_H_
+
+#include <stddef.h>
+
+#define POOL_SLAB_ITEMS 64
+#define ARENA_ALIGN 16
+#define ARENA_SIZE(size) (((size_t)(size)+ARENA_ALIGN-1)&~(size_t)(ARENA_ALIGN-1))
+
+// Build with SG3_POOL_PASSTHROUGH=1 to give every pool item its own malloc,
+// so tmcb tracks and reports items by the line that allocated them
+#ifndef SG3_POOL_PASSTHROUGH
+#define SG3_POOL_PASSTHROUGH 0
+#endif
+
+typedef struct _PoolStats {
+    long allocs;
+    long frees;
+    int live;
+    int peak;
+    int slabs;
+} PoolStats;
+
+// Fixed-size items carved from slabs of POOL_SLAB_ITEMS. Freed items are
+// kept on a free list for reuse; the slabs go back to malloc when the
+// last live item is freed, so an idle pool holds no memory. Define pools
+// statically with POOL_INIT, they register for stats on first use.
+typedef struct _Pool {
+    const char *name;
+    size_t item_size;
+    void *free_items;
+    struct _PoolSlab *slabs;
+    PoolStats stats;
+    int registered;
+    struct _Pool *next;
+} Pool;
+
+#define POOL_INIT(type) { #type, sizeof(type) }
+
+// One block handing out consecutive, aligned pieces, freed as a whole.
+// Size it with the sum of ARENA_SIZE() of each piece.
+typedef struct _Arena {
+    size_t size;
+    size_t used;
+} Arena;
+
+typedef struct _ArenaStats {
+    long creates;
+    long destroys;
+    int live;
+    size_t live_bytes;
+} ArenaStats;
+
+#define pool_alloc(pool) pool_alloc_at(pool, __FILE__, __LINE__)
+#define arena_create(size) arena_create_at(size, __FILE__, __LINE__)
+
+void *pool_alloc_at(Pool *pool, const char *file, int line);
+void pool_free(Pool *pool, void *item);
+Arena *arena_create_at(size_t size, const char *file, int line);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_destroy(Arena *arena);
+void alloc_arena_stats(ArenaStats *stats);
+void alloc_log_stats();
+
+#endif /* ALLOC_H_ */
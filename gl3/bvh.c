@@ -0,0 +1,322 @@
+/* bvh.c - bounding volume hierarchies
+ * Ray-query acceleration for meshes and scenes
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <stdlib.h>
+#include <log/log.h>
+#include "math.h"
+#include "bvh.h"
+
+#define BVH_BINS 12
+#define BVH_MAX_DEPTH 60
+
+typedef struct _BVHBuild {
+    const Cube3D *bounds;
+    Number3D *centroids;
+    BVH *bvh;
+    int leaf_size;
+} BVHBuild;
+
+typedef struct _BVHBin {
+    Cube3D bounds;
+    int count;
+} BVHBin;
+
+typedef struct _MeshQuery {
+    const Number3D *vertices;
+    const Face *faces;
+} MeshQuery;
+
+static void bvh_subdivide(BVHBuild *build, int index, int first, int count, int depth);
+
+static inline void box_empty(Cube3D *box) {
+    SET3D(box->min, FLT_MAX, FLT_MAX, FLT_MAX);
+    SET3D(box->max, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+}
+
+static inline void box_grow(Cube3D *box, const Cube3D *b) {
+    if (b->min.x < box->min.x) box->min.x = b->min.x;
+    if (b->min.y < box->min.y) box->min.y = b->min.y;
+    if (b->min.z < box->min.z) box->min.z = b->min.z;
+    if (b->max.x > box->max.x) box->max.x = b->max.x;
+    if (b->max.y > box->max.y) box->max.y = b->max.y;
+    if (b->max.z > box->max.z) box->max.z = b->max.z;
+}
+
+static inline void box_grow_point(Cube3D *box, Number3D p) {
+    if (p.x < box->min.x) box->min.x = p.x;
+    if (p.y < box->min.y) box->min.y = p.y;
+    if (p.z < box->min.z) box->min.z = p.z;
+    if (p.x > box->max.x) box->max.x = p.x;
+    if (p.y > box->max.y) box->max.y = p.y;
+    if (p.z > box->max.z) box->max.z = p.z;
+}
+
+static inline float box_area(const Cube3D *box) {
+    Number3D e = vec3d(box->min, box->max);
+    if (e.x < 0.0f || e.y < 0.0f || e.z < 0.0f)
+        return 0.0f;
+    return e.x*e.y+e.y*e.z+e.z*e.x;
+}
+
+/* Build a hierarchy over count primitive bounding boxes, splitting with a
+ * binned surface area heuristic until nodes hold leaf_size or fewer.
+ */
+BVH *bvh_build(const Cube3D *bounds, int count, int leaf_size) {
+    BVHBuild build;
+    int i;
+    if (count <= 0)
+        return NULL;
+    BVH *bvh = calloc(1, sizeof(BVH));
+    bvh->primitive_count = count;
+    bvh->primitives = malloc(sizeof(int)*count);
+    bvh->nodes = malloc(sizeof(BVHNode)*(2*count));
+    build.bounds = bounds;
+    build.centroids = malloc(sizeof(Number3D)*count);
+    build.bvh = bvh;
+    build.leaf_size = leaf_size > 0 ? leaf_size : 1;
+    for (i=0; i<count; i++) {
+        bvh->primitives[i] = i;
+        build.centroids[i] = NUM3D((bounds[i].min.x+bounds[i].max.x)*0.5f,
+                                   (bounds[i].min.y+bounds[i].max.y)*0.5f,
+                                   (bounds[i].min.z+bounds[i].max.z)*0.5f);
+    }
+    bvh->node_count = 1;
+    bvh_subdivide(&build, 0, 0, count, 0);
+    free(build.centroids);
+    return bvh;
+}
+
+static void bvh_subdivide(BVHBuild *build, int index, int first, int count, int depth) {
+    BVH *bvh = build->bvh;
+    BVHNode *node = &bvh->nodes[index];
+    Cube3D cbounds;
+    int i;
+    box_empty(&node->bounds);
+    box_empty(&cbounds);
+    for (i=first; i<first+count; i++) {
+        box_grow(&node->bounds, &build->bounds[bvh->primitives[i]]);
+        box_grow_point(&cbounds, build->centroids[bvh->primitives[i]]);
+    }
+    node->first = first;
+    node->count = count;
+    if (count <= build->leaf_size || depth >= BVH_MAX_DEPTH)
+        return;
+
+    // split along the longest axis of the centroid bounds
+    Number3D extent = vec3d(cbounds.min, cbounds.max);
+    int axis = 0;
+    if (extent.y > FA(extent)[axis]) axis = 1;
+    if (extent.z > FA(extent)[axis]) axis = 2;
+    float lo = FA(cbounds.min)[axis];
+    float span = FA(extent)[axis];
+    if (span <= FLT_EPSILON)
+        return;
+
+    BVHBin bins[BVH_BINS];
+    for (i=0; i<BVH_BINS; i++) {
+        box_empty(&bins[i].bounds);
+        bins[i].count = 0;
+    }
+    float scale = (float)BVH_BINS/span;
+    for (i=first; i<first+count; i++) {
+        int p = bvh->primitives[i];
+        int b = (int)((FA(build->centroids[p])[axis]-lo)*scale);
+        if (b >= BVH_BINS) b = BVH_BINS-1;
+        bins[b].count++;
+        box_grow(&bins[b].bounds, &build->bounds[p]);
+    }
+
+    // sweep the bins for the cheapest split plane
+    float right_area[BVH_BINS];
+    int right_count[BVH_BINS];
+    Cube3D acc;
+    int n = 0;
+    box_empty(&acc);
+    for (i=BVH_BINS-1; i>0; i--) {
+        box_grow(&acc, &bins[i].bounds);
+        n += bins[i].count;
+        right_area[i] = box_area(&acc);
+        right_count[i] = n;
+    }
+    float best_cost = FLT_MAX;
+    int best_split = 0;
+    box_empty(&acc);
+    n = 0;
+    for (i=0; i<BVH_BINS-1; i++) {
+        box_grow(&acc, &bins[i].bounds);
+        n += bins[i].count;
+        if (n == 0 || right_count[i+1] == 0)
+            continue;
+        float cost = box_area(&acc)*n+right_area[i+1]*right_count[i+1];
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_split = i+1;
+        }
+    }
+    if (best_split == 0)
+        return;
+    if (best_cost >= box_area(&node->bounds)*count && count <= build->leaf_size*4)
+        return;
+
+    // partition primitives about the chosen plane
+    int mid = first;
+    for (i=first; i<first+count; i++) {
+        int p = bvh->primitives[i];
+        int b = (int)((FA(build->centroids[p])[axis]-lo)*scale);
+        if (b >= BVH_BINS) b = BVH_BINS-1;
+        if (b < best_split) {
+            bvh->primitives[i] = bvh->primitives[mid];
+            bvh->primitives[mid++] = p;
+        }
+    }
+    if (mid == first || mid == first+count)
+        mid = first+count/2;
+
+    int left = bvh->node_count;
+    bvh->node_count += 2;
+    node->first = left;
+    node->count = 0;
+    bvh_subdivide(build, left, first, mid-first, depth+1);
+    bvh_subdivide(build, left+1, mid, first+count-mid, depth+1);
+}
+
+/* Hierarchy over a mesh's triangles. The primitive index is the face index.
+ */
+BVH *bvh_build_mesh(const Number3D *vertices, const Face *faces, int face_count) {
+    int i;
+    if (face_count <= 0)
+        return NULL;
+    Cube3D *bounds = malloc(sizeof(Cube3D)*face_count);
+    for (i=0; i<face_count; i++) {
+        box_empty(&bounds[i]);
+        box_grow_point(&bounds[i], vertices[faces[i].a]);
+        box_grow_point(&bounds[i], vertices[faces[i].b]);
+        box_grow_point(&bounds[i], vertices[faces[i].c]);
+    }
+    BVH *bvh = bvh_build(bounds, face_count, BVH_LEAF_SIZE);
+    free(bounds);
+    LOG("built mesh bvh: %d faces, %d nodes\n", face_count, bvh->node_count);
+    return bvh;
+}
+
+void bvh_destroy(BVH *bvh) {
+    free(bvh->nodes);
+    free(bvh->primitives);
+    free(bvh);
+}
+
+/* Recompute node bounds after primitives moved without rebuilding the
+ * tree. Children are always stored after their parent, so a reverse walk
+ * sees every child before its parent.
+ */
+void bvh_refit(BVH *bvh, const Cube3D *bounds) {
+    int i, j;
+    for (i=bvh->node_count-1; i>=0; i--) {
+        BVHNode *node = &bvh->nodes[i];
+        box_empty(&node->bounds);
+        if (node->count > 0) {
+            for (j=node->first; j<node->first+node->count; j++)
+                box_grow(&node->bounds, &bounds[bvh->primitives[j]]);
+        } else {
+            box_grow(&node->bounds, &bvh->nodes[node->first].bounds);
+            box_grow(&node->bounds, &bvh->nodes[node->first+1].bounds);
+        }
+    }
+}
+
+static inline int ray_box(const Cube3D *box, Number3D origin, Number3D inv, float tmax, float *tentry) {
+    float t1 = (box->min.x-origin.x)*inv.x;
+    float t2 = (box->max.x-origin.x)*inv.x;
+    float tmin = fminf(t1, t2);
+    float tout = fmaxf(t1, t2);
+    t1 = (box->min.y-origin.y)*inv.y;
+    t2 = (box->max.y-origin.y)*inv.y;
+    tmin = fmaxf(tmin, fminf(t1, t2));
+    tout = fminf(tout, fmaxf(t1, t2));
+    t1 = (box->min.z-origin.z)*inv.z;
+    t2 = (box->max.z-origin.z)*inv.z;
+    tmin = fmaxf(tmin, fminf(t1, t2));
+    tout = fminf(tout, fmaxf(t1, t2));
+    if (tout < 0.0f || tmin > tout || tmin > tmax)
+        return FALSE;
+    *tentry = tmin;
+    return TRUE;
+}
+
+/* Trace a ray (origin p0, direction p1) through the hierarchy, calling hit
+ * for primitives in the leaves it reaches. With any_hit the first hit ends
+ * the query, otherwise the closest is found. Returns the primitive hit, or
+ * -1, with its distance in *t.
+ */
+int bvh_intersect(const BVH *bvh, Line3D ray, float tmax, int any_hit, BVHHitFPtr hit, void *data, float *t) {
+    int stack[BVH_MAX_DEPTH+4];
+    float entry[BVH_MAX_DEPTH+4];
+    int sp = 0;
+    int result = -1;
+    float te;
+    if (bvh == NULL)
+        return -1;
+    Number3D inv = NUM3D(1.0f/ray.p1.x, 1.0f/ray.p1.y, 1.0f/ray.p1.z);
+    if (!ray_box(&bvh->nodes[0].bounds, ray.p0, inv, tmax, &te))
+        return -1;
+    stack[sp] = 0;
+    entry[sp++] = te;
+    while (sp > 0) {
+        sp--;
+        if (entry[sp] > tmax)
+            continue;
+        const BVHNode *node = &bvh->nodes[stack[sp]];
+        if (node->count > 0) {
+            int i;
+            for (i=node->first; i<node->first+node->count; i++) {
+                float th;
+                int p = bvh->primitives[i];
+                if (hit(p, ray, tmax, &th, data) && th <= tmax) {
+                    tmax = th;
+                    result = p;
+                    if (any_hit) {
+                        *t = th;
+                        return result;
+                    }
+                }
+            }
+        } else {
+            float tl, tr;
+            int l = ray_box(&bvh->nodes[node->first].bounds, ray.p0, inv, tmax, &tl);
+            int r = ray_box(&bvh->nodes[node->first+1].bounds, ray.p0, inv, tmax, &tr);
+            // push the far child first so the near one is visited next
+            if (l && r) {
+                if (tl <= tr) {
+                    stack[sp] = node->first+1; entry[sp++] = tr;
+                    stack[sp] = node->first; entry[sp++] = tl;
+                } else {
+                    stack[sp] = node->first; entry[sp++] = tl;
+                    stack[sp] = node->first+1; entry[sp++] = tr;
+                }
+            } else if (l) {
+                stack[sp] = node->first; entry[sp++] = tl;
+            } else if (r) {
+                stack[sp] = node->first+1; entry[sp++] = tr;
+            }
+        }
+    }
+    if (result >= 0)
+        *t = tmax;
+    return result;
+}
+
+static int mesh_hit(int primitive, Line3D ray, float tmax, float *t, void *data) {
+    MeshQuery *q = (MeshQuery*)data;
+    const Face *f = &q->faces[primitive];
+    return raytri3d(ray, q->vertices[f->a], q->vertices[f->b], q->vertices[f->c], t);
+}
+
+/* Ray against a mesh's triangles in the mesh's own space. Returns the face
+ * hit or -1.
+ */
+int bvh_intersect_mesh(const BVH *bvh, const Number3D *vertices, const Face *faces, Line3D ray, float tmax, int any_hit, float *t) {
+    MeshQuery q = { vertices, faces };
+    return bvh_intersect(bvh, ray, tmax, any_hit, mesh_hit, &q, t);
+}
@@ -0,0 +1,39 @@
+/* bvh.h - bounding volume hierarchies
+ * Ray-query acceleration for meshes and scenes
+ * Copyright 2012 Keath Milligan
+ */
+
+#ifndef BVH_H_
+#define BVH_H_
+
+#include "types.h"
+#include "texture.h"
+
+#define BVH_LEAF_SIZE 4
+
+// Node - interior nodes keep their children at first and first+1,
+// leaves reference count primitives starting at first
+typedef struct _BVHNode {
+    Cube3D bounds;
+    int first;
+    int count;
+} BVHNode;
+
+typedef struct _BVH {
+    BVHNode *nodes;
+    int node_count;
+    int *primitives;
+    int primitive_count;
+} BVH;
+
+// Ray/primitive test - returns TRUE with *t set for a hit closer than tmax
+typedef int (*BVHHitFPtr)(int primitive, Line3D ray, float tmax, float *t, void *data);
+
+BVH *bvh_build(const Cube3D *bounds, int count, int leaf_size);
+BVH *bvh_build_mesh(const Number3D *vertices, const Face *faces, int face_count);
+void bvh_destroy(BVH *bvh);
+void bvh_refit(BVH *bvh, const Cube3D *bounds);
+int bvh_intersect(const BVH *bvh, Line3D ray, float tmax, int any_hit, BVHHitFPtr hit, void *data, float *t);
+int bvh_intersect_mesh(const BVH *bvh, const Number3D *vertices, const Face *faces, Line3D ray, float tmax, int any_hit, float *t);
+
+#endif /* BVH_H_ */
@@ -5,6 +5,7 @@
 #include "gl.h"
 #include "math.h"
 #include "util.h"
+#include "matrix.h"
 #include "camera.h"
 #include "scene.h"
 #include "objects.h"
@@ -42,29 +43,35 @@ void camera_reshape_viewport(Camera *camera, int width, int height) {
         camera->viewport_bottom *= 1.0f/aspect;
         camera->viewport_top *= 1.0f/aspect;
     }
+    camera->viewport[0] = 0;
+    camera->viewport[1] = 0;
+    camera->viewport[2] = width;
+    camera->viewport[3] = height;
     camera->dirty = TRUE;
 }
 
+/* Build the projection and view matrices on the CPU and hand them to GL,
+ * so nothing has to be read back from it.
+ */
 void camera_update_view_frustum(Camera *camera) {
     if (camera->dirty) {
+        frustmx(camera->projection_matrix,
+                camera->viewport_left,
+                camera->viewport_right,
+                camera->viewport_bottom,
+                camera->viewport_top,
+                camera->near_clip,
+                camera->far_clip);
         glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        glFrustum(camera->viewport_left,
-                  camera->viewport_right,
-                  camera->viewport_bottom,
-                  camera->viewport_top,
-                  camera->near_clip,
-                  camera->far_clip);
-        glGetFloatv(GL_PROJECTION_MATRIX, camera->projection_matrix);
-        glGetIntegerv(GL_VIEWPORT, camera->viewport);
+        glLoadMatrixf(camera->projection_matrix);
+        glMatrixMode(GL_MODELVIEW);
         camera->dirty = FALSE;
     }
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    gluLookAt(camera->position.x, camera->position.y, camera->position.z,
-              camera->target.x, camera->target.y, camera->target.z,
-              camera->up.x, camera->up.y, camera->up.z);
-    glGetFloatv(GL_MODELVIEW_MATRIX, camera->model_view_matrix);
+    lookmx(camera->model_view_matrix,
+           CAMERA_STATE(camera, position),
+           CAMERA_STATE(camera, target),
+           CAMERA_STATE(camera, up));
+    matrix_reset(camera->model_view_matrix);
     camera_extract_frustum(camera);
 }
 
@@ -79,25 +86,23 @@ Number3D camera_screen_coords(Camera *camera, Number3D point) {
     return result;
 }
 
+/* Radius in pixels of a sphere drawn with the current projection, taken at
+ * the sphere's distance from the eye. Spheres around the eye are treated
+ * as filling the screen. Uses the live camera placement, as the scene picks
+ * levels of detail when it publishes.
+ */
+float camera_projected_radius(Camera *camera, Number3D center, float radius) {
+    float distance = len3d(vec3d(camera->position, center));
+    if (distance <= radius)
+        return (float)camera->screen_height;
+    return radius*camera->projection_matrix[5]*0.5f*(float)camera->screen_height/distance;
+}
+
 void camera_extract_frustum(Camera *camera) {
-    float clip[16];
+    ALIGNED_MATRIX(clip);
     float t;
-    clip[ 0] = camera->model_view_matrix[ 0] * camera->projection_matrix[ 0] + camera->model_view_matrix[ 1] * camera->projection_matrix[ 4] + camera->model_view_matrix[ 2] * camera->projection_matrix[ 8] +    camera->model_view_matrix[ 3] * camera->projection_matrix[12];
-    clip[ 1] = camera->model_view_matrix[ 0] * camera->projection_matrix[ 1] + camera->model_view_matrix[ 1] * camera->projection_matrix[ 5] + camera->model_view_matrix[ 2] * camera->projection_matrix[ 9] +    camera->model_view_matrix[ 3] * camera->projection_matrix[13];
-    clip[ 2] = camera->model_view_matrix[ 0] * camera->projection_matrix[ 2] + camera->model_view_matrix[ 1] * camera->projection_matrix[ 6] + camera->model_view_matrix[ 2] * camera->projection_matrix[10] +    camera->model_view_matrix[ 3] * camera->projection_matrix[14];
-    clip[ 3] = camera->model_view_matrix[ 0] * camera->projection_matrix[ 3] + camera->model_view_matrix[ 1] * camera->projection_matrix[ 7] + camera->model_view_matrix[ 2] * camera->projection_matrix[11] +    camera->model_view_matrix[ 3] * camera->projection_matrix[15];
-    clip[ 4] = camera->model_view_matrix[ 4] * camera->projection_matrix[ 0] + camera->model_view_matrix[ 5] * camera->projection_matrix[ 4]    + camera->model_view_matrix[ 6] * camera->projection_matrix[ 8] + camera->model_view_matrix[ 7] * camera->projection_matrix[12];
-    clip[ 5] = camera->model_view_matrix[ 4] * camera->projection_matrix[ 1] + camera->model_view_matrix[ 5] * camera->projection_matrix[ 5] + camera->model_view_matrix[ 6] * camera->projection_matrix[ 9] +    camera->model_view_matrix[ 7] * camera->projection_matrix[13];
-    clip[ 6] = camera->model_view_matrix[ 4] * camera->projection_matrix[ 2] + camera->model_view_matrix[ 5] * camera->projection_matrix[ 6] + camera->model_view_matrix[ 6] * camera->projection_matrix[10] +    camera->model_view_matrix[ 7] * camera->projection_matrix[14];
-    clip[ 7] = camera->model_view_matrix[ 4] * camera->projection_matrix[ 3] + camera->model_view_matrix[ 5] * camera->projection_matrix[ 7] + camera->model_view_matrix[ 6] * camera->projection_matrix[11] +    camera->model_view_matrix[ 7] * camera->projection_matrix[15];
-    clip[ 8] = camera->model_view_matrix[ 8] * camera->projection_matrix[ 0] + camera->model_view_matrix[ 9] * camera->projection_matrix[ 4]    + camera->model_view_matrix[10] * camera->projection_matrix[ 8] + camera->model_view_matrix[11] * camera->projection_matrix[12];
-    clip[ 9] = camera->model_view_matrix[ 8] * camera->projection_matrix[ 1] + camera->model_view_matrix[ 9] * camera->projection_matrix[ 5] + camera->model_view_matrix[10] * camera->projection_matrix[ 9] +    camera->model_view_matrix[11] * camera->projection_matrix[13];
-    clip[10] = camera->model_view_matrix[ 8] * camera->projection_matrix[ 2] + camera->model_view_matrix[ 9] * camera->projection_matrix[ 6] + camera->model_view_matrix[10] * camera->projection_matrix[10] +    camera->model_view_matrix[11] * camera->projection_matrix[14];
-    clip[11] = camera->model_view_matrix[ 8] * camera->projection_matrix[ 3] + camera->model_view_matrix[ 9] * camera->projection_matrix[ 7] + camera->model_view_matrix[10] * camera->projection_matrix[11] +    camera->model_view_matrix[11] * camera->projection_matrix[15];
-    clip[12] = camera->model_view_matrix[12] * camera->projection_matrix[ 0] + camera->model_view_matrix[13] * camera->projection_matrix[ 4]    + camera->model_view_matrix[14] * camera->projection_matrix[ 8] + camera->model_view_matrix[15] * camera->projection_matrix[12];
-    clip[13] = camera->model_view_matrix[12] * camera->projection_matrix[ 1] + camera->model_view_matrix[13] * camera->projection_matrix[ 5] + camera->model_view_matrix[14] * camera->projection_matrix[ 9] +    camera->model_view_matrix[15] * camera->projection_matrix[13];
-    clip[14] = camera->model_view_matrix[12] * camera->projection_matrix[ 2] + camera->model_view_matrix[13] * camera->projection_matrix[ 6] + camera->model_view_matrix[14] * camera->projection_matrix[10] +    camera->model_view_matrix[15] * camera->projection_matrix[14];
-    clip[15] = camera->model_view_matrix[12] * camera->projection_matrix[ 3] + camera->model_view_matrix[13] * camera->projection_matrix[ 7] + camera->model_view_matrix[14] * camera->projection_matrix[11] +    camera->model_view_matrix[15] * camera->projection_matrix[15];
+    dupmx(clip, camera->model_view_matrix);
+    mulmx(clip, camera->projection_matrix);
     camera->frustum[0][0] = clip[ 3] - clip[ 0];
     camera->frustum[0][1] = clip[ 7] - clip[ 4];
     camera->frustum[0][2] = clip[11] - clip[ 8];
@@ -170,20 +175,32 @@ int camera_sphere_in_frustrum(Camera *camera, Number3D center, float radius) {
     return TRUE;
 }
 
+int camera_box_in_frustum(Camera *camera, Cube3D box) {
+    int p;
+    for (p=0; p<6; p++) {
+        // test the corner furthest along the plane normal
+        float x = camera->frustum[p][0] > 0.0f ? box.max.x : box.min.x;
+        float y = camera->frustum[p][1] > 0.0f ? box.max.y : box.min.y;
+        float z = camera->frustum[p][2] > 0.0f ? box.max.z : box.min.z;
+        if (camera->frustum[p][0]*x+camera->frustum[p][1]*y+camera->frustum[p][2]*z+camera->frustum[p][3] <= 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
 void camera_set_ortho(Camera *camera) {
+    ALIGNED_MATRIX(ortho);
+    orthmx(ortho, 0.0f, camera->screen_width, camera->screen_height, 0.0f, -1.0f, 1.0f);
     glMatrixMode(GL_PROJECTION);
-    glPushMatrix();
-    glLoadIdentity();
-    glOrtho(0.0f, camera->screen_width, camera->screen_height, 0.0f, -1.0f, 1.0f);
-    //gluOrtho2D(0.0f, camera->viewport_right, 0.0f, camera->viewport_bottom);
+    glLoadMatrixf(ortho);
     glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
-    glLoadIdentity();
+    matrix_push();
+    matrix_load_identity();
 }
 
 void camera_clear_ortho(Camera *camera) {
     glMatrixMode(GL_PROJECTION);
-    glPopMatrix();
+    glLoadMatrixf(camera->projection_matrix);
     glMatrixMode(GL_MODELVIEW);
-    glPopMatrix();
+    matrix_pop();
 }
@@ -7,6 +7,16 @@
 
 #include "types.h"
 
+// Camera placement captured for the render thread by scene_publish()
+typedef struct _CameraState {
+    Number3D position;
+    Number3D target;
+    Number3D up;
+} CameraState;
+
+// Read a placement field as the render thread should see it
+#define CAMERA_STATE(c, field) ((c)->state ? (c)->state->field : (c)->field)
+
 // Camera - camera position & projection
 typedef struct _Camera {
     float short_side_length;
@@ -22,10 +32,11 @@ typedef struct _Camera {
     float viewport_right;
     float viewport_bottom;
     float viewport_top;
-    float projection_matrix[16];
-    float model_view_matrix[16];
+    ALIGNED_MATRIX(projection_matrix);
+    ALIGNED_MATRIX(model_view_matrix);
     float frustum[6][4];
     int viewport[4];
+    const CameraState *state;   // published snapshot, render thread only
 } Camera;
 
 
@@ -36,7 +47,9 @@ void camera_update_view_frustum(Camera *camera);
 void camera_extract_frustum(Camera *camera);
 int camera_point_in_frustum(Camera *camera, Number3D point);
 int camera_sphere_in_frustrum(Camera *camera, Number3D center, float radius);
+int camera_box_in_frustum(Camera *camera, Cube3D box);
 Number3D camera_screen_coords(Camera *camera, Number3D point);
+float camera_projected_radius(Camera *camera, Number3D center, float radius);
 void camera_set_ortho(Camera *camera);
 void camera_clear_ortho(Camera *camera);
 
@@ -11,6 +11,8 @@
 #include <log/log.h>
 
 #include "gl.h"
+#include "glstate.h"
+#include "matrix.h"
 #include "effects.h"
 #include "objects.h"
 #include "math.h"
@@ -21,6 +23,7 @@ static void effect_init(Effect *effect, Camera *camera);
 static void effect_cleanup(Effect *effect);
 static void lensflare_update(Scene *scene, LensFlare *flare);
 static void lensflare_render(LensFlare *flare, EffectRenderLevel level);
+static void lensflare_publish(LensFlare *flare, LensFlareState *state);
 static void lensflare_render_element(LensFlare *flare, Texture *texture, float x, float y, float scale, float rotation, Color color);
 
 static void effect_init(Effect *effect, Camera *camera) {
@@ -30,12 +33,26 @@ static void effect_init(Effect *effect, Camera *camera) {
 static void effect_cleanup(Effect *effect) {
 }
 
+/* Keep an effect alive for a published scene state, see scene_publish().
+ * Destroying a held effect is put off until its last hold is released.
+ */
+void effect_hold(Effect *effect) {
+    effect->holds++;
+}
+
+void effect_release(Effect *effect) {
+    if (--effect->holds == 0 && effect->destroy_pending)
+        effect->destroy(effect);
+}
+
 LensFlare *lensflare_create(const char *resources, Camera *camera, Number3D light_position, float light_radius) {
     LensFlare *flare = calloc(1, sizeof(LensFlare));
     effect_init(EFFECT(flare), camera);
     EFFECT(flare)->update = (EffectUpdateFuncPtr)lensflare_update;
     EFFECT(flare)->render = (EffectRenderFuncPtr)lensflare_render;
     EFFECT(flare)->destroy = (EffectDestroyFuncPtr)lensflare_destroy;
+    EFFECT(flare)->publish = (EffectPublishFuncPtr)lensflare_publish;
+    EFFECT(flare)->state_size = sizeof(LensFlareState);
     flare->light_position = light_position;
     flare->light_radius = light_radius;
     flare->_streaks = texture_create(resources, "streaks.png", TRUE, FALSE);
@@ -45,6 +62,10 @@ LensFlare *lensflare_create(const char *resources, Camera *camera, Number3D ligh
 }
 
 void lensflare_destroy(LensFlare *flare) {
+    if (EFFECT(flare)->holds > 0) {
+        EFFECT(flare)->destroy_pending = TRUE;
+        return;
+    }
     effect_cleanup(EFFECT(flare));
     texture_destroy(flare->_streaks);
     texture_destroy(flare->_halo);
@@ -53,51 +74,56 @@ void lensflare_destroy(LensFlare *flare) {
 }
 
 static void lensflare_update(Scene *scene, LensFlare *flare) {
-    int occluded = flare->_occluded;
+    int occluded = flare->_state.occluded;
     Number3D pos = flare->light_position;
     add3d(&pos, EFFECT(flare)->camera->position);
     int visible = camera_sphere_in_frustrum(EFFECT(flare)->camera, pos, flare->light_radius);
     if (visible) {
         occluded = scene_point_occluded(scene, EFFECT(flare)->camera, pos);
         if (!occluded)
-            flare->_screen_position = camera_screen_coords(EFFECT(flare)->camera, pos);
+            flare->_state.screen_position = camera_screen_coords(EFFECT(flare)->camera, pos);
     }
-    //if (visible != flare->_visible)
+    //if (visible != flare->_state.visible)
     //    LOG("%s\n", visible? "light visible" : "light not visible");
-    //if (occluded != flare->_occluded)
+    //if (occluded != flare->_state.occluded)
     //    LOG("%s\n", occluded? "light occluded" : "light not occluded");
-    flare->_visible = visible;
-    flare->_occluded = occluded;
+    flare->_state.visible = visible;
+    flare->_state.occluded = occluded;
+}
+
+static void lensflare_publish(LensFlare *flare, LensFlareState *state) {
+    *state = flare->_state;
 }
 
 static void lensflare_render(LensFlare *flare, EffectRenderLevel level) {
+    const LensFlareState *state = EFFECT(flare)->state ? EFFECT(flare)->state : &flare->_state;
     switch(level) {
     case EF_BACKGROUND: {
         break; }
     case EF_SCENE: {
         break; }
     case EF_OVERLAY: {
-        if (flare->_visible && !flare->_occluded) {
-            glDisable(GL_LIGHTING);
-            glEnable(GL_COLOR_MATERIAL);
-            glDisableClientState(GL_NORMAL_ARRAY);
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-            glDisable(GL_DEPTH_TEST);
+        if (state->visible && !state->occluded) {
+            glstate_disable(GL_LIGHTING);
+            glstate_enable(GL_COLOR_MATERIAL);
+            glstate_disable_client(GL_NORMAL_ARRAY);
+            glstate_blend_func(GL_SRC_ALPHA, GL_ONE);
+            glstate_disable(GL_DEPTH_TEST);
             static Number2D vertices[4] = { {-0.5f, -0.5f}, {-0.5f, 0.5f}, {0.5f, -0.5f}, {0.5f, 0.5f} };
             static UV uvs[4]  = { {0.0f, 0.0f}, {0.0f, 1.0f}, {1.0f, 0.0f}, {1.0f, 1.0f} };
-            glEnableClientState(GL_VERTEX_ARRAY);
+            glstate_enable_client(GL_VERTEX_ARRAY);
             glVertexPointer(2, GL_FLOAT, 0, vertices);
-            glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+            glstate_enable_client(GL_TEXTURE_COORD_ARRAY);
             glTexCoordPointer(2, GL_FLOAT, 0, uvs);
             float cx = (float)EFFECT(flare)->camera->screen_width*0.5f;
             float cy = (float)EFFECT(flare)->camera->screen_height*0.5f;
-            float vx = cx-flare->_screen_position.x;
-            float vy = cy-flare->_screen_position.y;
+            float vx = cx-state->screen_position.x;
+            float vy = cy-state->screen_position.y;
             float len = sqrtf(SQR(vx)+SQR(vy));
             vx = vx/len;
             vy = vy/len;
-            float px = flare->_screen_position.x;
-            float py = flare->_screen_position.y;
+            float px = state->screen_position.x;
+            float py = state->screen_position.y;
             float s = (float)(EFFECT(flare)->camera->screen_width+EFFECT(flare)->camera->screen_height)/2.0f;
             lensflare_render_element(flare, flare->_streaks, px, py, s*0.9f, 0.0f, COLOR(255, 255, 225, 255));
             lensflare_render_element(flare, flare->_streaks, px, py, s*0.4f, 45.0f, COLOR(255, 255, 225, 255));
@@ -129,12 +155,12 @@ static void lensflare_render(LensFlare *flare, EffectRenderLevel level) {
 
 static void lensflare_render_element(LensFlare *flare, Texture *texture, float x, float y, float scale, float rotation, Color color) {
     texture_activate(texture);
-    glPushMatrix();
-    glTranslatef(x, y, 0.0f);
-    glScalef(scale, scale, 1.0f);
-    glRotatef(rotation, 0.0f, 0.0f, 1.0f);
+    matrix_push();
+    matrix_translate(x, y, 0.0f);
+    matrix_scale(scale, scale, 1.0f);
+    matrix_rotate(rotation, 0.0f, 0.0f, 1.0f);
     glColor4f(COLORFL(color));
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-    glPopMatrix();
+    matrix_pop();
     texture_deactivate(texture);
 }
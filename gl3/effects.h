@@ -25,6 +25,7 @@ struct _Scene;
 typedef void (*EffectUpdateFuncPtr)(struct _Scene *scene, struct _Effect *);
 typedef void (*EffectRenderFuncPtr)(struct _Effect *, EffectRenderLevel level);
 typedef void (*EffectDestroyFuncPtr)(struct _Effect *);
+typedef void (*EffectPublishFuncPtr)(struct _Effect *, void *state);
 
 // Effect Base Class
 typedef struct _Effect {
@@ -32,27 +33,32 @@ typedef struct _Effect {
     EffectUpdateFuncPtr update;
     EffectRenderFuncPtr render;
     EffectDestroyFuncPtr destroy;
+    EffectPublishFuncPtr publish;   // copy update results for the render thread
+    int state_size;
+    const void *state;              // published snapshot, render thread only
+    int holds;                      // published states that may still draw the effect
+    int destroy_pending;            // destroyed while held, freed with the last hold
 } Effect;
 
-typedef struct _EffectList {
-    Effect *effect;
-    struct _EffectList *next;
-    struct _EffectList *prev;
-} EffectList;
-
 // Lens Flare Effect
+typedef struct _LensFlareState {
+    int visible;
+    int occluded;
+    Number3D screen_position;
+} LensFlareState;
+
 typedef struct _LensFlare {
     Effect _base;
     Number3D light_position;
     float light_radius;
-    int _visible;
-    int _occluded;
-    Number3D _screen_position;
+    LensFlareState _state;
     Texture *_streaks;
     Texture *_halo;
     Texture *_glow;
 } LensFlare;
 
+void effect_hold(Effect *effect);
+void effect_release(Effect *effect);
 LensFlare *lensflare_create(const char *resources, Camera *camera, Number3D light_position, float light_radius);
 void lensflare_destroy(LensFlare *flare);
 
@@ -43,7 +43,7 @@ Font *font_create(const char *resources, const char *name) {
     sprintf(fname, "%s%s.fnt", resources, name);
     FILE *f = fopen(fname, "rb");
     if (f == NULL) {
-        LOGERR("could not open: %s errno = %d\n", f, errno);
+        LOGERR("could not open: %s errno = %d\n", fname, errno);
         return NULL;
     }
     unsigned char fileheader[5];
@@ -63,11 +63,11 @@ Font *font_create(const char *resources, const char *name) {
         case 1: // info block
         case 3: // page block
         case 5: // kerning pairs
-            LOG("skipping block type: %d size: %d\n", blocktype, blocksize);
+            LOGDEBUG("skipping block type: %d size: %d\n", blocktype, blocksize);
             fseek(f, blocksize, SEEK_CUR);
             break;
         case 2: { // common block
-            LOG("reading common block: size: %d (%d)\n", blocksize, sizeof(common_block));
+            LOGDEBUG("reading common block: size: %d (%d)\n", blocksize, (int)sizeof(common_block));
             common_block cb;
             fread(&cb, sizeof(common_block), 1, f);
             font->width = cb.scale_w;
@@ -75,7 +75,7 @@ Font *font_create(const char *resources, const char *name) {
             break; }
         case 4: { // chars
             int numchars = blocksize/sizeof(char_descriptor);
-            LOG("reading %d character descriptors\n", numchars);
+            LOGDEBUG("reading %d character descriptors\n", numchars);
             int i;
             char_descriptor chd;
             for (i=0; i<numchars; i++) {
@@ -22,6 +22,7 @@
 
     // Mac OSX
 #   else
+#       define SG3_BUFFER_OBJECTS 1
 #       include <OpenGL/OpenGL.h>
 #       include <OpenGL/gl.h>
 #       include <OpenGL/glu.h>
@@ -29,10 +30,28 @@
 
 // Linux
 #else
+#   define SG3_BUFFER_OBJECTS 1
+#   define GL_GLEXT_PROTOTYPES 1
 #   include <GL/gl.h>
 #   include <GL/glu.h>
 #endif
 
+// Buffer objects are only used where the headers expose them directly,
+// everything else (ES1, MinGW's GL 1.1) renders from client arrays
+#ifndef SG3_BUFFER_OBJECTS
+#define SG3_BUFFER_OBJECTS 0
+#endif
+
+// 32-bit element indices are core on desktop GL, ES1 only has them with
+// GL_OES_element_index_uint, which is checked at run time
+#ifndef SG3_INDEX_UINT
+#if SG3_OPENGLES
+#define SG3_INDEX_UINT 0
+#else
+#define SG3_INDEX_UINT 1
+#endif
+#endif
+
 #if SG3_OPENGLES
 #define glClearDepth glClearDepthf
 #define glDepthRange glDepthRangef
@@ -5,8 +5,18 @@
 #include "types.h"
 #include <log/log.h>
 #include "math.h"
+#include "glstate.h"
+#include "matrix.h"
+#include "alloc.h"
+#include "handles.h"
+#include "bvh.h"
+#include "scenegraph.h"
 #include "scene.h"
 #include "objects.h"
+#include "mesh.h"
+#include "meshopt.h"
+#include "simplify.h"
+#include "renderqueue.h"
 #include "overlay.h"
 #include "texture.h"
 #include "util.h"
@@ -0,0 +1,223 @@
+/* glstate.c - GL state shadowing
+ * Drops redundant fixed-function state changes
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <string.h>
+#include "glstate.h"
+
+#define UNKNOWN -1
+
+// Capabilities tracked by the shadow, everything else goes straight to GL
+enum {
+    CAP_LIGHTING,
+    CAP_COLOR_MATERIAL,
+    CAP_CULL_FACE,
+    CAP_DEPTH_TEST,
+    CAP_BLEND,
+    CAP_TEXTURE_2D,
+    CAP_FOG,
+    CAP_LINE_SMOOTH,
+    CAP_LIGHT0,
+    CAP_COUNT = CAP_LIGHT0+8
+};
+
+enum {
+    ARRAY_VERTEX,
+    ARRAY_NORMAL,
+    ARRAY_TEXTURE_COORD,
+    ARRAY_COLOR,
+    ARRAY_COUNT
+};
+
+// Render thread only - GL state is per context
+static struct {
+    int caps[CAP_COUNT];
+    int arrays[ARRAY_COUNT];
+    GLenum blend_src;
+    GLenum blend_dst;
+    int blend_valid;
+    int shade_model;
+    GLuint texture;
+    int texture_valid;
+    int env_mode;
+    float offset_u;
+    float offset_v;
+    int offset_valid;
+    GLStateStats frame;
+    GLStateStats last;
+} shadow;
+
+static int initialized = FALSE;
+
+static int cap_slot(GLenum cap) {
+    switch (cap) {
+    case GL_LIGHTING: return CAP_LIGHTING;
+    case GL_COLOR_MATERIAL: return CAP_COLOR_MATERIAL;
+    case GL_CULL_FACE: return CAP_CULL_FACE;
+    case GL_DEPTH_TEST: return CAP_DEPTH_TEST;
+    case GL_BLEND: return CAP_BLEND;
+    case GL_TEXTURE_2D: return CAP_TEXTURE_2D;
+    case GL_FOG: return CAP_FOG;
+    case GL_LINE_SMOOTH: return CAP_LINE_SMOOTH;
+    }
+    if (cap >= GL_LIGHT0 && cap < GL_LIGHT0+8)
+        return CAP_LIGHT0+(cap-GL_LIGHT0);
+    return -1;
+}
+
+static int array_slot(GLenum array) {
+    switch (array) {
+    case GL_VERTEX_ARRAY: return ARRAY_VERTEX;
+    case GL_NORMAL_ARRAY: return ARRAY_NORMAL;
+    case GL_TEXTURE_COORD_ARRAY: return ARRAY_TEXTURE_COORD;
+    case GL_COLOR_ARRAY: return ARRAY_COLOR;
+    }
+    return -1;
+}
+
+/* Forget everything the shadow knows. Call after GL state has been changed
+ * behind its back (texture loading, third-party rendering).
+ */
+void glstate_reset() {
+    int i;
+    for (i=0; i<CAP_COUNT; i++)
+        shadow.caps[i] = UNKNOWN;
+    for (i=0; i<ARRAY_COUNT; i++)
+        shadow.arrays[i] = UNKNOWN;
+    shadow.blend_valid = FALSE;
+    shadow.shade_model = UNKNOWN;
+    shadow.texture_valid = FALSE;
+    shadow.env_mode = UNKNOWN;
+    shadow.offset_valid = FALSE;
+    initialized = TRUE;
+}
+
+/* Start counting a new frame; the previous frame's counts are kept for
+ * glstate_frame_stats().
+ */
+void glstate_begin_frame() {
+    if (!initialized)
+        glstate_reset();
+    shadow.last = shadow.frame;
+    memset(&shadow.frame, 0, sizeof(GLStateStats));
+}
+
+GLStateStats glstate_frame_stats() {
+    return shadow.last;
+}
+
+void glstate_set(GLenum cap, int enabled) {
+    int slot = cap_slot(cap);
+    enabled = enabled ? 1 : 0;
+    if (!initialized)
+        glstate_reset();
+    if (slot >= 0) {
+        if (shadow.caps[slot] == enabled) {
+            shadow.frame.elided++;
+            return;
+        }
+        shadow.caps[slot] = enabled;
+    }
+    enabled? glEnable(cap) : glDisable(cap);
+    shadow.frame.issued++;
+}
+
+void glstate_enable(GLenum cap) {
+    glstate_set(cap, TRUE);
+}
+
+void glstate_disable(GLenum cap) {
+    glstate_set(cap, FALSE);
+}
+
+static void glstate_set_client(GLenum array, int enabled) {
+    int slot = array_slot(array);
+    if (!initialized)
+        glstate_reset();
+    if (slot >= 0) {
+        if (shadow.arrays[slot] == enabled) {
+            shadow.frame.elided++;
+            return;
+        }
+        shadow.arrays[slot] = enabled;
+    }
+    enabled? glEnableClientState(array) : glDisableClientState(array);
+    shadow.frame.issued++;
+}
+
+void glstate_enable_client(GLenum array) {
+    glstate_set_client(array, 1);
+}
+
+void glstate_disable_client(GLenum array) {
+    glstate_set_client(array, 0);
+}
+
+void glstate_blend_func(GLenum src, GLenum dst) {
+    if (shadow.blend_valid && shadow.blend_src == src && shadow.blend_dst == dst) {
+        shadow.frame.elided++;
+        return;
+    }
+    glBlendFunc(src, dst);
+    shadow.blend_src = src;
+    shadow.blend_dst = dst;
+    shadow.blend_valid = TRUE;
+    shadow.frame.issued++;
+}
+
+void glstate_shade_model(GLenum mode) {
+    if (shadow.shade_model == (int)mode) {
+        shadow.frame.elided++;
+        return;
+    }
+    glShadeModel(mode);
+    shadow.shade_model = mode;
+    shadow.frame.issued++;
+}
+
+void glstate_bind_texture(GLuint id) {
+    if (shadow.texture_valid && shadow.texture == id) {
+        shadow.frame.elided++;
+        return;
+    }
+    glBindTexture(GL_TEXTURE_2D, id);
+    shadow.texture = id;
+    shadow.texture_valid = TRUE;
+    shadow.frame.issued++;
+}
+
+// Deleting a bound texture rebinds 0
+void glstate_forget_texture(GLuint id) {
+    if (shadow.texture_valid && shadow.texture == id)
+        shadow.texture = 0;
+}
+
+void glstate_tex_env_mode(GLint mode) {
+    if (shadow.env_mode == mode) {
+        shadow.frame.elided++;
+        return;
+    }
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, mode);
+    shadow.env_mode = mode;
+    shadow.frame.issued++;
+}
+
+/* Texture matrix translation for scrolling textures, kept so an unscrolled
+ * texture drawn after a scrolled one gets the identity back.
+ */
+void glstate_texture_offset(float u, float v) {
+    if (shadow.offset_valid && shadow.offset_u == u && shadow.offset_v == v) {
+        shadow.frame.elided++;
+        return;
+    }
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    if (u != 0.0f || v != 0.0f)
+        glTranslatef(u, v, 0.0f);
+    glMatrixMode(GL_MODELVIEW);
+    shadow.offset_u = u;
+    shadow.offset_v = v;
+    shadow.offset_valid = TRUE;
+    shadow.frame.issued++;
+}
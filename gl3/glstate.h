@@ -0,0 +1,33 @@
+/* glstate.h - GL state shadowing
+ * Drops redundant fixed-function state changes
+ * Copyright 2012 Keath Milligan
+ */
+
+#ifndef GLSTATE_H_
+#define GLSTATE_H_
+
+#include "gl.h"
+#include "types.h"
+
+// GL calls made and skipped through this module
+typedef struct _GLStateStats {
+    int issued;
+    int elided;
+} GLStateStats;
+
+void glstate_reset();
+void glstate_begin_frame();
+GLStateStats glstate_frame_stats();
+void glstate_enable(GLenum cap);
+void glstate_disable(GLenum cap);
+void glstate_set(GLenum cap, int enabled);
+void glstate_enable_client(GLenum array);
+void glstate_disable_client(GLenum array);
+void glstate_blend_func(GLenum src, GLenum dst);
+void glstate_shade_model(GLenum mode);
+void glstate_bind_texture(GLuint id);
+void glstate_forget_texture(GLuint id);
+void glstate_tex_env_mode(GLint mode);
+void glstate_texture_offset(float u, float v);
+
+#endif /* GLSTATE_H_ */
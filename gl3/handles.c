@@ -0,0 +1,117 @@
+/* handles.c - handle arrays
+ * Dense arrays of pointers addressed through generation-checked handles
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <log/log.h>
+#include "handles.h"
+
+void handles_init(HandleArray *array) {
+    memset(array, 0, sizeof(HandleArray));
+    array->free_slot = -1;
+}
+
+/* Free the arrays, not the items.
+ */
+void handles_release(HandleArray *array) {
+    if (array->items) free(array->items);
+    if (array->item_slots) free(array->item_slots);
+    if (array->slot_items) free(array->slot_items);
+    if (array->slot_generations) free(array->slot_generations);
+    handles_init(array);
+}
+
+/* Append an item, reusing a free slot for its handle if there is one.
+ * Returns HANDLE_NONE once every slot index is taken.
+ */
+Handle handles_add(HandleArray *array, void *item) {
+    int slot;
+    if (array->free_slot < 0 && array->slot_count > (int)HANDLE_INDEX_MASK) {
+        LOGERR("handle array full\n");
+        return HANDLE_NONE;
+    }
+    if (array->count == array->capacity) {
+        array->capacity = array->capacity ? array->capacity*2 : HANDLES_INITIAL_SIZE;
+        array->items = realloc(array->items, sizeof(void*)*array->capacity);
+        array->item_slots = realloc(array->item_slots, sizeof(int)*array->capacity);
+        array->slot_items = realloc(array->slot_items, sizeof(int)*array->capacity);
+        array->slot_generations = realloc(array->slot_generations, sizeof(unsigned int)*array->capacity);
+    }
+    if (array->free_slot >= 0) {
+        slot = array->free_slot;
+        array->free_slot = array->slot_items[slot];
+    } else {
+        // with no slot free, every slot holds an item, so there is room
+        slot = array->slot_count++;
+        array->slot_generations[slot] = 1;
+    }
+    array->items[array->count] = item;
+    array->item_slots[array->count] = slot;
+    array->slot_items[slot] = array->count++;
+    return (array->slot_generations[slot]<<HANDLE_INDEX_BITS)|slot;
+}
+
+static inline Handle handles_handle(const HandleArray *array, int i) {
+    int slot = array->item_slots[i];
+    return (array->slot_generations[slot]<<HANDLE_INDEX_BITS)|slot;
+}
+
+static inline int handles_slot(const HandleArray *array, Handle handle) {
+    int slot = handle&HANDLE_INDEX_MASK;
+    if (handle == HANDLE_NONE || slot >= array->slot_count ||
+        array->slot_generations[slot] != handle>>HANDLE_INDEX_BITS)
+        return -1;
+    return slot;
+}
+
+/* The item a handle names, or NULL if it has been removed.
+ */
+void *handles_get(const HandleArray *array, Handle handle) {
+    int slot = handles_slot(array, handle);
+    return slot < 0 ? NULL : array->items[array->slot_items[slot]];
+}
+
+/* Remove the item a handle names, moving the last item into its place.
+ * Returns the item, or NULL if the handle was stale.
+ */
+void *handles_remove(HandleArray *array, Handle handle) {
+    int slot = handles_slot(array, handle);
+    int i, last;
+    void *item;
+    if (slot < 0)
+        return NULL;
+    i = array->slot_items[slot];
+    item = array->items[i];
+    last = --array->count;
+    if (i != last) {
+        array->items[i] = array->items[last];
+        array->item_slots[i] = array->item_slots[last];
+        array->slot_items[array->item_slots[i]] = i;
+    }
+    array->slot_generations[slot] = (array->slot_generations[slot]+1)&HANDLE_GENERATION_MASK;
+    if (array->slot_generations[slot] == 0)
+        array->slot_generations[slot] = 1;
+    array->slot_items[slot] = array->free_slot;
+    array->free_slot = slot;
+    return item;
+}
+
+/* Handle of an item, found by walking the array.
+ */
+Handle handles_find(const HandleArray *array, const void *item) {
+    int i;
+    for (i=0; i<array->count; i++) {
+        if (array->items[i] == item)
+            return handles_handle(array, i);
+    }
+    return HANDLE_NONE;
+}
+
+/* Remove every item, leaving all outstanding handles stale.
+ */
+void handles_clear(HandleArray *array) {
+    while (array->count > 0)
+        handles_remove(array, handles_handle(array, array->count-1));
+}
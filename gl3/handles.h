@@ -0,0 +1,46 @@
+/* handles.h - handle arrays
+ * Dense arrays of pointers addressed through generation-checked handles
+ * Copyright 2012 Keath Milligan
+ */
+
+#ifndef HANDLES_H_
+#define HANDLES_H_
+
+#include "types.h"
+
+#define HANDLES_INITIAL_SIZE 16
+#define HANDLE_INDEX_BITS 20
+#define HANDLE_INDEX_MASK ((1u<<HANDLE_INDEX_BITS)-1)
+#define HANDLE_GENERATION_MASK ((1u<<(32-HANDLE_INDEX_BITS))-1)
+#define HANDLE_NONE 0
+
+// Slot index in the low bits, the slot's generation above. Generations
+// start at 1, so no valid handle is HANDLE_NONE.
+typedef unsigned int Handle;
+
+// Items are packed at the front of items for linear walks, in no
+// particular order: removing one moves the last into its place. Handles
+// name slots that track where their item has moved; a slot's generation
+// is bumped when its item is removed, so stale handles stop resolving.
+typedef struct _HandleArray {
+    void **items;
+    int *item_slots;                // slot of each item
+    int *slot_items;                // item index of each used slot, next free slot otherwise
+    unsigned int *slot_generations;
+    int count;
+    int slot_count;
+    int capacity;
+    int free_slot;                  // -1 if every slot is in use
+} HandleArray;
+
+#define HANDLES_ITEM(a, type, i) ((type*)(a).items[i])
+
+void handles_init(HandleArray *array);
+void handles_release(HandleArray *array);
+Handle handles_add(HandleArray *array, void *item);
+void *handles_get(const HandleArray *array, Handle handle);
+void *handles_remove(HandleArray *array, Handle handle);
+Handle handles_find(const HandleArray *array, const void *item);
+void handles_clear(HandleArray *array);
+
+#endif /* HANDLES_H_ */
@@ -68,13 +68,30 @@ void rotz3d(Number3D *n, float angle) {
     n->y = (t.x * sinRY) + (t.y * cosRY);
 }
 
-void trmx3d(Number3D *n, float *m) {
+void trmx3d(Number3D *n, const float *m) {
     Number3D v = *n;
     n->x = m[M00]*v.x+m[M01]*v.y+m[M02]*v.z;
     n->y = m[M10]*v.x+m[M11]*v.y+m[M12]*v.z;
     n->z = m[M20]*v.x+m[M21]*v.y+m[M22]*v.z;
 }
 
+/* Transform a point, or a direction without the translation, by a matrix
+ * laid out for glLoadMatrixf.
+ */
+void trpt3d(Number3D *n, const float *m) {
+    Number3D v = *n;
+    n->x = m[M00]*v.x+m[M10]*v.y+m[M20]*v.z+m[M30];
+    n->y = m[M01]*v.x+m[M11]*v.y+m[M21]*v.z+m[M31];
+    n->z = m[M02]*v.x+m[M12]*v.y+m[M22]*v.z+m[M32];
+}
+
+void trdir3d(Number3D *n, const float *m) {
+    Number3D v = *n;
+    n->x = m[M00]*v.x+m[M10]*v.y+m[M20]*v.z;
+    n->y = m[M01]*v.x+m[M11]*v.y+m[M21]*v.z;
+    n->z = m[M02]*v.x+m[M12]*v.y+m[M22]*v.z;
+}
+
 int isxtri3d(Line3D ray, Triangle3D plane, Number3D *where) {
 /*  Number3D e1 = vec3d(plane.a, plane.b);
     Number3D e2 = vec3d(plane.a, plane.c);
@@ -173,6 +190,52 @@ int isxcube3d(Line3D ray, Cube3D cube, Number3D *where) {
     return TRUE;
 }
 
+/* Ray (origin p0, direction p1) against a two-sided triangle. On a hit
+ * returns TRUE with the distance along the ray, in units of p1, in *t.
+ */
+int raytri3d(Line3D ray, Number3D a, Number3D b, Number3D c, float *t) {
+    Number3D e1 = vec3d(a, b);
+    Number3D e2 = vec3d(a, c);
+    Number3D s1 = cross3d(ray.p1, e2);
+    float d = dot3d(e1, s1);
+    if (fabsf(d) < FLT_EPSILON)
+        return FALSE;
+    d = 1.0f/d;
+    Number3D dist = vec3d(a, ray.p0);
+    float u = dot3d(dist, s1)*d;
+    if (u < 0.0f || u > 1.0f)
+        return FALSE;
+    Number3D s2 = cross3d(dist, e1);
+    float v = dot3d(ray.p1, s2)*d;
+    if (v < 0.0f || u+v > 1.0f)
+        return FALSE;
+    *t = dot3d(e2, s2)*d;
+    if (*t < 0.0f)
+        return FALSE;
+    return TRUE;
+}
+
+/* Ray against a box, returning the entry and exit distances along the ray.
+ * The caller's tmin/tmax bound the part of the ray that is tested.
+ */
+int raycube3d(Line3D ray, Cube3D cube, float *tmin, float *tmax) {
+    int i;
+    for (i=0; i<3; i++) {
+        if (fabsf(FA(ray.p1)[i]) < FLT_EPSILON) {
+            if (FA(ray.p0)[i] < FA(cube.min)[i] || FA(ray.p0)[i] > FA(cube.max)[i]) return FALSE;
+        } else {
+            float ood = 1.0f/FA(ray.p1)[i];
+            float t1 = (FA(cube.min)[i]-FA(ray.p0)[i])*ood;
+            float t2 = (FA(cube.max)[i]-FA(ray.p0)[i])*ood;
+            if (t1 > t2) SWAPF(t1, t2);
+            if (t1 > *tmin) *tmin = t1;
+            if (t2 < *tmax) *tmax = t2;
+            if (*tmin > *tmax) return FALSE;
+        }
+    }
+    return TRUE;
+}
+
 void rotmx(float *m, Number3D vector, float angle) {
     float c = cosf(angle);
     float s = sinf(angle);
@@ -209,6 +272,45 @@ void ortmx(float *m, Number3D euler) {
     m[10] = -sh*sr*sp + ch*cp;
 }
 
+/* Projection and view matrices laid out as glFrustum, glOrtho and
+ * gluLookAt build them, for loading with glLoadMatrixf.
+ */
+void frustmx(float *m, float left, float right, float bottom, float top, float n, float f) {
+    memset(m, 0, sizeof(IDMAT));
+    m[0] = 2.0f*n/(right-left);
+    m[5] = 2.0f*n/(top-bottom);
+    m[8] = (right+left)/(right-left);
+    m[9] = (top+bottom)/(top-bottom);
+    m[10] = -(f+n)/(f-n);
+    m[11] = -1.0f;
+    m[14] = -2.0f*f*n/(f-n);
+}
+
+void orthmx(float *m, float left, float right, float bottom, float top, float n, float f) {
+    idmx(m);
+    m[0] = 2.0f/(right-left);
+    m[5] = 2.0f/(top-bottom);
+    m[10] = -2.0f/(f-n);
+    m[12] = -(right+left)/(right-left);
+    m[13] = -(top+bottom)/(top-bottom);
+    m[14] = -(f+n)/(f-n);
+}
+
+void lookmx(float *m, Number3D eye, Number3D target, Number3D up) {
+    Number3D z = nvec3d(target, eye);
+    Number3D x = cross3d(up, z);
+    norm3d(&x);
+    Number3D y = cross3d(z, x);
+    m[0] = x.x; m[4] = x.y; m[8] = x.z;
+    m[1] = y.x; m[5] = y.y; m[9] = y.z;
+    m[2] = z.x; m[6] = z.y; m[10] = z.z;
+    m[3] = m[7] = m[11] = 0.0f;
+    m[12] = -dot3d(x, eye);
+    m[13] = -dot3d(y, eye);
+    m[14] = -dot3d(z, eye);
+    m[15] = 1.0f;
+}
+
 float detmx(const float *m) {
     return    (m[M00] * m[M11] - m[M10] * m[M01])
             * (m[M22] * m[M33] - m[M32] * m[M23])
@@ -224,7 +326,7 @@ float detmx(const float *m) {
             * (m[M02] * m[M13] - m[M12] * m[M03]);
 }
 
-void mulmx(float *m, const float *v) {
+void mulmx_scalar(float *m, const float *v) {
     float t[16];
     dupmx(t, m);
 
@@ -249,7 +351,7 @@ void mulmx(float *m, const float *v) {
     m[M33] = (t[M30] * v[M03]) + (t[M31] * v[M13]) + (t[M32] * v[M23]) + (t[M33] * v[M33]);
 }
 
-void invmx(float *m) {
+void invmx_scalar(float *m) {
     float d = detmx(m);
     if (close_enough(d, 0.0f)) {
         idmx(m);
@@ -279,6 +381,17 @@ void invmx(float *m) {
     }
 }
 
+#if !SG3_SIMD
+// without a SIMD backend the reference code is the implementation
+void mulmx(float *m, const float *v) {
+    mulmx_scalar(m, v);
+}
+
+void invmx(float *m) {
+    invmx_scalar(m);
+}
+#endif
+
 void mulq(Quaternion *q, Quaternion v) {
     Quaternion t = *q;
     q->w = (t.w*v.w)-(t.x*v.x)-(t.y*v.y)-(t.z*v.z);
@@ -24,6 +24,17 @@
 #define EULER3D(x, y, z) ((Number3D){DEG2RAD((float)x), DEG2RAD((float)y), DEG2RAD((float)z)})
 #define SWAPF(a, b) { float _t = a; a = b; b = _t; }
 
+// SIMD backend for the matrix kernels, picked at compile time from the
+// target. Define SG3_NO_SIMD to build the scalar reference code instead.
+#ifndef SG3_NO_SIMD
+#if defined(__SSE__) || defined(_M_X64)
+#define SG3_SIMD_SSE 1
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define SG3_SIMD_NEON 1
+#endif
+#endif
+#define SG3_SIMD (SG3_SIMD_SSE || SG3_SIMD_NEON)
+
 // Matrix index values
 #define M00 0
 #define M01 1
@@ -94,7 +105,9 @@ static inline void norm3d(Number3D *n) { float mod = len3d(*n); if (mod != 0.0f
 void rotx3d(Number3D *n, float angle);
 void roty3d(Number3D *n, float angle);
 void rotz3d(Number3D *n, float angle);
-void trmx3d(Number3D *n, float *m);
+void trmx3d(Number3D *n, const float *m);
+void trpt3d(Number3D *n, const float *m);
+void trdir3d(Number3D *n, const float *m);
 static inline Number3D cross3d(Number3D v, Number3D w) { return (Number3D){(v.y*w.z)-(v.z*w.y), (v.z*w.x)-(v.x*w.z), (v.x*w.y)-(v.y*w.x)}; }
 static inline float dot3d(Number3D v, Number3D w) { return (v.x*w.x+v.y*w.y+v.z*w.z); }
 static inline float angle3d(Number3D v, Number3D w) { return acosf(dot3d(v, w)); }
@@ -103,17 +116,53 @@ static inline Number3D nvec3d(Number3D p0, Number3D p1) { Number3D v = p1; sub3d
 int isxtri3d(Line3D ray, Triangle3D plane, Number3D *where);
 int isxquad3d(Line3D ray, Quad3D plane, Number3D *where);
 int isxcube3d(Line3D ray, Cube3D cube, Number3D *where);
+int raytri3d(Line3D ray, Number3D a, Number3D b, Number3D c, float *t);
+int raycube3d(Line3D ray, Cube3D cube, float *tmin, float *tmax);
+
+// Batched 3D functions over count vectors, either packed Number3D arrays
+// (...3dv) or structure-of-arrays streams (...3ds). Batches of at least
+// BATCH_THREAD_MIN vectors are split across the threads set with
+// set_batch_threads(). Under about 16 vectors the per-vector functions
+// are as fast.
+#define BATCH_THREAD_MIN 65536
+
+typedef struct _Stream3D {
+    float *x;
+    float *y;
+    float *z;
+} Stream3D;
+
+void set_batch_threads(int threads);
+void trmx3dv(Number3D *n, int count, const float *m);
+void trpt3dv(Number3D *out, const Number3D *in, int count, const float *m);
+void norm3dv(Number3D *n, int count);
+void dot3dv(float *out, const Number3D *v, const Number3D *w, int count);
+void cross3dv(Number3D *out, const Number3D *v, const Number3D *w, int count);
+void bounds3dv(const Number3D *n, int count, Number3D *min, Number3D *max);
+void trmx3ds(Stream3D n, int count, const float *m);
+void trpt3ds(Stream3D out, Stream3D in, int count, const float *m);
+void norm3ds(Stream3D n, int count);
+void dot3ds(float *out, Stream3D v, Stream3D w, int count);
+void cross3ds(Stream3D out, Stream3D v, Stream3D w, int count);
+void bounds3ds(Stream3D n, int count, Number3D *min, Number3D *max);
 
 // Matrix functions
 static inline void dupmx(float *m, const float *o) { memcpy((void*)m, (void*)o, sizeof(IDMAT)); }
 static inline void idmx(float *m) { dupmx(m, IDMAT); }
 void rotmx(float *m, Number3D vector, float angle);
 void ortmx(float *m, Number3D euler);
+void frustmx(float *m, float left, float right, float bottom, float top, float n, float f);
+void orthmx(float *m, float left, float right, float bottom, float top, float n, float f);
+void lookmx(float *m, Number3D eye, Number3D target, Number3D up);
 float detmx(const float *m);
 void mulmx(float *m, const float *v);
 void invmx(float *m);
 Quaternion quatmx(const float *m);
 
+// Scalar reference versions of the SIMD kernels
+void mulmx_scalar(float *m, const float *v);
+void invmx_scalar(float *m);
+
 // Quaternion functions
 static inline void addq(Quaternion *q, Quaternion v) { q->w += v.w; q->x += v.x; q->y += v.y; q->z += v.z; }
 static inline void subq(Quaternion *q, Quaternion v) { q->w -= v.w; q->x -= v.x; q->y -= v.y; q->z -= v.z; }
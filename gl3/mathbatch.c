@@ -0,0 +1,542 @@
+/* mathbatch.c - batched math
+ * 3D vector functions over whole arrays and structure-of-arrays streams,
+ * four vectors at a time with SSE and split across threads when large
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <log/log.h>
+#include "math.h"
+#if SG3_SIMD_SSE
+#include <xmmintrin.h>
+#endif
+
+#define BATCH_MAX_THREADS 16
+
+typedef struct _BatchJob BatchJob;
+typedef void (*BatchKernelFPtr)(BatchJob *job, int first, int last);
+
+// One batched call. Each thread works on its own copy over first to last.
+struct _BatchJob {
+    BatchKernelFPtr kernel;
+    float c[12];            // rows of the affine transform, x' = c0*x+c1*y+c2*z+c3
+    const Number3D *v;
+    const Number3D *w;
+    Number3D *out;
+    float *scalars;
+    Stream3D sv;
+    Stream3D sw;
+    Stream3D sout;
+    Number3D min;
+    Number3D max;
+    int first;
+    int last;
+};
+
+// Worker threads kept between batches. A batch is handed over by
+// bumping generation; each worker runs its part and the last to finish
+// signals done. One batch at a time uses the pool.
+static struct {
+    pthread_mutex_t lock;           // held by the caller using the pool
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_t threads[BATCH_MAX_THREADS];
+    int seen[BATCH_MAX_THREADS];    // the last generation each worker took
+    int thread_count;               // workers started, the caller not included
+    BatchJob *parts;
+    int part_count;
+    int pending;
+    int generation;
+    int quit;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int batch_threads = 1;
+
+static void *batch_worker(void *data) {
+    int index = (int)(long)data;
+    pthread_mutex_lock(&pool.mutex);
+    for (;;) {
+        while (pool.generation == pool.seen[index] && !pool.quit)
+            pthread_cond_wait(&pool.start, &pool.mutex);
+        if (pool.quit)
+            break;
+        pool.seen[index] = pool.generation;
+        if (index < pool.part_count) {
+            BatchJob *part = &pool.parts[index];
+            pthread_mutex_unlock(&pool.mutex);
+            part->kernel(part, part->first, part->last);
+            pthread_mutex_lock(&pool.mutex);
+            if (--pool.pending == 0)
+                pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return NULL;
+}
+
+/* Stop every worker. Called with pool.lock held.
+ */
+static void pool_stop() {
+    int i;
+    pthread_mutex_lock(&pool.mutex);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.mutex);
+    for (i=1; i<=pool.thread_count; i++)
+        pthread_join(pool.threads[i], NULL);
+    pool.thread_count = 0;
+    pool.quit = 0;
+}
+
+/* Start workers until there are threads-1 of them; returns how many
+ * threads, the caller included, the pool can give a batch. Called with
+ * pool.lock held.
+ */
+static int pool_start(int threads) {
+    while (pool.thread_count < threads-1) {
+        int index = pool.thread_count+1;
+        pool.seen[index] = pool.generation;
+        if (pthread_create(&pool.threads[index], NULL, batch_worker, (void*)(long)index) != 0) {
+            LOGERR("could not start batch thread\n");
+            break;
+        }
+        pool.thread_count++;
+    }
+    return pool.thread_count+1;
+}
+
+/* Set how many threads large batches are split across, counting the
+ * calling thread. The default of 1 keeps every batch on the caller;
+ * going back to 1 stops the pool's threads.
+ */
+void set_batch_threads(int threads) {
+    threads = threads < 1 ? 1 : threads > BATCH_MAX_THREADS ? BATCH_MAX_THREADS : threads;
+    pthread_mutex_lock(&pool.lock);
+    if (pool.thread_count > threads-1)
+        pool_stop();
+    batch_threads = threads;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Run job over count vectors. Batches under BATCH_THREAD_MIN, or that
+ * find the pool busy, run straight on the caller and return 0. Others
+ * are cut into runs of whole groups of four, one per thread, the caller
+ * taking the first; parts receives each thread's copy of the job and
+ * the count of them is returned.
+ */
+static int batch_run(BatchJob *job, int count, BatchJob *parts) {
+    int n, i;
+    if (count < BATCH_THREAD_MIN || batch_threads == 1 || pthread_mutex_trylock(&pool.lock) != 0) {
+        job->kernel(job, 0, count);
+        return 0;
+    }
+    n = pool_start(batch_threads);
+    for (i=0; i<n; i++) {
+        parts[i] = *job;
+        parts[i].first = i == 0 ? 0 : (int)((long long)count*i/n)&~3;
+        parts[i].last = i == n-1 ? count : (int)((long long)count*(i+1)/n)&~3;
+    }
+    pthread_mutex_lock(&pool.mutex);
+    pool.parts = parts;
+    pool.part_count = n;
+    pool.pending = n-1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.mutex);
+    parts[0].kernel(&parts[0], parts[0].first, parts[0].last);
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.pending > 0)
+        pthread_cond_wait(&pool.done, &pool.mutex);
+    pthread_mutex_unlock(&pool.mutex);
+    pthread_mutex_unlock(&pool.lock);
+    return n;
+}
+
+static void affine_rows(float *c, const float *m, int translate) {
+    if (translate) {
+        // GL order: columns of m are the axes, m[12..14] the translation
+        float t[12] = { m[0], m[4], m[8], m[12], m[1], m[5], m[9], m[13], m[2], m[6], m[10], m[14] };
+        memcpy(c, t, sizeof(t));
+    } else {
+        // as trmx3d
+        float t[12] = { m[M00], m[M01], m[M02], 0.0f, m[M10], m[M11], m[M12], 0.0f, m[M20], m[M21], m[M22], 0.0f };
+        memcpy(c, t, sizeof(t));
+    }
+}
+
+static inline Number3D affine1(const float *c, Number3D v) {
+    return (Number3D){ c[0]*v.x+c[1]*v.y+c[2]*v.z+c[3],
+                       c[4]*v.x+c[5]*v.y+c[6]*v.z+c[7],
+                       c[8]*v.x+c[9]*v.y+c[10]*v.z+c[11] };
+}
+
+static inline float norm_scale(float x, float y, float z) {
+    float l = x*x+y*y+z*z;
+    return l > 0.0f ? 1.0f/sqrtf(l) : 0.0f;
+}
+
+#if SG3_SIMD_SSE
+#define SHUFFLE(a, b, x, y, z, w) _mm_shuffle_ps(a, b, _MM_SHUFFLE(w, z, y, x))
+
+/* Four packed Number3Ds to and from one register per component.
+ */
+static inline void load4(const Number3D *p, __m128 *x, __m128 *y, __m128 *z) {
+    const float *f = (const float*)p;
+    __m128 a = _mm_loadu_ps(f), b = _mm_loadu_ps(f+4), c = _mm_loadu_ps(f+8);
+    *x = SHUFFLE(a, SHUFFLE(b, c, 2, 2, 1, 1), 0, 3, 0, 2);
+    *y = SHUFFLE(SHUFFLE(a, b, 1, 1, 0, 0), SHUFFLE(b, c, 3, 3, 2, 2), 0, 2, 0, 2);
+    *z = SHUFFLE(SHUFFLE(a, b, 2, 2, 1, 1), SHUFFLE(c, c, 0, 0, 3, 3), 0, 2, 0, 2);
+}
+
+static inline void store4(Number3D *p, __m128 x, __m128 y, __m128 z) {
+    float *f = (float*)p;
+    _mm_storeu_ps(f, SHUFFLE(SHUFFLE(x, y, 0, 0, 0, 0), SHUFFLE(z, x, 0, 0, 1, 1), 0, 2, 0, 2));
+    _mm_storeu_ps(f+4, SHUFFLE(SHUFFLE(y, z, 1, 1, 1, 1), SHUFFLE(x, y, 2, 2, 2, 2), 0, 2, 0, 2));
+    _mm_storeu_ps(f+8, SHUFFLE(SHUFFLE(z, x, 2, 2, 3, 3), SHUFFLE(y, z, 3, 3, 3, 3), 0, 2, 0, 2));
+}
+
+/* Broadcast the affine rows once per batch rather than every group of
+ * four; the kernels' stores may alias job->c, so the compiler won't.
+ */
+static inline void affine_splat(__m128 *c4, const float *c) {
+    int i;
+    for (i=0; i<12; i++)
+        c4[i] = _mm_set1_ps(c[i]);
+}
+
+static inline void affine4(const __m128 *c, __m128 *x, __m128 *y, __m128 *z) {
+    __m128 tx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[0], *x), _mm_mul_ps(c[1], *y)), _mm_add_ps(_mm_mul_ps(c[2], *z), c[3]));
+    __m128 ty = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[4], *x), _mm_mul_ps(c[5], *y)), _mm_add_ps(_mm_mul_ps(c[6], *z), c[7]));
+    __m128 tz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[8], *x), _mm_mul_ps(c[9], *y)), _mm_add_ps(_mm_mul_ps(c[10], *z), c[11]));
+    *x = tx;
+    *y = ty;
+    *z = tz;
+}
+
+// 1/length, or 0 for zero vectors as with norm3d
+static inline __m128 norm_scale4(__m128 x, __m128 y, __m128 z) {
+    __m128 l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+    return _mm_and_ps(_mm_cmpgt_ps(l, _mm_setzero_ps()), _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(l)));
+}
+#endif
+
+static void affine_kernel(BatchJob *job, int first, int last) {
+    int i = first;
+#if SG3_SIMD_SSE
+    __m128 c[12];
+    affine_splat(c, job->c);
+    for (; i+4<=last; i+=4) {
+        __m128 x, y, z;
+        load4(job->v+i, &x, &y, &z);
+        affine4(c, &x, &y, &z);
+        store4(job->out+i, x, y, z);
+    }
+#endif
+    for (; i<last; i++)
+        job->out[i] = affine1(job->c, job->v[i]);
+}
+
+static void affine_stream_kernel(BatchJob *job, int first, int last) {
+    int i = first;
+#if SG3_SIMD_SSE
+    __m128 c[12];
+    affine_splat(c, job->c);
+    for (; i+4<=last; i+=4) {
+        __m128 x = _mm_loadu_ps(job->sv.x+i), y = _mm_loadu_ps(job->sv.y+i), z = _mm_loadu_ps(job->sv.z+i);
+        affine4(c, &x, &y, &z);
+        _mm_storeu_ps(job->sout.x+i, x);
+        _mm_storeu_ps(job->sout.y+i, y);
+        _mm_storeu_ps(job->sout.z+i, z);
+    }
+#endif
+    for (; i<last; i++) {
+        Number3D t = affine1(job->c, (Number3D){job->sv.x[i], job->sv.y[i], job->sv.z[i]});
+        job->sout.x[i] = t.x;
+        job->sout.y[i] = t.y;
+        job->sout.z[i] = t.z;
+    }
+}
+
+static void norm_kernel(BatchJob *job, int first, int last) {
+    int i = first;
+#if SG3_SIMD_SSE
+    for (; i+4<=last; i+=4) {
+        __m128 x, y, z;
+        load4(job->out+i, &x, &y, &z);
+        __m128 s = norm_scale4(x, y, z);
+        store4(job->out+i, _mm_mul_ps(x, s), _mm_mul_ps(y, s), _mm_mul_ps(z, s));
+    }
+#endif
+    for (; i<last; i++)
+        muls3d(&job->out[i], norm_scale(job->out[i].x, job->out[i].y, job->out[i].z));
+}
+
+static void norm_stream_kernel(BatchJob *job, int first, int last) {
+    int i = first;
+#if SG3_SIMD_SSE
+    for (; i+4<=last; i+=4) {
+        __m128 x = _mm_loadu_ps(job->sout.x+i), y = _mm_loadu_ps(job->sout.y+i), z = _mm_loadu_ps(job->sout.z+i);
+        __m128 s = norm_scale4(x, y, z);
+        _mm_storeu_ps(job->sout.x+i, _mm_mul_ps(x, s));
+        _mm_storeu_ps(job->sout.y+i, _mm_mul_ps(y, s));
+        _mm_storeu_ps(job->sout.z+i, _mm_mul_ps(z, s));
+    }
+#endif
+    for (; i<last; i++) {
+        float s = norm_scale(job->sout.x[i], job->sout.y[i], job->sout.z[i]);
+        job->sout.x[i] *= s;
+        job->sout.y[i] *= s;
+        job->sout.z[i] *= s;
+    }
+}
+
+static void dot_kernel(BatchJob *job, int first, int last) {
+    int i = first;
+#if SG3_SIMD_SSE
+    for (; i+4<=last; i+=4) {
+        __m128 vx, vy, vz, wx, wy, wz;
+        load4(job->v+i, &vx, &vy, &vz);
+        load4(job->w+i, &wx, &wy, &wz);
+        _mm_storeu_ps(job->scalars+i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, wx), _mm_mul_ps(vy, wy)), _mm_mul_ps(vz, wz)));
+    }
+#endif
+    for (; i<last; i++)
+        job->scalars[i] = dot3d(job->v[i], job->w[i]);
+}
+
+static void dot_stream_kernel(BatchJob *job, int first, int last) {
+    int i = first;
+#if SG3_SIMD_SSE
+    for (; i+4<=last; i+=4) {
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(job->sv.x+i), _mm_loadu_ps(job->sw.x+i)),
+                                         _mm_mul_ps(_mm_loadu_ps(job->sv.y+i), _mm_loadu_ps(job->sw.y+i))),
+                              _mm_mul_ps(_mm_loadu_ps(job->sv.z+i), _mm_loadu_ps(job->sw.z+i)));
+        _mm_storeu_ps(job->scalars+i, d);
+    }
+#endif
+    for (; i<last; i++)
+        job->scalars[i] = job->sv.x[i]*job->sw.x[i]+job->sv.y[i]*job->sw.y[i]+job->sv.z[i]*job->sw.z[i];
+}
+
+static void cross_kernel(BatchJob *job, int first, int last) {
+    int i = first;
+#if SG3_SIMD_SSE
+    for (; i+4<=last; i+=4) {
+        __m128 vx, vy, vz, wx, wy, wz;
+        load4(job->v+i, &vx, &vy, &vz);
+        load4(job->w+i, &wx, &wy, &wz);
+        store4(job->out+i, _mm_sub_ps(_mm_mul_ps(vy, wz), _mm_mul_ps(vz, wy)),
+                           _mm_sub_ps(_mm_mul_ps(vz, wx), _mm_mul_ps(vx, wz)),
+                           _mm_sub_ps(_mm_mul_ps(vx, wy), _mm_mul_ps(vy, wx)));
+    }
+#endif
+    for (; i<last; i++)
+        job->out[i] = cross3d(job->v[i], job->w[i]);
+}
+
+static void cross_stream_kernel(BatchJob *job, int first, int last) {
+    int i = first;
+#if SG3_SIMD_SSE
+    for (; i+4<=last; i+=4) {
+        __m128 vx = _mm_loadu_ps(job->sv.x+i), vy = _mm_loadu_ps(job->sv.y+i), vz = _mm_loadu_ps(job->sv.z+i);
+        __m128 wx = _mm_loadu_ps(job->sw.x+i), wy = _mm_loadu_ps(job->sw.y+i), wz = _mm_loadu_ps(job->sw.z+i);
+        _mm_storeu_ps(job->sout.x+i, _mm_sub_ps(_mm_mul_ps(vy, wz), _mm_mul_ps(vz, wy)));
+        _mm_storeu_ps(job->sout.y+i, _mm_sub_ps(_mm_mul_ps(vz, wx), _mm_mul_ps(vx, wz)));
+        _mm_storeu_ps(job->sout.z+i, _mm_sub_ps(_mm_mul_ps(vx, wy), _mm_mul_ps(vy, wx)));
+    }
+#endif
+    for (; i<last; i++) {
+        Number3D t = cross3d((Number3D){job->sv.x[i], job->sv.y[i], job->sv.z[i]},
+                             (Number3D){job->sw.x[i], job->sw.y[i], job->sw.z[i]});
+        job->sout.x[i] = t.x;
+        job->sout.y[i] = t.y;
+        job->sout.z[i] = t.z;
+    }
+}
+
+static inline void bounds1(BatchJob *job, float x, float y, float z) {
+    if (x < job->min.x) job->min.x = x;
+    if (y < job->min.y) job->min.y = y;
+    if (z < job->min.z) job->min.z = z;
+    if (x > job->max.x) job->max.x = x;
+    if (y > job->max.y) job->max.y = y;
+    if (z > job->max.z) job->max.z = z;
+}
+
+static void bounds_kernel(BatchJob *job, int first, int last) {
+    int i = first;
+    job->min = (Number3D){FLT_MAX, FLT_MAX, FLT_MAX};
+    job->max = (Number3D){-FLT_MAX, -FLT_MAX, -FLT_MAX};
+#if SG3_SIMD_SSE
+    if (i+4 <= last) {
+        // four packed vectors fill three registers as xyzx yzxy zxyz, so
+        // each lane keeps to one component
+        const float *f = (const float*)(job->v+i);
+        __m128 lo[3] = { _mm_loadu_ps(f), _mm_loadu_ps(f+4), _mm_loadu_ps(f+8) };
+        __m128 hi[3] = { lo[0], lo[1], lo[2] };
+        float l[12], h[12];
+        int k;
+        for (i+=4; i+4<=last; i+=4) {
+            f = (const float*)(job->v+i);
+            for (k=0; k<3; k++) {
+                __m128 t = _mm_loadu_ps(f+k*4);
+                lo[k] = _mm_min_ps(lo[k], t);
+                hi[k] = _mm_max_ps(hi[k], t);
+            }
+        }
+        for (k=0; k<3; k++) {
+            _mm_storeu_ps(l+k*4, lo[k]);
+            _mm_storeu_ps(h+k*4, hi[k]);
+        }
+        for (k=0; k<12; k+=3) {
+            bounds1(job, l[k], l[k+1], l[k+2]);
+            bounds1(job, h[k], h[k+1], h[k+2]);
+        }
+    }
+#endif
+    for (; i<last; i++)
+        bounds1(job, job->v[i].x, job->v[i].y, job->v[i].z);
+}
+
+static void bounds_stream_kernel(BatchJob *job, int first, int last) {
+    int i = first;
+    job->min = (Number3D){FLT_MAX, FLT_MAX, FLT_MAX};
+    job->max = (Number3D){-FLT_MAX, -FLT_MAX, -FLT_MAX};
+#if SG3_SIMD_SSE
+    if (i+4 <= last) {
+        __m128 lx = _mm_loadu_ps(job->sv.x+i), ly = _mm_loadu_ps(job->sv.y+i), lz = _mm_loadu_ps(job->sv.z+i);
+        __m128 hx = lx, hy = ly, hz = lz;
+        float l[12], h[12];
+        int k;
+        for (i+=4; i+4<=last; i+=4) {
+            __m128 x = _mm_loadu_ps(job->sv.x+i), y = _mm_loadu_ps(job->sv.y+i), z = _mm_loadu_ps(job->sv.z+i);
+            lx = _mm_min_ps(lx, x); ly = _mm_min_ps(ly, y); lz = _mm_min_ps(lz, z);
+            hx = _mm_max_ps(hx, x); hy = _mm_max_ps(hy, y); hz = _mm_max_ps(hz, z);
+        }
+        _mm_storeu_ps(l, lx); _mm_storeu_ps(l+4, ly); _mm_storeu_ps(l+8, lz);
+        _mm_storeu_ps(h, hx); _mm_storeu_ps(h+4, hy); _mm_storeu_ps(h+8, hz);
+        for (k=0; k<4; k++) {
+            bounds1(job, l[k], l[k+4], l[k+8]);
+            bounds1(job, h[k], h[k+4], h[k+8]);
+        }
+    }
+#endif
+    for (; i<last; i++)
+        bounds1(job, job->sv.x[i], job->sv.y[i], job->sv.z[i]);
+}
+
+/* trmx3d() over an array, in place.
+ */
+void trmx3dv(Number3D *n, int count, const float *m) {
+    BatchJob job = { affine_kernel }, parts[BATCH_MAX_THREADS];
+    affine_rows(job.c, m, FALSE);
+    job.v = n;
+    job.out = n;
+    batch_run(&job, count, parts);
+}
+
+/* Transform points as GL would with m, translation included. out may be
+ * in.
+ */
+void trpt3dv(Number3D *out, const Number3D *in, int count, const float *m) {
+    BatchJob job = { affine_kernel }, parts[BATCH_MAX_THREADS];
+    affine_rows(job.c, m, TRUE);
+    job.v = in;
+    job.out = out;
+    batch_run(&job, count, parts);
+}
+
+/* Normalize in place; zero vectors stay zero.
+ */
+void norm3dv(Number3D *n, int count) {
+    BatchJob job = { norm_kernel }, parts[BATCH_MAX_THREADS];
+    job.out = n;
+    batch_run(&job, count, parts);
+}
+
+void dot3dv(float *out, const Number3D *v, const Number3D *w, int count) {
+    BatchJob job = { dot_kernel }, parts[BATCH_MAX_THREADS];
+    job.v = v;
+    job.w = w;
+    job.scalars = out;
+    batch_run(&job, count, parts);
+}
+
+/* out may be v or w.
+ */
+void cross3dv(Number3D *out, const Number3D *v, const Number3D *w, int count) {
+    BatchJob job = { cross_kernel }, parts[BATCH_MAX_THREADS];
+    job.v = v;
+    job.w = w;
+    job.out = out;
+    batch_run(&job, count, parts);
+}
+
+/* Combine the bounds of the n parts batch_run split job into, or take
+ * job's own if it ran whole.
+ */
+static void merge_bounds(const BatchJob *job, const BatchJob *parts, int n, Number3D *min, Number3D *max) {
+    BatchJob total = n == 0 ? *job : parts[0];
+    int i;
+    for (i=1; i<n; i++) {
+        bounds1(&total, parts[i].min.x, parts[i].min.y, parts[i].min.z);
+        bounds1(&total, parts[i].max.x, parts[i].max.y, parts[i].max.z);
+    }
+    *min = total.min;
+    *max = total.max;
+}
+
+/* Smallest and largest component values; an empty batch leaves min at
+ * FLT_MAX and max at -FLT_MAX.
+ */
+void bounds3dv(const Number3D *n, int count, Number3D *min, Number3D *max) {
+    BatchJob job = { bounds_kernel }, parts[BATCH_MAX_THREADS];
+    job.v = n;
+    merge_bounds(&job, parts, batch_run(&job, count, parts), min, max);
+}
+
+void trmx3ds(Stream3D n, int count, const float *m) {
+    BatchJob job = { affine_stream_kernel }, parts[BATCH_MAX_THREADS];
+    affine_rows(job.c, m, FALSE);
+    job.sv = n;
+    job.sout = n;
+    batch_run(&job, count, parts);
+}
+
+void trpt3ds(Stream3D out, Stream3D in, int count, const float *m) {
+    BatchJob job = { affine_stream_kernel }, parts[BATCH_MAX_THREADS];
+    affine_rows(job.c, m, TRUE);
+    job.sv = in;
+    job.sout = out;
+    batch_run(&job, count, parts);
+}
+
+void norm3ds(Stream3D n, int count) {
+    BatchJob job = { norm_stream_kernel }, parts[BATCH_MAX_THREADS];
+    job.sout = n;
+    batch_run(&job, count, parts);
+}
+
+void dot3ds(float *out, Stream3D v, Stream3D w, int count) {
+    BatchJob job = { dot_stream_kernel }, parts[BATCH_MAX_THREADS];
+    job.sv = v;
+    job.sw = w;
+    job.scalars = out;
+    batch_run(&job, count, parts);
+}
+
+void cross3ds(Stream3D out, Stream3D v, Stream3D w, int count) {
+    BatchJob job = { cross_stream_kernel }, parts[BATCH_MAX_THREADS];
+    job.sv = v;
+    job.sw = w;
+    job.sout = out;
+    batch_run(&job, count, parts);
+}
+
+void bounds3ds(Stream3D n, int count, Number3D *min, Number3D *max) {
+    BatchJob job = { bounds_stream_kernel }, parts[BATCH_MAX_THREADS];
+    job.sv = n;
+    merge_bounds(&job, parts, batch_run(&job, count, parts), min, max);
+}
@@ -0,0 +1,125 @@
+/* mathsimd.c - SIMD math kernels
+ * SSE and NEON versions of the matrix functions in math.c, which keeps the
+ * scalar reference code
+ * Copyright 2012 Keath Milligan
+ */
+
+#include "math.h"
+
+#if SG3_SIMD_SSE
+#include <xmmintrin.h>
+
+#define SHUFFLE(a, b, x, y, z, w) _mm_shuffle_ps(a, b, _MM_SHUFFLE(w, z, y, x))
+#define SWIZZLE(a, x, y, z, w) SHUFFLE(a, a, x, y, z, w)
+#define SPLAT(a, i) SWIZZLE(a, i, i, i, i)
+
+/* m = m*v. Each result row is the rows of v weighted by one row of m.
+ */
+void mulmx(float *m, const float *v) {
+    __m128 v0 = _mm_loadu_ps(v), v1 = _mm_loadu_ps(v+4), v2 = _mm_loadu_ps(v+8), v3 = _mm_loadu_ps(v+12);
+    int i;
+    for (i=0; i<16; i+=4) {
+        __m128 r = _mm_loadu_ps(m+i);
+        __m128 t = _mm_mul_ps(SPLAT(r, 0), v0);
+        t = _mm_add_ps(t, _mm_mul_ps(SPLAT(r, 1), v1));
+        t = _mm_add_ps(t, _mm_mul_ps(SPLAT(r, 2), v2));
+        t = _mm_add_ps(t, _mm_mul_ps(SPLAT(r, 3), v3));
+        _mm_storeu_ps(m+i, t);
+    }
+}
+
+// 2x2 blocks held as (00, 01, 10, 11): a*b, adj(a)*b and a*adj(b)
+static inline __m128 mul2x2(__m128 a, __m128 b) {
+    return _mm_add_ps(_mm_mul_ps(a, SWIZZLE(b, 0, 3, 0, 3)),
+                      _mm_mul_ps(SWIZZLE(a, 1, 0, 3, 2), SWIZZLE(b, 2, 1, 2, 1)));
+}
+
+static inline __m128 adjmul2x2(__m128 a, __m128 b) {
+    return _mm_sub_ps(_mm_mul_ps(SWIZZLE(a, 3, 3, 0, 0), b),
+                      _mm_mul_ps(SWIZZLE(a, 1, 1, 2, 2), SWIZZLE(b, 2, 3, 0, 1)));
+}
+
+static inline __m128 muladj2x2(__m128 a, __m128 b) {
+    return _mm_sub_ps(_mm_mul_ps(a, SWIZZLE(b, 3, 0, 3, 0)),
+                      _mm_mul_ps(SWIZZLE(a, 1, 0, 3, 2), SWIZZLE(b, 2, 1, 2, 1)));
+}
+
+// The matrix split into 2x2 blocks | A B |, with the block determinants,
+//                                  | C D |
+// adj(A)*B, adj(D)*C and the determinant of the whole
+typedef struct _Blocks {
+    __m128 a, b, c, d;
+    __m128 det_a, det_b, det_c, det_d;
+    __m128 ab, dc;
+    __m128 det;
+} Blocks;
+
+static inline void split_blocks(const float *m, Blocks *k) {
+    __m128 r0 = _mm_loadu_ps(m), r1 = _mm_loadu_ps(m+4), r2 = _mm_loadu_ps(m+8), r3 = _mm_loadu_ps(m+12);
+    k->a = _mm_movelh_ps(r0, r1);
+    k->b = _mm_movehl_ps(r1, r0);
+    k->c = _mm_movelh_ps(r2, r3);
+    k->d = _mm_movehl_ps(r3, r2);
+    __m128 dets = _mm_sub_ps(_mm_mul_ps(SHUFFLE(r0, r2, 0, 2, 0, 2), SHUFFLE(r1, r3, 1, 3, 1, 3)),
+                             _mm_mul_ps(SHUFFLE(r0, r2, 1, 3, 1, 3), SHUFFLE(r1, r3, 0, 2, 0, 2)));
+    k->det_a = SPLAT(dets, 0);
+    k->det_b = SPLAT(dets, 1);
+    k->det_c = SPLAT(dets, 2);
+    k->det_d = SPLAT(dets, 3);
+    k->ab = adjmul2x2(k->a, k->b);
+    k->dc = adjmul2x2(k->d, k->c);
+    // |M| = |A||D| + |B||C| - tr(adj(A)B adj(D)C)
+    __m128 tr = _mm_mul_ps(k->ab, SWIZZLE(k->dc, 0, 2, 1, 3));
+    tr = _mm_add_ps(tr, SWIZZLE(tr, 1, 0, 3, 2));
+    tr = _mm_add_ps(tr, SWIZZLE(tr, 2, 3, 0, 1));
+    k->det = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(k->det_a, k->det_d), _mm_mul_ps(k->det_b, k->det_c)), tr);
+}
+
+/* Blockwise inverse from the adjugates of the 2x2 blocks. Singular
+ * matrices become the identity, as with invmx_scalar.
+ */
+void invmx(float *m) {
+    Blocks k;
+    split_blocks(m, &k);
+    if (close_enough(_mm_cvtss_f32(k.det), 0.0f)) {
+        idmx(m);
+        return;
+    }
+    __m128 x = _mm_sub_ps(_mm_mul_ps(k.det_d, k.a), mul2x2(k.b, k.dc));
+    __m128 w = _mm_sub_ps(_mm_mul_ps(k.det_a, k.d), mul2x2(k.c, k.ab));
+    __m128 y = _mm_sub_ps(_mm_mul_ps(k.det_b, k.c), muladj2x2(k.d, k.ab));
+    __m128 z = _mm_sub_ps(_mm_mul_ps(k.det_c, k.b), muladj2x2(k.a, k.dc));
+    __m128 r = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), k.det);
+    x = _mm_mul_ps(x, r);
+    y = _mm_mul_ps(y, r);
+    z = _mm_mul_ps(z, r);
+    w = _mm_mul_ps(w, r);
+    // taking the adjugates of the blocks as they are stored back
+    _mm_storeu_ps(m, SHUFFLE(x, y, 3, 1, 3, 1));
+    _mm_storeu_ps(m+4, SHUFFLE(x, y, 2, 0, 2, 0));
+    _mm_storeu_ps(m+8, SHUFFLE(z, w, 3, 1, 3, 1));
+    _mm_storeu_ps(m+12, SHUFFLE(z, w, 2, 0, 2, 0));
+}
+
+#elif SG3_SIMD_NEON
+#include <arm_neon.h>
+
+void mulmx(float *m, const float *v) {
+    float32x4_t v0 = vld1q_f32(v), v1 = vld1q_f32(v+4), v2 = vld1q_f32(v+8), v3 = vld1q_f32(v+12);
+    int i;
+    for (i=0; i<16; i+=4) {
+        float32x4_t r = vld1q_f32(m+i);
+        float32x4_t t = vmulq_lane_f32(v0, vget_low_f32(r), 0);
+        t = vmlaq_lane_f32(t, v1, vget_low_f32(r), 1);
+        t = vmlaq_lane_f32(t, v2, vget_high_f32(r), 0);
+        t = vmlaq_lane_f32(t, v3, vget_high_f32(r), 1);
+        vst1q_f32(m+i, t);
+    }
+}
+
+// the blockwise inverse needs a vector divide, which 32-bit NEON lacks
+void invmx(float *m) {
+    invmx_scalar(m);
+}
+
+#endif
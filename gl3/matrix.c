@@ -0,0 +1,128 @@
+/* matrix.c - model-view matrix stack
+ * Keeps the GL model-view matrix on the CPU so it never has to be read back
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <log/log.h>
+#include "gl.h"
+#include "math.h"
+#include "matrix.h"
+
+// Render thread only. The functions here stand in for glPushMatrix(),
+// glMultMatrixf() and friends and expect GL to be in GL_MODELVIEW mode;
+// the result is handed to GL with glLoadMatrixf() and GL's own stack is
+// left alone.
+static struct {
+    float m[MATRIX_STACK_DEPTH][16] ALIGN16;
+    int depth;
+} stack = { { { 1.0f, 0.0f, 0.0f, 0.0f,
+                0.0f, 1.0f, 0.0f, 0.0f,
+                0.0f, 0.0f, 1.0f, 0.0f,
+                0.0f, 0.0f, 0.0f, 1.0f } }, 0 };
+
+#define TOP (stack.m[stack.depth])
+
+static inline void upload() {
+    glLoadMatrixf(TOP);
+}
+
+// top = top*m in GL terms, which is m*top in math.c's row order
+static inline void mult(const float *m) {
+    ALIGNED_MATRIX(t);
+    dupmx(t, m);
+    mulmx(t, TOP);
+    dupmx(TOP, t);
+}
+
+static inline void translate(float x, float y, float z) {
+    int i;
+    for (i=0; i<4; i++)
+        TOP[12+i] += x*TOP[i]+y*TOP[4+i]+z*TOP[8+i];
+}
+
+static inline void scale(float x, float y, float z) {
+    int i;
+    for (i=0; i<4; i++) {
+        TOP[i] *= x;
+        TOP[4+i] *= y;
+        TOP[8+i] *= z;
+    }
+}
+
+/* Empty the stack and start over from m, or the identity if m is NULL.
+ */
+void matrix_reset(const float *m) {
+    stack.depth = 0;
+    if (m) dupmx(TOP, m);
+    else idmx(TOP);
+    upload();
+}
+
+void matrix_push() {
+    if (stack.depth == MATRIX_STACK_DEPTH-1) {
+        LOGERR("matrix stack overflow\n");
+        return;
+    }
+    dupmx(stack.m[stack.depth+1], TOP);
+    stack.depth++;
+}
+
+void matrix_pop() {
+    if (stack.depth == 0) {
+        LOGERR("matrix stack underflow\n");
+        return;
+    }
+    stack.depth--;
+    upload();
+}
+
+void matrix_load(const float *m) {
+    dupmx(TOP, m);
+    upload();
+}
+
+void matrix_load_identity() {
+    idmx(TOP);
+    upload();
+}
+
+void matrix_mult(const float *m) {
+    mult(m);
+    upload();
+}
+
+void matrix_translate(float x, float y, float z) {
+    translate(x, y, z);
+    upload();
+}
+
+void matrix_scale(float x, float y, float z) {
+    scale(x, y, z);
+    upload();
+}
+
+/* Rotate angle degrees about (x, y, z), as glRotatef.
+ */
+void matrix_rotate(float angle, float x, float y, float z) {
+    ALIGNED_MATRIX(r);
+    Number3D axis = { x, y, z };
+    norm3d(&axis);
+    idmx(r);
+    rotmx(r, axis, DEG2RAD(angle));
+    matrix_mult(r);
+}
+
+/* Translate, rotate and scale into an object's frame with one upload.
+ */
+void matrix_transform(Number3D position, const float *rotation, Number3D scale_by) {
+    translate(position.x, position.y, position.z);
+    mult(rotation);
+    scale(scale_by.x, scale_by.y, scale_by.z);
+    upload();
+}
+
+/* The current model-view matrix.
+ */
+const float *matrix_top() {
+    return TOP;
+}
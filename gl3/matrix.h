@@ -0,0 +1,25 @@
+/* matrix.h - model-view matrix stack
+ * Keeps the GL model-view matrix on the CPU so it never has to be read back
+ * Copyright 2012 Keath Milligan
+ */
+
+#ifndef MATRIX_H_
+#define MATRIX_H_
+
+#include "types.h"
+
+#define MATRIX_STACK_DEPTH 32
+
+void matrix_reset(const float *m);
+void matrix_push();
+void matrix_pop();
+void matrix_load(const float *m);
+void matrix_load_identity();
+void matrix_mult(const float *m);
+void matrix_translate(float x, float y, float z);
+void matrix_scale(float x, float y, float z);
+void matrix_rotate(float angle, float x, float y, float z);
+void matrix_transform(Number3D position, const float *rotation, Number3D scale);
+const float *matrix_top();
+
+#endif /* MATRIX_H_ */
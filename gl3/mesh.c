@@ -0,0 +1,896 @@
+/* mesh.c - shared meshes
+ * Reference-counted geometry loaded once and shared between models
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <log/log.h>
+#include "gl.h"
+#include "mesh.h"
+#include "math.h"
+#include "meshopt.h"
+#include "simplify.h"
+
+static int mesh_parse(Mesh *mesh, const char *path);
+static void mesh_build_normals(Mesh *mesh);
+static void mesh_build_bounds(Mesh *mesh);
+static void mesh_build_lods(Mesh *mesh);
+static int mesh_load_cooked(Mesh *mesh, const char *path, const char *source);
+static void mesh_cook(Mesh *mesh, const char *path, const char *source);
+static void mesh_build_draw_faces(Mesh *mesh);
+static void mesh_destroy(Mesh *mesh);
+static unsigned char *mesh_map_file(const char *path, size_t *size);
+static void mesh_unmap_file(unsigned char *data, size_t size);
+
+#define MESH_COOKED_MAGIC 0x4d334753    // "SG3M"
+#define MESH_COOKED_VERSION 4
+#define ALIGN4(x) (((x)+3)&~(size_t)3)
+
+// Cooked mesh file header. The sections follow at the given offsets, each
+// 4-byte aligned, in the layout the Mesh uses at run time.
+typedef struct _MeshBlobHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int source_size;       // .3ds the blob was cooked from
+    unsigned int source_mtime;
+    int vertex_count;
+    int face_count;
+    int material_count;
+    int has_uvs;
+    AABB aabb;
+    float radius;
+    int lod_count;
+    MeshLOD lods[MESH_MAX_LODS];
+    unsigned int interleaved_offset;
+    unsigned int positions_offset;
+    unsigned int faces_offset;
+    unsigned int face_materials_offset;
+    unsigned int materials_offset;
+    unsigned int size;
+} MeshBlobHeader;
+
+// Loaded meshes keyed by path. Meshes are loaded and released on the
+// thread that creates objects.
+static Mesh *meshes = NULL;
+static int next_id = 1;
+static int index_uint_known = FALSE;
+static int index_uint = FALSE;
+
+/* Return the mesh for <resources><mesh_name>.3ds with its texture,
+ * loading it on first use. The caller owns one reference. A cooked copy
+ * next to the .3ds is used when it is current, otherwise the .3ds is
+ * parsed and the cooked copy written for next time.
+ */
+Mesh *mesh_load(const char *resources, const char *mesh_name) {
+    int pathlen = (int)(strlen(resources)+strlen(mesh_name)+1);
+    char *path = alloca(pathlen);
+    sprintf(path, "%s%s", resources, mesh_name);
+    Mesh *mesh;
+    HASH_FIND_STR(meshes, path, mesh);
+    if (mesh != NULL)
+        return mesh_retain(mesh);
+    mesh = calloc(1, sizeof(Mesh));
+    mesh->path = strdup(path);
+    mesh->refcount = 1;
+    char *meshpath = alloca(pathlen+4);
+    sprintf(meshpath, "%s.3ds", path);
+    char *cookedpath = alloca(pathlen+strlen(MESH_COOKED_EXT));
+    sprintf(cookedpath, "%s" MESH_COOKED_EXT, path);
+    if (!mesh_load_cooked(mesh, cookedpath, meshpath)) {
+        if (!mesh_parse(mesh, meshpath)) {
+            mesh_destroy(mesh);
+            return NULL;
+        }
+        mesh_build_normals(mesh);
+        mesh_build_bounds(mesh);
+        MeshOptStats stats;
+        meshopt_optimize(mesh->vertices, mesh->normals, mesh->uvs, mesh->vertex_count,
+                         mesh->faces, mesh->face_materials, mesh->face_count,
+                         MESHOPT_OVERDRAW_THRESHOLD, &stats);
+        LOG("%s: ACMR %.3f -> %.3f\n", path, stats.acmr_before, stats.acmr_after);
+        mesh_build_lods(mesh);
+        mesh_cook(mesh, cookedpath, meshpath);
+    }
+    char *texpath = alloca(pathlen+4);
+    sprintf(texpath, "%s.png", mesh_name);
+    mesh->texture = texture_create(resources, texpath, TRUE, TRUE);
+    if (mesh->texture == NULL)
+        LOGERR("could not load texture: %s\n", texpath);
+    mesh_build_draw_faces(mesh);
+    mesh->bvh = bvh_build_mesh(mesh->vertices, mesh->faces, mesh->face_count);
+    mesh->id = next_id++;
+    HASH_ADD_KEYPTR(hh, meshes, mesh->path, strlen(mesh->path), mesh);
+    return mesh;
+}
+
+Mesh *mesh_retain(Mesh *mesh) {
+    mesh->refcount++;
+    return mesh;
+}
+
+/* Drop a reference, freeing the mesh and its GPU buffers with the last one.
+ * The final release must happen on the GL thread when the mesh is buffered.
+ */
+void mesh_release(Mesh *mesh) {
+    if (--mesh->refcount > 0)
+        return;
+    HASH_DEL(meshes, mesh);
+    mesh_destroy(mesh);
+}
+
+/* Override whether GL_UNSIGNED_INT indices can be drawn, which is otherwise
+ * decided from the GL version or extensions. Affects meshes loaded later.
+ */
+void mesh_set_index_uint(int supported) {
+    index_uint = supported;
+    index_uint_known = TRUE;
+}
+
+static int mesh_index_uint() {
+    if (!index_uint_known) {
+#if SG3_INDEX_UINT
+        index_uint = TRUE;
+#else
+        const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+        index_uint = extensions != NULL && strstr(extensions, "GL_OES_element_index_uint") != NULL;
+#endif
+        index_uint_known = TRUE;
+    }
+    return index_uint;
+}
+
+/* Full-detail faces plus those of every level of detail.
+ */
+static int mesh_total_faces(const Mesh *mesh) {
+    const MeshLOD *last = &mesh->lods[mesh->lod_count-1];
+    return last->first_face+last->face_count;
+}
+
+/* Split the faces into runs that each reach at most MESH_BATCH_VERTICES
+ * vertices, giving every run its own copy of the vertices it uses so
+ * 16-bit indices relative to the run's first vertex can address them.
+ * Faces keep their order.
+ */
+static void mesh_split_batches(Mesh *mesh) {
+    int *batch_of = malloc(sizeof(int)*mesh->vertex_count);
+    int *local = malloc(sizeof(int)*mesh->vertex_count);
+    int capacity = mesh->vertex_count+mesh->vertex_count/8;
+    int count = 0, batch_capacity = 4;
+    int i, j;
+    IndexBatch *batch;
+    for (i=0; i<mesh->vertex_count; i++)
+        batch_of[i] = -1;
+    mesh->split_vertices = malloc(sizeof(InterleavedVertex)*capacity);
+    mesh->draw_faces = malloc(sizeof(Face16)*mesh->face_count);
+    mesh->batches = malloc(sizeof(IndexBatch)*batch_capacity);
+    mesh->batch_count = 1;
+    batch = &mesh->batches[0];
+    memset(batch, 0, sizeof(IndexBatch));
+    for (i=0; i<mesh->face_count; i++) {
+        unsigned int v[3] = { mesh->faces[i].a, mesh->faces[i].b, mesh->faces[i].c };
+        int b = mesh->batch_count-1;
+        int needed = 0;
+        for (j=0; j<3; j++)
+            if (batch_of[v[j]] != b && (j == 0 || v[j] != v[0]) && (j < 2 || v[j] != v[1]))
+                needed++;
+        if (batch->vertex_count+needed > MESH_BATCH_VERTICES) {
+            if (mesh->batch_count == batch_capacity) {
+                batch_capacity *= 2;
+                mesh->batches = realloc(mesh->batches, sizeof(IndexBatch)*batch_capacity);
+            }
+            b = mesh->batch_count++;
+            batch = &mesh->batches[b];
+            batch->base_vertex = count;
+            batch->vertex_count = 0;
+            batch->first_face = i;
+            batch->face_count = 0;
+        }
+        unsigned short idx[3];
+        for (j=0; j<3; j++) {
+            if (batch_of[v[j]] != b) {
+                if (count == capacity) {
+                    capacity *= 2;
+                    mesh->split_vertices = realloc(mesh->split_vertices, sizeof(InterleavedVertex)*capacity);
+                }
+                mesh->split_vertices[count++] = mesh->interleaved[v[j]];
+                batch_of[v[j]] = b;
+                local[v[j]] = batch->vertex_count++;
+            }
+            idx[j] = (unsigned short)local[v[j]];
+        }
+        mesh->draw_faces[i] = (Face16){idx[0], idx[1], idx[2]};
+        batch->face_count++;
+    }
+    free(batch_of);
+    free(local);
+    mesh->interleaved = mesh->split_vertices;
+    LOG("%s: split into %d batches, %d vertices drawn for %d\n", mesh->path, mesh->batch_count, count, mesh->vertex_count);
+}
+
+/* Pick the index format at load time: a 16-bit copy of the faces when they
+ * fit, the 32-bit faces themselves where GL can draw them, and 16-bit
+ * sub-batches otherwise.
+ */
+static void mesh_build_draw_faces(Mesh *mesh) {
+    int count = mesh_total_faces(mesh);
+    int i;
+    if (mesh->vertex_count <= MESH_BATCH_VERTICES) {
+        mesh->draw_faces = malloc(sizeof(Face16)*count);
+        for (i=0; i<count; i++)
+            mesh->draw_faces[i] = (Face16){mesh->faces[i].a, mesh->faces[i].b, mesh->faces[i].c};
+    } else if (!mesh_index_uint()) {
+        // batches cover the full detail faces only
+        mesh_split_batches(mesh);
+        mesh->lod_count = 1;
+    }
+}
+
+static void mesh_destroy(Mesh *mesh) {
+    if (mesh->draw_faces) free(mesh->draw_faces);
+    if (mesh->batches) free(mesh->batches);
+    if (mesh->split_vertices) free(mesh->split_vertices);
+    if (mesh->buffers) {
+#if SG3_BUFFER_OBJECTS
+        if (mesh->buffers->ids[GEOMETRY_VERTEX_BUFFER])
+            glDeleteBuffers(GEOMETRY_BUFFERS, mesh->buffers->ids);
+#endif
+        free(mesh->buffers);
+    }
+    if (mesh->bvh) bvh_destroy(mesh->bvh);
+    if (mesh->texture) texture_destroy(mesh->texture);
+    if (mesh->blob) {
+        // the arrays live in the blob
+        if (mesh->blob_mapped)
+            mesh_unmap_file(mesh->blob, mesh->blob_size);
+        else
+            free(mesh->blob);
+        free(mesh->path);
+        free(mesh);
+        return;
+    }
+    if (mesh->vertices) free(mesh->vertices);
+    if (mesh->normals) free(mesh->normals);
+    if (mesh->uvs) free(mesh->uvs);
+    if (mesh->faces) free(mesh->faces);
+    if (mesh->face_materials) free(mesh->face_materials);
+    if (mesh->materials) free(mesh->materials);
+    free(mesh->path);
+    free(mesh);
+}
+
+/* Point the mesh's arrays into a cooked blob, which it then owns.
+ */
+static void mesh_attach_blob(Mesh *mesh, void *blob, size_t size, int mapped) {
+    MeshBlobHeader *h = blob;
+    unsigned char *base = blob;
+    mesh->blob = blob;
+    mesh->blob_size = size;
+    mesh->blob_mapped = mapped;
+    mesh->vertex_count = h->vertex_count;
+    mesh->face_count = h->face_count;
+    mesh->material_count = h->material_count;
+    mesh->interleaved = (InterleavedVertex*)(base+h->interleaved_offset);
+    mesh->vertices = (Number3D*)(base+h->positions_offset);
+    mesh->normals = NULL;
+    mesh->uvs = NULL;
+    mesh->faces = (Face*)(base+h->faces_offset);
+    mesh->face_materials = (short*)(base+h->face_materials_offset);
+    mesh->materials = h->material_count ? (MeshMaterial*)(base+h->materials_offset) : NULL;
+    mesh->aabb = h->aabb;
+    mesh->radius = h->radius;
+    mesh->lod_count = h->lod_count;
+    memcpy(mesh->lods, h->lods, sizeof(mesh->lods));
+}
+
+static int section_fits(const MeshBlobHeader *h, unsigned int offset, size_t length) {
+    return offset >= sizeof(MeshBlobHeader) && (offset&3) == 0 &&
+           offset <= h->size && length <= h->size-offset;
+}
+
+/* Use the cooked blob at path if it is valid and was cooked from the
+ * current source. The blob stays mapped for the life of the mesh.
+ */
+static int mesh_load_cooked(Mesh *mesh, const char *path, const char *source) {
+    size_t size;
+    unsigned char *data = mesh_map_file(path, &size);
+    if (data == NULL)
+        return FALSE;
+    const MeshBlobHeader *h = (const MeshBlobHeader*)data;
+    struct stat fst;
+    int i, faces_total = 0, ok = size >= sizeof(MeshBlobHeader) && h->magic == MESH_COOKED_MAGIC;
+    if (ok && h->version != MESH_COOKED_VERSION) {
+        LOG("%s: cooked by another version\n", path);
+        mesh_unmap_file(data, size);
+        return FALSE;
+    }
+    ok = ok && h->size == size &&
+         h->lod_count > 0 && h->lod_count <= MESH_MAX_LODS &&
+         h->lods[0].first_face == 0 && h->lods[0].face_count == h->face_count;
+    for (i=0; ok && i<h->lod_count; i++) {
+        // levels follow one another
+        ok = h->lods[i].first_face == faces_total &&
+             h->lods[i].face_count > 0 && h->lods[i].face_count <= (int)(size/sizeof(Face))-faces_total;
+        faces_total += ok ? h->lods[i].face_count : 0;
+    }
+    ok = ok &&
+         h->vertex_count > 0 && h->vertex_count <= MESH_MAX_VERTICES &&
+         h->face_count > 0 && h->face_count <= (int)(size/sizeof(Face)) &&
+         h->material_count >= 0 && h->material_count <= (int)(size/sizeof(MeshMaterial)) &&
+         section_fits(h, h->interleaved_offset, sizeof(InterleavedVertex)*h->vertex_count) &&
+         section_fits(h, h->positions_offset, sizeof(Number3D)*h->vertex_count) &&
+         section_fits(h, h->faces_offset, sizeof(Face)*faces_total) &&
+         section_fits(h, h->face_materials_offset, sizeof(short)*h->face_count) &&
+         (h->material_count == 0 || section_fits(h, h->materials_offset, sizeof(MeshMaterial)*h->material_count));
+    if (!ok) {
+        LOGERR("%s: not a valid cooked mesh\n", path);
+    } else if (stat(source, &fst) == 0 &&
+               (h->source_size != (unsigned int)fst.st_size || h->source_mtime != (unsigned int)fst.st_mtime)) {
+        LOG("%s: out of date\n", path);
+        ok = FALSE;
+    } else {
+        const Face *faces = (const Face*)(data+h->faces_offset);
+        for (i=0; i<faces_total && ok; i++)
+            ok = faces[i].a < (unsigned int)h->vertex_count &&
+                 faces[i].b < (unsigned int)h->vertex_count &&
+                 faces[i].c < (unsigned int)h->vertex_count;
+        if (!ok)
+            LOGERR("%s: face %d indexes past the vertex list\n", path, i-1);
+    }
+    if (!ok) {
+        mesh_unmap_file(data, size);
+        return FALSE;
+    }
+    mesh_attach_blob(mesh, data, size, TRUE);
+    LOG("%s: loaded vertices=%d, faces=%d\n", path, mesh->vertex_count, mesh->face_count);
+    return TRUE;
+}
+
+/* Pack a freshly parsed mesh into the cooked layout, switch the mesh over
+ * to it and save it at path. Failing to save only costs the next load.
+ */
+static void mesh_cook(Mesh *mesh, const char *path, const char *source) {
+    MeshBlobHeader h;
+    struct stat fst;
+    int i;
+    memset(&h, 0, sizeof(h));
+    h.magic = MESH_COOKED_MAGIC;
+    h.version = MESH_COOKED_VERSION;
+    if (stat(source, &fst) == 0) {
+        h.source_size = (unsigned int)fst.st_size;
+        h.source_mtime = (unsigned int)fst.st_mtime;
+    }
+    h.vertex_count = mesh->vertex_count;
+    h.face_count = mesh->face_count;
+    h.material_count = mesh->material_count;
+    h.has_uvs = mesh->uvs != NULL;
+    h.aabb = mesh->aabb;
+    h.radius = mesh->radius;
+    h.lod_count = mesh->lod_count;
+    memcpy(h.lods, mesh->lods, sizeof(h.lods));
+    int faces_total = mesh_total_faces(mesh);
+    size_t offset = ALIGN4(sizeof(MeshBlobHeader));
+    h.interleaved_offset = offset;
+    offset = ALIGN4(offset+sizeof(InterleavedVertex)*mesh->vertex_count);
+    h.positions_offset = offset;
+    offset = ALIGN4(offset+sizeof(Number3D)*mesh->vertex_count);
+    h.faces_offset = offset;
+    offset = ALIGN4(offset+sizeof(Face)*faces_total);
+    h.face_materials_offset = offset;
+    offset = ALIGN4(offset+sizeof(short)*mesh->face_count);
+    h.materials_offset = offset;
+    offset += sizeof(MeshMaterial)*mesh->material_count;
+    h.size = offset;
+
+    unsigned char *blob = calloc(1, h.size);
+    memcpy(blob, &h, sizeof(h));
+    InterleavedVertex *v = (InterleavedVertex*)(blob+h.interleaved_offset);
+    for (i=0; i<mesh->vertex_count; i++) {
+        v[i].position = mesh->vertices[i];
+        v[i].normal = mesh->normals[i];
+        if (mesh->uvs) v[i].uv = mesh->uvs[i];
+    }
+    memcpy(blob+h.positions_offset, mesh->vertices, sizeof(Number3D)*mesh->vertex_count);
+    memcpy(blob+h.faces_offset, mesh->faces, sizeof(Face)*faces_total);
+    memcpy(blob+h.face_materials_offset, mesh->face_materials, sizeof(short)*mesh->face_count);
+    if (mesh->material_count)
+        memcpy(blob+h.materials_offset, mesh->materials, sizeof(MeshMaterial)*mesh->material_count);
+
+    // write beside the target and rename so readers never see a partial file
+    char *tmppath = alloca(strlen(path)+5);
+    sprintf(tmppath, "%s.tmp", path);
+    FILE *file = fopen(tmppath, "wb");
+    if (file == NULL) {
+        LOG("%s: not writable, mesh will not be cached\n", tmppath);
+    } else {
+        int written = fwrite(blob, 1, h.size, file) == h.size;
+        if (fclose(file) != 0) written = FALSE;
+#ifdef __MINGW32__
+        // rename will not replace an existing file on Windows
+        remove(path);
+#endif
+        if (!written || rename(tmppath, path) != 0) {
+            LOGERR("%s: could not write cooked mesh\n", path);
+            remove(tmppath);
+        }
+    }
+
+    free(mesh->vertices);
+    free(mesh->normals);
+    if (mesh->uvs) free(mesh->uvs);
+    free(mesh->faces);
+    free(mesh->face_materials);
+    if (mesh->materials) free(mesh->materials);
+    mesh_attach_blob(mesh, blob, h.size, FALSE);
+}
+
+/* Map a whole file copy-on-write. Windows builds read it into memory with
+ * a single call instead.
+ */
+static unsigned char *mesh_map_file(const char *path, size_t *size) {
+    struct stat fst;
+#ifdef __MINGW32__
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    fstat(fileno(file), &fst);
+    unsigned char *data = NULL;
+    if (fst.st_size > 0) {
+        data = malloc(fst.st_size);
+        if (fread(data, 1, fst.st_size, file) != (size_t)fst.st_size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    fstat(fd, &fst);
+    unsigned char *data = NULL;
+    if (fst.st_size > 0) {
+        data = mmap(NULL, fst.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+    }
+    close(fd);
+#endif
+    *size = fst.st_size;
+    return data;
+}
+
+static void mesh_unmap_file(unsigned char *data, size_t size) {
+#ifdef __MINGW32__
+    free(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+// Parse state while walking a 3DS chunk tree
+typedef struct _MeshLoader {
+    Mesh *mesh;
+    const char *path;
+    const unsigned char *mesh_data;
+    int vertex_capacity;
+    int face_capacity;
+    int object_base;        // first vertex of the current object
+    int object_vertices;    // vertices read for the current object
+    int face_base;          // first face of the current face list
+    int face_list_count;
+    int has_uvs;
+    MeshMaterial *material; // material being read
+} MeshLoader;
+
+static int mesh_parse_chunks(MeshLoader *ld, const unsigned char *p, const unsigned char *end);
+
+static unsigned short read_u16(const unsigned char *p) {
+    unsigned short v;
+    memcpy(&v, p, 2);
+    return v;
+}
+
+static int mesh_reserve(MeshLoader *ld, int vertices, int faces) {
+    Mesh *mesh = ld->mesh;
+    if (mesh->vertex_count+vertices > MESH_MAX_VERTICES) {
+        LOGERR("%s: more than %d vertices\n", ld->path, MESH_MAX_VERTICES);
+        return FALSE;
+    }
+    if (mesh->vertex_count+vertices > ld->vertex_capacity) {
+        int capacity = ld->vertex_capacity ? ld->vertex_capacity : 256;
+        while (capacity < mesh->vertex_count+vertices) capacity *= 2;
+        mesh->vertices = realloc(mesh->vertices, sizeof(Number3D)*capacity);
+        mesh->uvs = realloc(mesh->uvs, sizeof(UV)*capacity);
+        memset(mesh->uvs+ld->vertex_capacity, 0, sizeof(UV)*(capacity-ld->vertex_capacity));
+        ld->vertex_capacity = capacity;
+    }
+    if (mesh->face_count+faces > ld->face_capacity) {
+        int capacity = ld->face_capacity ? ld->face_capacity : 256;
+        while (capacity < mesh->face_count+faces) capacity *= 2;
+        mesh->faces = realloc(mesh->faces, sizeof(Face)*capacity);
+        mesh->face_materials = realloc(mesh->face_materials, sizeof(short)*capacity);
+        ld->face_capacity = capacity;
+    }
+    return TRUE;
+}
+
+// Length of a NUL-terminated name that must end before end, or -1
+static int read_name(const unsigned char *p, const unsigned char *end) {
+    const unsigned char *nul = memchr(p, '\0', end-p);
+    return nul ? (int)(nul-p) : -1;
+}
+
+static void copy_name(char *dst, const unsigned char *src, int len) {
+    if (len >= MESH_NAME_SIZE) len = MESH_NAME_SIZE-1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+// First color sub-chunk of a material color, preferring the linear ones
+static void read_color(const unsigned char *p, const unsigned char *end, Color *color) {
+    while (end-p >= 6) {
+        unsigned short id = read_u16(p);
+        unsigned int len;
+        memcpy(&len, p+2, 4);
+        if (len < 6 || len > (unsigned)(end-p))
+            return;
+        if (id == 0x0011 && len >= 9) {
+            SETCOLOR((*color), p[6], p[7], p[8], 255);
+            return;
+        } else if (id == 0x0010 && len >= 18) {
+            float rgb[3];
+            memcpy(rgb, p+6, sizeof(rgb));
+            SETCOLORF((*color), rgb[0], rgb[1], rgb[2], 1.0f);
+            return;
+        }
+        p += len;
+    }
+}
+
+// Percentage sub-chunk as a fraction
+static float read_percent(const unsigned char *p, const unsigned char *end) {
+    if (end-p >= 8 && read_u16(p) == 0x0030)
+        return (float)(short)read_u16(p+6)/100.0f;
+    if (end-p >= 10 && read_u16(p) == 0x0031) {
+        float f;
+        memcpy(&f, p+6, sizeof(float));
+        return f/100.0f;
+    }
+    return 0.0f;
+}
+
+static int mesh_read_vertices(MeshLoader *ld, const unsigned char *p, const unsigned char *end) {
+    Mesh *mesh = ld->mesh;
+    if (end-p < 2) return FALSE;
+    int count = read_u16(p);
+    if ((size_t)(end-p-2) < sizeof(Number3D)*count || ld->object_vertices != 0) return FALSE;
+    if (!mesh_reserve(ld, count, 0)) return FALSE;
+    ld->object_base = mesh->vertex_count;
+    ld->object_vertices = count;
+    memcpy(mesh->vertices+mesh->vertex_count, p+2, sizeof(Number3D)*count);
+    mesh->vertex_count += count;
+    return TRUE;
+}
+
+static int mesh_read_uvs(MeshLoader *ld, const unsigned char *p, const unsigned char *end) {
+    Mesh *mesh = ld->mesh;
+    if (end-p < 2) return FALSE;
+    int count = read_u16(p);
+    if ((size_t)(end-p-2) < sizeof(UV)*count) return FALSE;
+    if (count != ld->object_vertices) {
+        LOGERR("%s: %d uvs for %d vertices\n", ld->path, count, ld->object_vertices);
+        if (count > ld->object_vertices) count = ld->object_vertices;
+    }
+    memcpy(mesh->uvs+ld->object_base, p+2, sizeof(UV)*count);
+    ld->has_uvs = TRUE;
+    return TRUE;
+}
+
+static int mesh_read_faces(MeshLoader *ld, const unsigned char *p, const unsigned char *end) {
+    Mesh *mesh = ld->mesh;
+    if (end-p < 2) return FALSE;
+    int count = read_u16(p);
+    int i;
+    p += 2;
+    if ((end-p)/8 < count) return FALSE;
+    if (!mesh_reserve(ld, 0, count)) return FALSE;
+    ld->face_base = mesh->face_count;
+    ld->face_list_count = count;
+    for (i=0; i<count; i++, p+=8) {
+        unsigned short a = read_u16(p), b = read_u16(p+2), c = read_u16(p+4);
+        if (a >= ld->object_vertices || b >= ld->object_vertices || c >= ld->object_vertices) {
+            LOGERR("%s: face %d indexes past the vertex list\n", ld->path, i);
+            return FALSE;
+        }
+        mesh->faces[mesh->face_count] = (Face){ld->object_base+a, ld->object_base+b, ld->object_base+c};
+        mesh->face_materials[mesh->face_count] = -1;
+        mesh->face_count++;
+    }
+    // material groups and smoothing follow the face data
+    return mesh_parse_chunks(ld, p, end);
+}
+
+static int mesh_read_face_material(MeshLoader *ld, const unsigned char *p, const unsigned char *end) {
+    Mesh *mesh = ld->mesh;
+    int len = read_name(p, end);
+    if (len < 0) return FALSE;
+    char name[MESH_NAME_SIZE];
+    copy_name(name, p, len);
+    p += len+1;
+    if (end-p < 2) return FALSE;
+    int count = read_u16(p);
+    p += 2;
+    if ((end-p)/2 < count) return FALSE;
+    int m, i;
+    for (m=0; m<mesh->material_count; m++)
+        if (strcmp(mesh->materials[m].name, name) == 0) break;
+    if (m == mesh->material_count) {
+        LOGERR("%s: unknown material %s\n", ld->path, name);
+        return TRUE;
+    }
+    for (i=0; i<count; i++) {
+        int face = read_u16(p+i*2);
+        if (face < ld->face_list_count)
+            mesh->face_materials[ld->face_base+face] = (short)m;
+    }
+    return TRUE;
+}
+
+/* Walk the chunks between p and end. Every chunk must fit inside its
+ * parent, so truncated or corrupt files fail instead of reading past the
+ * mapping.
+ */
+static int mesh_parse_chunks(MeshLoader *ld, const unsigned char *p, const unsigned char *end) {
+    Mesh *mesh = ld->mesh;
+    while (end-p >= 6) {
+        unsigned short id = read_u16(p);
+        unsigned int len;
+        memcpy(&len, p+2, 4);
+        if (len < 6 || len > (unsigned)(end-p)) {
+            LOGERR("%s: chunk %x at %d overruns its parent\n", ld->path, id, (int)(p-ld->mesh_data));
+            return FALSE;
+        }
+        const unsigned char *body = p+6, *body_end = p+len;
+        int ok = TRUE, n;
+        switch(id) {
+        case 0x4d4d:    // main
+        case 0x3d3d:    // editor
+        case 0xa200:    // texture map
+            ok = mesh_parse_chunks(ld, body, body_end);
+            break;
+        case 0x4000:    // named object
+            n = read_name(body, body_end);
+            ok = n >= 0 && mesh_parse_chunks(ld, body+n+1, body_end);
+            break;
+        case 0x4100:    // triangle mesh
+            ld->object_vertices = 0;
+            ld->face_list_count = 0;
+            ok = mesh_parse_chunks(ld, body, body_end);
+            break;
+        case 0x4110:
+            ok = mesh_read_vertices(ld, body, body_end);
+            break;
+        case 0x4120:
+            ok = mesh_read_faces(ld, body, body_end);
+            break;
+        case 0x4130:
+            ok = mesh_read_face_material(ld, body, body_end);
+            break;
+        case 0x4140:
+            ok = mesh_read_uvs(ld, body, body_end);
+            break;
+        case 0xafff:    // material
+            mesh->materials = realloc(mesh->materials, sizeof(MeshMaterial)*(mesh->material_count+1));
+            ld->material = &mesh->materials[mesh->material_count++];
+            memset(ld->material, 0, sizeof(MeshMaterial));
+            SETCOLORF(ld->material->diffuse, 1.0f, 1.0f, 1.0f, 1.0f);
+            ok = mesh_parse_chunks(ld, body, body_end);
+            ld->material = NULL;
+            break;
+        case 0xa000:
+        case 0xa010:
+        case 0xa020:
+        case 0xa030:
+        case 0xa040:
+        case 0xa300:
+            if (ld->material == NULL)
+                break;
+            if (id == 0xa000 || id == 0xa300) {
+                n = read_name(body, body_end);
+                if (n < 0)
+                    ok = FALSE;
+                else
+                    copy_name(id == 0xa000 ? ld->material->name : ld->material->texture, body, n);
+            } else if (id == 0xa040) {
+                ld->material->shininess = read_percent(body, body_end)*128.0f;
+            } else {
+                read_color(body, body_end, id == 0xa010 ? &ld->material->ambient :
+                                           id == 0xa020 ? &ld->material->diffuse : &ld->material->specular);
+            }
+            break;
+        default:
+            break;
+        }
+        if (!ok) {
+            LOGERR("%s: bad chunk %x\n", ld->path, id);
+            return FALSE;
+        }
+        p += len;
+    }
+    return TRUE;
+}
+
+/* Read every triangle mesh in a 3DS file into one vertex and face list,
+ * along with the file's materials.
+ */
+static int mesh_parse(Mesh *mesh, const char *path) {
+    size_t size;
+    unsigned char *data = mesh_map_file(path, &size);
+    if (data == NULL) {
+        LOGERR("%s not found\n", path);
+        return FALSE;
+    }
+    MeshLoader ld;
+    memset(&ld, 0, sizeof(ld));
+    ld.mesh = mesh;
+    ld.path = path;
+    ld.mesh_data = data;
+    int ok = mesh_parse_chunks(&ld, data, data+size);
+    mesh_unmap_file(data, size);
+    if (!ok)
+        return FALSE;
+    if (mesh->vertex_count == 0 || mesh->face_count == 0) {
+        LOGERR("%s: no geometry\n", path);
+        return FALSE;
+    }
+    if (!ld.has_uvs) {
+        LOGERR("%s: no uvs\n", path);
+        free(mesh->uvs);
+        mesh->uvs = NULL;
+    }
+    LOG("%s: read vertices=%d, faces=%d, materials=%d\n", path, mesh->vertex_count, mesh->face_count, mesh->material_count);
+    return TRUE;
+}
+
+static void mesh_build_normals(Mesh *mesh) {
+    mesh->normals = malloc(sizeof(Number3D)*mesh->vertex_count);
+    mesh_compute_normals(mesh->vertices, mesh->vertex_count, mesh->faces, mesh->face_count,
+                         MN_UNIFORM, mesh->normals);
+}
+
+// Angle at p between the edges to q and r
+static float corner_angle(Number3D p, Number3D q, Number3D r) {
+    float d = dot3d(nvec3d(p, q), nvec3d(p, r));
+    if (d > 1.0f) d = 1.0f;
+    if (d < -1.0f) d = -1.0f;
+    return acosf(d);
+}
+
+/* Smooth vertex normals for an indexed triangle list. Each face adds its
+ * normal to its three corners and the sums are normalized afterwards, so
+ * the cost is linear in vertices plus faces. normals must hold
+ * vertex_count entries.
+ */
+void mesh_compute_normals(const Number3D *vertices, int vertex_count, const Face *faces, int face_count,
+                          MeshNormalWeight weight, Number3D *normals) {
+    int i;
+    memset(normals, 0, sizeof(Number3D)*vertex_count);
+    for (i=0; i<face_count; i++) {
+        Number3D a = vertices[faces[i].a];
+        Number3D b = vertices[faces[i].b];
+        Number3D c = vertices[faces[i].c];
+        Number3D e1 = b, e2 = c;
+        sub3d(&e1, a);
+        sub3d(&e2, a);
+        // the cross product's length is twice the face area
+        Number3D n = cross3d(e1, e2);
+        if (weight == MN_AREA) {
+            add3d(&normals[faces[i].a], n);
+            add3d(&normals[faces[i].b], n);
+            add3d(&normals[faces[i].c], n);
+            continue;
+        }
+        norm3d(&n);
+        if (weight == MN_ANGLE) {
+            Number3D w = n;
+            muls3d(&w, corner_angle(a, b, c));
+            add3d(&normals[faces[i].a], w);
+            w = n;
+            muls3d(&w, corner_angle(b, c, a));
+            add3d(&normals[faces[i].b], w);
+            w = n;
+            muls3d(&w, corner_angle(c, a, b));
+            add3d(&normals[faces[i].c], w);
+        } else {
+            add3d(&normals[faces[i].a], n);
+            add3d(&normals[faces[i].b], n);
+            add3d(&normals[faces[i].c], n);
+        }
+    }
+    norm3dv(normals, vertex_count);
+}
+
+/* Area-weighted mesh_compute_normals() over separate x, y and z arrays.
+ * The final normalize pass has no gathers or branches, so the compiler can
+ * vectorize it.
+ */
+void mesh_compute_normals_soa(const float *x, const float *y, const float *z, int vertex_count,
+                              const Face *faces, int face_count, float *nx, float *ny, float *nz) {
+    int i;
+    memset(nx, 0, sizeof(float)*vertex_count);
+    memset(ny, 0, sizeof(float)*vertex_count);
+    memset(nz, 0, sizeof(float)*vertex_count);
+    for (i=0; i<face_count; i++) {
+        int a = faces[i].a, b = faces[i].b, c = faces[i].c;
+        float e1x = x[b]-x[a], e1y = y[b]-y[a], e1z = z[b]-z[a];
+        float e2x = x[c]-x[a], e2y = y[c]-y[a], e2z = z[c]-z[a];
+        float cx = e1y*e2z-e1z*e2y;
+        float cy = e1z*e2x-e1x*e2z;
+        float cz = e1x*e2y-e1y*e2x;
+        nx[a] += cx; ny[a] += cy; nz[a] += cz;
+        nx[b] += cx; ny[b] += cy; nz[b] += cz;
+        nx[c] += cx; ny[c] += cy; nz[c] += cz;
+    }
+    norm3ds((Stream3D){nx, ny, nz}, vertex_count);
+}
+
+/* Local box around the vertices, always including the origin as the
+ * model loader always has, and a radius that encloses the box.
+ */
+static void mesh_build_bounds(Mesh *mesh) {
+    Number3D min, max;
+    int i;
+    bounds3dv(mesh->vertices, mesh->vertex_count, &min, &max);
+    // the box has always taken in the model origin too
+    mesh->aabb.min = (Number3D){fminf(min.x, 0.0f), fminf(min.y, 0.0f), fminf(min.z, 0.0f)};
+    mesh->aabb.max = (Number3D){fmaxf(max.x, 0.0f), fmaxf(max.y, 0.0f), fmaxf(max.z, 0.0f)};
+    Number3D corners[8] = {{mesh->aabb.min.x, mesh->aabb.min.y, mesh->aabb.max.z},
+                           {mesh->aabb.max.x, mesh->aabb.min.y, mesh->aabb.max.z},
+                           {mesh->aabb.max.x, mesh->aabb.min.y, mesh->aabb.min.z},
+                           {mesh->aabb.min.x, mesh->aabb.min.y, mesh->aabb.min.z},
+                           {mesh->aabb.min.x, mesh->aabb.max.y, mesh->aabb.max.z},
+                           {mesh->aabb.max.x, mesh->aabb.max.y, mesh->aabb.max.z},
+                           {mesh->aabb.max.x, mesh->aabb.max.y, mesh->aabb.min.z},
+                           {mesh->aabb.min.x, mesh->aabb.max.y, mesh->aabb.min.z}};
+    for (i=0; i<8; i++) {
+        float m = len3d(corners[i]);
+        if (m > mesh->radius) mesh->radius = m;
+    }
+}
+
+/* Simplify the full faces into coarser levels of detail, each aiming at
+ * half the faces of the one before, and append them to the face list. The
+ * chain stops at MESH_MAX_LODS levels, once a level gets too small or too
+ * far from the full surface, or when simplifying stops paying off.
+ */
+static void mesh_build_lods(Mesh *mesh) {
+    Face *scratch = malloc(sizeof(Face)*mesh->face_count);
+    int total = mesh->face_count;
+    int target = mesh->face_count/2;
+    float error;
+    mesh->lods[0] = (MeshLOD){0, mesh->face_count, 0.0f};
+    mesh->lod_count = 1;
+    while (mesh->lod_count < MESH_MAX_LODS && target >= MESH_LOD_MIN_FACES && mesh->radius > 0.0f) {
+        const MeshLOD *previous = &mesh->lods[mesh->lod_count-1];
+        int count = simplify_faces(mesh->vertices, mesh->vertex_count, mesh->faces, mesh->face_count,
+                                   target, mesh->radius*MESH_LOD_MAX_ERROR, scratch, &error);
+        if (count == 0 || count > previous->face_count*3/4)
+            break;
+        meshopt_optimize_cache(scratch, count, mesh->vertex_count, NULL);
+        mesh->faces = realloc(mesh->faces, sizeof(Face)*(total+count));
+        memcpy(mesh->faces+total, scratch, sizeof(Face)*count);
+        mesh->lods[mesh->lod_count++] = (MeshLOD){total, count, error/mesh->radius};
+        LOG("%s: LOD %d has %d faces, error %.4f\n", mesh->path, mesh->lod_count-1, count, error/mesh->radius);
+        total += count;
+        target = count/2;
+    }
+    free(scratch);
+}
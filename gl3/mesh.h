@@ -0,0 +1,88 @@
+/* mesh.h - shared meshes
+ * Reference-counted geometry loaded once and shared between models
+ * Copyright 2012 Keath Milligan
+ */
+
+#ifndef MESH_H_
+#define MESH_H_
+
+#include "types.h"
+#include "texture.h"
+#include "bvh.h"
+#include "objects.h"
+
+#define MESH_NAME_SIZE 64
+#define MESH_MAX_VERTICES (1<<24)
+#define MESH_BATCH_VERTICES 65536   // most vertices one 16-bit batch can reach
+#define MESH_MAX_LODS 4                 // levels of detail, counting the full mesh
+#define MESH_LOD_MIN_FACES 64           // smallest level worth generating
+#define MESH_LOD_MAX_ERROR 0.1f         // furthest a level may stray, as a fraction of the radius
+
+// Surface properties from a material chunk
+typedef struct _MeshMaterial {
+    char name[MESH_NAME_SIZE];
+    Color ambient;
+    Color diffuse;
+    Color specular;
+    float shininess;
+    char texture[MESH_NAME_SIZE];   // texture map file named by the material
+} MeshMaterial;
+
+// How face normals are weighted when summed into vertex normals
+typedef enum {
+    MN_UNIFORM,     // each face counts the same
+    MN_AREA,        // by face area
+    MN_ANGLE        // by the face's angle at the vertex
+} MeshNormalWeight;
+
+#define MESH_COOKED_EXT ".sg3mesh"
+
+// Geometry, texture and bounds shared by every model drawn from one file.
+// Objects only hold a reference; the mesh is freed on the last release.
+// Loaded meshes live in a cooked blob: vertices holds packed positions for
+// ray casts and interleaved the draw data, normals and uvs included, so
+// normals and uvs are NULL (uvs are zero in meshes without them). Meshes
+// split into 16-bit batches draw from split_vertices instead, which
+// repeats vertices that batches share. faces holds face_count full-detail
+// faces followed by the faces of the coarser levels of detail.
+typedef struct _Mesh {
+    int id;
+    char *path;
+    int refcount;
+    Number3D *vertices;
+    Number3D *normals;
+    UV *uvs;
+    Face *faces;
+    int vertex_count;
+    int face_count;
+    InterleavedVertex *interleaved;
+    Face16 *draw_faces;             // 16-bit faces to draw, NULL to draw faces as 32-bit
+    IndexBatch *batches;            // sub-batches when split for 16-bit indices
+    int batch_count;
+    MeshLOD lods[MESH_MAX_LODS];
+    int lod_count;
+    InterleavedVertex *split_vertices;
+    short *face_materials;          // material index per face, -1 for none
+    MeshMaterial *materials;
+    int material_count;
+    Texture *texture;
+    AABB aabb;
+    float radius;
+    BVH *bvh;
+    GeometryBuffers *buffers;
+    void *blob;                     // cooked data the arrays point into
+    size_t blob_size;
+    int blob_mapped;
+    UT_hash_handle hh;
+} Mesh;
+
+Mesh *mesh_load(const char *resources, const char *mesh_name);
+Mesh *mesh_retain(Mesh *mesh);
+void mesh_release(Mesh *mesh);
+void mesh_set_index_uint(int supported);
+void mesh_compute_normals(const Number3D *vertices, int vertex_count, const Face *faces, int face_count,
+                          MeshNormalWeight weight, Number3D *normals);
+void mesh_compute_normals_soa(const float *x, const float *y, const float *z, int vertex_count,
+                              const Face *faces, int face_count, float *nx, float *ny, float *nz);
+
+#endif /* MESH_H_ */
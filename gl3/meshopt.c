@@ -0,0 +1,345 @@
+/* meshopt.c - mesh optimization
+ * Triangle and vertex ordering for the post-transform cache, vertex fetch
+ * and overdraw
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <log/log.h>
+#include "meshopt.h"
+#include "math.h"
+
+// Forsyth's linear-speed vertex cache optimization, scored against an LRU
+// cache of FORSYTH_CACHE_SIZE entries
+#define FORSYTH_CACHE_SIZE 32
+#define FORSYTH_DECAY 1.5f
+#define FORSYTH_LAST_TRI 0.75f
+#define FORSYTH_VALENCE_SCALE 2.0f
+#define FORSYTH_VALENCE_POWER 0.5f
+
+/* Simulate a FIFO post-transform cache over the triangle list and return
+ * the vertices transformed per triangle: 3.0 is no reuse at all, and
+ * well-ordered meshes come close to 0.5.
+ */
+float meshopt_acmr(const Face *faces, int face_count, int vertex_count, int cache_size) {
+    if (face_count == 0)
+        return 0.0f;
+    int *stamp = malloc(sizeof(int)*vertex_count);
+    int i, j, time = 0, misses = 0;
+    for (i=0; i<vertex_count; i++)
+        stamp[i] = -cache_size-1;
+    for (i=0; i<face_count; i++) {
+        unsigned int v[3] = { faces[i].a, faces[i].b, faces[i].c };
+        for (j=0; j<3; j++) {
+            // a vertex is cached while fewer than cache_size misses followed it
+            if (time-stamp[v[j]] > cache_size) {
+                stamp[v[j]] = time++;
+                misses++;
+            }
+        }
+    }
+    free(stamp);
+    return (float)misses/(float)face_count;
+}
+
+static float forsyth_score(int cache_position, int remaining) {
+    float score = 0.0f;
+    if (remaining == 0)
+        return -1.0f;
+    if (cache_position >= 0) {
+        if (cache_position < 3) {
+            score = FORSYTH_LAST_TRI;
+        } else {
+            float s = 1.0f-(float)(cache_position-3)/(float)(FORSYTH_CACHE_SIZE-3);
+            score = powf(s, FORSYTH_DECAY);
+        }
+    }
+    return score+FORSYTH_VALENCE_SCALE*powf((float)remaining, -FORSYTH_VALENCE_POWER);
+}
+
+/* Reorder triangles so consecutive ones share vertices still in the
+ * post-transform cache. order, if given, receives the old index of each
+ * triangle in the new order.
+ */
+void meshopt_optimize_cache(Face *faces, int face_count, int vertex_count, int *order) {
+    int *offsets = calloc(vertex_count+1, sizeof(int));
+    int *remaining = calloc(vertex_count, sizeof(int));
+    int *adjacency = malloc(sizeof(int)*face_count*3);
+    int *cache_position = malloc(sizeof(int)*vertex_count);
+    float *vertex_score = malloc(sizeof(float)*vertex_count);
+    float *face_score = malloc(sizeof(float)*face_count);
+    char *emitted = calloc(face_count, 1);
+    int *new_order = malloc(sizeof(int)*face_count);
+    int cache[FORSYTH_CACHE_SIZE+3];
+    int cache_count = 0;
+    int i, j, k, next = 0, best = -1;
+
+    // triangles around each vertex
+    for (i=0; i<face_count; i++) {
+        remaining[faces[i].a]++;
+        remaining[faces[i].b]++;
+        remaining[faces[i].c]++;
+    }
+    for (i=0; i<vertex_count; i++)
+        offsets[i+1] = offsets[i]+remaining[i];
+    memset(cache_position, 0, sizeof(int)*vertex_count);
+    for (i=0; i<face_count; i++) {
+        unsigned int v[3] = { faces[i].a, faces[i].b, faces[i].c };
+        for (j=0; j<3; j++)
+            adjacency[offsets[v[j]]+cache_position[v[j]]++] = i;
+    }
+    for (i=0; i<vertex_count; i++) {
+        cache_position[i] = -1;
+        vertex_score[i] = forsyth_score(-1, remaining[i]);
+    }
+    for (i=0; i<face_count; i++)
+        face_score[i] = vertex_score[faces[i].a]+vertex_score[faces[i].b]+vertex_score[faces[i].c];
+
+    for (k=0; k<face_count; k++) {
+        if (best < 0) {
+            // nothing scored in the cache, take the next triangle not drawn
+            while (emitted[next]) next++;
+            best = next;
+        }
+        new_order[k] = best;
+        emitted[best] = 1;
+        unsigned int v[3] = { faces[best].a, faces[best].b, faces[best].c };
+
+        // move the triangle's vertices to the front of the cache
+        int updated[FORSYTH_CACHE_SIZE+3];
+        int updated_count = 0;
+        for (j=0; j<3; j++) {
+            int p;
+            for (p=0; p<updated_count && updated[p] != (int)v[j]; p++);
+            if (p == updated_count)
+                updated[updated_count++] = v[j];
+            // drop the triangle from the vertex's list
+            int *list = &adjacency[offsets[v[j]]];
+            for (p=0; p<remaining[v[j]]; p++) {
+                if (list[p] == best) {
+                    list[p] = list[--remaining[v[j]]];
+                    break;
+                }
+            }
+        }
+        for (i=0; i<cache_count; i++) {
+            int p;
+            for (p=0; p<3 && cache[i] != (int)v[p]; p++);
+            if (p == 3)
+                updated[updated_count++] = cache[i];
+        }
+        for (i=0; i<cache_count; i++)
+            cache_position[cache[i]] = -1;
+        cache_count = updated_count < FORSYTH_CACHE_SIZE ? updated_count : FORSYTH_CACHE_SIZE;
+        memcpy(cache, updated, sizeof(int)*cache_count);
+        for (i=0; i<cache_count; i++)
+            cache_position[cache[i]] = i;
+
+        // rescore the vertices that moved, including ones pushed out
+        best = -1;
+        float best_score = -1.0f;
+        for (i=0; i<updated_count; i++) {
+            int vertex = updated[i];
+            float delta = forsyth_score(cache_position[vertex], remaining[vertex])-vertex_score[vertex];
+            vertex_score[vertex] += delta;
+            int *list = &adjacency[offsets[vertex]];
+            for (j=0; j<remaining[vertex]; j++) {
+                face_score[list[j]] += delta;
+                if (i < cache_count && face_score[list[j]] > best_score) {
+                    best_score = face_score[list[j]];
+                    best = list[j];
+                }
+            }
+        }
+    }
+
+    Face *sorted = malloc(sizeof(Face)*face_count);
+    for (i=0; i<face_count; i++)
+        sorted[i] = faces[new_order[i]];
+    memcpy(faces, sorted, sizeof(Face)*face_count);
+    if (order)
+        memcpy(order, new_order, sizeof(int)*face_count);
+    free(sorted);
+    free(offsets);
+    free(remaining);
+    free(adjacency);
+    free(cache_position);
+    free(vertex_score);
+    free(face_score);
+    free(emitted);
+    free(new_order);
+}
+
+// Run of cache-ordered triangles kept together by the overdraw pass
+typedef struct _Cluster {
+    int first;
+    int count;
+    float sort;
+} Cluster;
+
+static int cluster_compare(const void *a, const void *b) {
+    float d = ((const Cluster*)b)->sort-((const Cluster*)a)->sort;
+    return d > 0.0f ? 1 : (d < 0.0f ? -1 : ((const Cluster*)a)->first-((const Cluster*)b)->first);
+}
+
+/* Reorder runs of a cache-optimized triangle list so that outward-facing
+ * parts of the mesh draw first and hide what is behind them. Runs end where
+ * the cache restarts anyway, or where the run so far is within threshold
+ * of the mesh's ACMR and the next triangle misses at least twice, so a
+ * threshold of 1.05 gives up about 5% of the cache efficiency.
+ */
+void meshopt_optimize_overdraw(Face *faces, int face_count, const Number3D *vertices, int vertex_count,
+                               float threshold, int *order) {
+    int *stamp = malloc(sizeof(int)*vertex_count);
+    Cluster *clusters = malloc(sizeof(Cluster)*face_count);
+    int cluster_count = 0;
+    int i, j, time = 0, cluster_misses = 0;
+    float acmr = meshopt_acmr(faces, face_count, vertex_count, MESHOPT_CACHE_SIZE);
+    Number3D centroid = NUM3D(0.0f, 0.0f, 0.0f);
+
+    for (i=0; i<vertex_count; i++) {
+        stamp[i] = -MESHOPT_CACHE_SIZE-1;
+        add3d(&centroid, vertices[i]);
+    }
+    if (vertex_count > 0)
+        muls3d(&centroid, 1.0f/(float)vertex_count);
+    for (i=0; i<face_count; i++) {
+        unsigned int v[3] = { faces[i].a, faces[i].b, faces[i].c };
+        int misses = 0;
+        for (j=0; j<3; j++) {
+            if (time-stamp[v[j]] > MESHOPT_CACHE_SIZE) {
+                stamp[v[j]] = time++;
+                misses++;
+            }
+        }
+        Cluster *c = cluster_count ? &clusters[cluster_count-1] : NULL;
+        if (c == NULL || misses == 3 ||
+            (misses >= 2 && (float)cluster_misses <= acmr*threshold*(float)c->count)) {
+            c = &clusters[cluster_count++];
+            c->first = i;
+            c->count = 0;
+            cluster_misses = 0;
+        }
+        c->count++;
+        cluster_misses += misses;
+    }
+
+    // clusters facing away from the middle of the mesh go first
+    for (i=0; i<cluster_count; i++) {
+        Number3D normal = NUM3D(0.0f, 0.0f, 0.0f);
+        Number3D center = NUM3D(0.0f, 0.0f, 0.0f);
+        float area = 0.0f;
+        for (j=clusters[i].first; j<clusters[i].first+clusters[i].count; j++) {
+            Number3D a = vertices[faces[j].a], b = vertices[faces[j].b], c = vertices[faces[j].c];
+            Number3D e1 = b, e2 = c;
+            sub3d(&e1, a);
+            sub3d(&e2, a);
+            Number3D n = cross3d(e1, e2);
+            float w = len3d(n);
+            add3d(&normal, n);
+            Number3D mid = a;
+            add3d(&mid, b);
+            add3d(&mid, c);
+            muls3d(&mid, w/3.0f);
+            add3d(&center, mid);
+            area += w;
+        }
+        if (area > 0.0f)
+            muls3d(&center, 1.0f/area);
+        sub3d(&center, centroid);
+        norm3d(&normal);
+        clusters[i].sort = dot3d(center, normal);
+    }
+    qsort(clusters, cluster_count, sizeof(Cluster), cluster_compare);
+
+    int *new_order = malloc(sizeof(int)*face_count);
+    int k = 0;
+    for (i=0; i<cluster_count; i++)
+        for (j=0; j<clusters[i].count; j++)
+            new_order[k++] = clusters[i].first+j;
+    meshopt_permute(faces, sizeof(Face), face_count, new_order);
+    if (order)
+        memcpy(order, new_order, sizeof(int)*face_count);
+    free(new_order);
+    free(stamp);
+    free(clusters);
+}
+
+/* Renumber vertices in the order the triangles first use them so vertex
+ * fetches walk memory forwards. Unused vertices move to the end. remap
+ * receives the new index of each old vertex; returns the number used.
+ */
+int meshopt_optimize_fetch(Face *faces, int face_count, int vertex_count, int *remap) {
+    int i, next = 0;
+    for (i=0; i<vertex_count; i++)
+        remap[i] = -1;
+    for (i=0; i<face_count; i++) {
+        if (remap[faces[i].a] < 0) remap[faces[i].a] = next++;
+        if (remap[faces[i].b] < 0) remap[faces[i].b] = next++;
+        if (remap[faces[i].c] < 0) remap[faces[i].c] = next++;
+        faces[i].a = remap[faces[i].a];
+        faces[i].b = remap[faces[i].b];
+        faces[i].c = remap[faces[i].c];
+    }
+    int used = next;
+    for (i=0; i<vertex_count; i++)
+        if (remap[i] < 0) remap[i] = next++;
+    return used;
+}
+
+/* Move element i of an array of count elements of size bytes to remap[i].
+ */
+void meshopt_remap(void *data, size_t size, int count, const int *remap) {
+    char *copy = malloc(size*count);
+    int i;
+    memcpy(copy, data, size*count);
+    for (i=0; i<count; i++)
+        memcpy((char*)data+size*remap[i], copy+size*i, size);
+    free(copy);
+}
+
+/* Rearrange an array so element i becomes the old element order[i].
+ */
+void meshopt_permute(void *data, size_t size, int count, const int *order) {
+    char *copy = malloc(size*count);
+    int i;
+    memcpy(copy, data, size*count);
+    for (i=0; i<count; i++)
+        memcpy((char*)data+size*i, copy+size*order[i], size);
+    free(copy);
+}
+
+/* Run the cache, optional overdraw and fetch passes over an indexed mesh,
+ * keeping per-vertex normals and uvs and per-face attributes (any may be
+ * NULL) in step. An overdraw_threshold of 0 skips the overdraw pass.
+ */
+void meshopt_optimize(Number3D *vertices, Number3D *normals, UV *uvs, int vertex_count,
+                      Face *faces, short *face_attributes, int face_count,
+                      float overdraw_threshold, MeshOptStats *stats) {
+    if (face_count == 0)
+        return;
+    int *order = malloc(sizeof(int)*face_count);
+    int *remap = malloc(sizeof(int)*vertex_count);
+    float before = meshopt_acmr(faces, face_count, vertex_count, MESHOPT_CACHE_SIZE);
+    meshopt_optimize_cache(faces, face_count, vertex_count, order);
+    if (face_attributes)
+        meshopt_permute(face_attributes, sizeof(short), face_count, order);
+    if (overdraw_threshold > 0.0f) {
+        meshopt_optimize_overdraw(faces, face_count, vertices, vertex_count, overdraw_threshold, order);
+        if (face_attributes)
+            meshopt_permute(face_attributes, sizeof(short), face_count, order);
+    }
+    meshopt_optimize_fetch(faces, face_count, vertex_count, remap);
+    meshopt_remap(vertices, sizeof(Number3D), vertex_count, remap);
+    if (normals)
+        meshopt_remap(normals, sizeof(Number3D), vertex_count, remap);
+    if (uvs)
+        meshopt_remap(uvs, sizeof(UV), vertex_count, remap);
+    if (stats) {
+        stats->acmr_before = before;
+        stats->acmr_after = meshopt_acmr(faces, face_count, vertex_count, MESHOPT_CACHE_SIZE);
+    }
+    free(order);
+    free(remap);
+}
@@ -0,0 +1,34 @@
+/* meshopt.h - mesh optimization
+ * Triangle and vertex ordering for the post-transform cache, vertex fetch
+ * and overdraw
+ * Copyright 2012 Keath Milligan
+ */
+
+#ifndef MESHOPT_H_
+#define MESHOPT_H_
+
+#include "types.h"
+#include "texture.h"
+
+#define MESHOPT_CACHE_SIZE 16       // FIFO entries used to measure ACMR
+#define MESHOPT_OVERDRAW_THRESHOLD 1.05f
+
+// Average cache miss ratio (transformed vertices per triangle) before and
+// after meshopt_optimize
+typedef struct _MeshOptStats {
+    float acmr_before;
+    float acmr_after;
+} MeshOptStats;
+
+float meshopt_acmr(const Face *faces, int face_count, int vertex_count, int cache_size);
+void meshopt_optimize_cache(Face *faces, int face_count, int vertex_count, int *order);
+void meshopt_optimize_overdraw(Face *faces, int face_count, const Number3D *vertices, int vertex_count,
+                               float threshold, int *order);
+int meshopt_optimize_fetch(Face *faces, int face_count, int vertex_count, int *remap);
+void meshopt_remap(void *data, size_t size, int count, const int *remap);
+void meshopt_permute(void *data, size_t size, int count, const int *order);
+void meshopt_optimize(Number3D *vertices, Number3D *normals, UV *uvs, int vertex_count,
+                      Face *faces, short *face_attributes, int face_count,
+                      float overdraw_threshold, MeshOptStats *stats);
+
+#endif /* MESHOPT_H_ */
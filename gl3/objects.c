@@ -5,24 +5,42 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/stat.h>
+#include <stddef.h>
 #include <log/log.h>
 #include "gl.h"
 #include "objects.h"
 #include "math.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "meshopt.h"
+#include "glstate.h"
+#include "matrix.h"
 #include "scene.h"
 
 static void object3d_init(Object3D *object);
 static void object3d_cleanup(Object3D *object);
+static int object3d_defer_destroy(Object3D *object);
 static void object3d_render_setup(const Object3D *object, int orient);
 static void object3d_render(const Object3D *object);
 static void object3d_render_cleanup(const Object3D *object, int pop);
+static void object3d_push_transform(const Object3D *object);
+static int object3d_draw_mode(const Object3D *object);
+static void object3d_bind_geometry(const Object3D *object);
+static void object3d_bind_vertices(const Object3D *object, int base);
+static void object3d_draw_elements(const Object3D *object, int mode);
+static void object3d_build_draw_faces(Object3D *object);
+static void object3d_upload_geometry(Object3D *object);
+static void object3d_release_geometry(Object3D *object);
+static void object3d_alloc_geometry(Object3D *object, int vertices, int normals, int uvs, int faces);
 static int object3d_add_vertex(Object3D *object, Number3D coord, UV uv, Number3D normal);
 static void object3d_add_face(Object3D *object, int a, int b, int c);
 static void object3d_add_quad_face(Object3D *object, int ul, int ur, int lr, int ll);
 static void object3d_build_aabb(Object3D *object);
 static void object3d_calculate_radius(Object3D *object);
+static void object3d_bounds(const Object3D *object, Number3D *center, float *radius, AABB *box);
+static void object3d_transform_box(const float *m, AABB local, AABB *box);
 static void objectgroup_render(const ObjectGroup *group);
+static void objectgroup_bounds(const ObjectGroup *group, Number3D *center, float *radius, AABB *box);
 static void objectgroup_destroy(ObjectGroup *group);
 static void wireline_render(const WireLine *obj);
 static void wireline_destroy(WireLine *obj);
@@ -36,6 +54,20 @@ static void panel_destroy(Panel *obj);
 static void cube_destroy(Cube *obj);
 static void model_destroy(Model *obj);
 static void billboard_render(Billboard *obj);
+static void billboard_bounds(const Billboard *obj, Number3D *center, float *radius, AABB *box);
+
+static int default_buffered = FALSE;
+static unsigned int hierarchy_generation = 0;
+
+// Material last set by object3d_render_setup
+static struct {
+    int material_valid;
+    Color ambient;
+    Color diffuse;
+    Color specular;
+    Color emission;
+    float shininess;
+} applied = { FALSE };
 
 static void object3d_init(Object3D *object) {
     SET3D(object->scale, 1.0f, 1.0f, 1.0f);
@@ -52,80 +84,165 @@ static void object3d_init(Object3D *object) {
     object->smooth_shading = TRUE;
     object->line_width = 2.0f;
     object->point_size = 3.0f;
+    object->bounds = object3d_bounds;
+    idmx(object->world);
+    idmx(object->world_inverse);
+    object->transform_flags = OBJ3D_TRANSFORM_DIRTY|OBJ3D_BOUNDS_DIRTY;
+    object3d_set_buffered(object, default_buffered);
 }
 
 static void object3d_cleanup(Object3D *object) {
+    if (object->parent)
+        object3d_detach(object);
+    while (object->first_child)
+        object3d_detach(object->first_child);
+    if (object->mesh) {
+        // geometry, bounds and buffers belong to the mesh
+        if (object->texture && object->texture != object->mesh->texture)
+            texture_destroy(object->texture);
+        mesh_release(object->mesh);
+        return;
+    }
+    object3d_release_geometry(object);
+    if (object->bvh) bvh_destroy(object->bvh);
     if (object->texture) texture_destroy(object->texture);
-    if (object->vertices) free(object->vertices);
-    if (object->normals) free(object->normals);
-    if (object->uvs) free(object->uvs);
-    if (object->faces) free(object->faces);
+    if (object->geometry) {
+        arena_destroy(object->geometry);
+    } else {
+        if (object->vertices) free(object->vertices);
+        if (object->normals) free(object->normals);
+        if (object->uvs) free(object->uvs);
+        if (object->faces) free(object->faces);
+    }
+    if (object->draw_faces) free(object->draw_faces);
+}
+
+/* Objects still held by a published scene state are only detached from
+ * their parents when destroyed, and destroyed again with the last hold.
+ * Returns TRUE if the object was kept.
+ */
+static int object3d_defer_destroy(Object3D *object) {
+    if (object->holds == 0)
+        return FALSE;
+    if (object->parent)
+        object3d_detach(object);
+    object->destroy_pending = TRUE;
+    return TRUE;
+}
+
+/* Keep an object alive for a published scene state, see scene_publish().
+ */
+void object3d_hold(Object3D *object) {
+    object->holds++;
+}
+
+void object3d_release(Object3D *object) {
+    if (--object->holds == 0 && object->destroy_pending)
+        object->destroy(object);
+}
+
+/* Allocate an object's own geometry arrays together in one arena, leaving
+ * out those with no elements. Sizes are in elements.
+ */
+static void object3d_alloc_geometry(Object3D *object, int vertices, int normals, int uvs, int faces) {
+    Arena *arena = arena_create(ARENA_SIZE(sizeof(Number3D)*vertices)+ARENA_SIZE(sizeof(Number3D)*normals)+
+                                ARENA_SIZE(sizeof(UV)*uvs)+ARENA_SIZE(sizeof(Face)*faces));
+    object->geometry = arena;
+    object->vertices = vertices ? arena_alloc(arena, sizeof(Number3D)*vertices) : NULL;
+    object->normals = normals ? arena_alloc(arena, sizeof(Number3D)*normals) : NULL;
+    object->uvs = uvs ? arena_alloc(arena, sizeof(UV)*uvs) : NULL;
+    object->faces = faces ? arena_alloc(arena, sizeof(Face)*faces) : NULL;
+}
+
+/* Forget the cached material. Call whenever it may have been changed
+ * outside object3d_render_setup, e.g. by glColor with color tracking on.
+ */
+void object3d_reset_render_state() {
+    applied.material_valid = FALSE;
+}
+
+static void object3d_apply_material(const Object3D *object) {
+    if (applied.material_valid &&
+        COLORLV(applied.ambient) == COLORLV(object->ambient) &&
+        COLORLV(applied.diffuse) == COLORLV(object->diffuse) &&
+        COLORLV(applied.specular) == COLORLV(object->specular) &&
+        COLORLV(applied.emission) == COLORLV(object->emission) &&
+        applied.shininess == object->shininess)
+        return;
+    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, COLORFA(object->ambient));
+    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, COLORFA(object->diffuse));
+    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, COLORFA(object->specular));
+    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, COLORFA(object->emission));
+    glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, &object->shininess);
+    applied.ambient = object->ambient;
+    applied.diffuse = object->diffuse;
+    applied.specular = object->specular;
+    applied.emission = object->emission;
+    applied.shininess = object->shininess;
+    applied.material_valid = TRUE;
 }
 
 static void object3d_render_setup(const Object3D *object, int orient) {
-    if (object->no_depth_test) glDisable(GL_DEPTH_TEST);
-    if (object->visible) {
+    if (object->no_depth_test) glstate_disable(GL_DEPTH_TEST);
+    if (OBJ3D_STATE(object, visible)) {
         if (!object->wireframe && !object->draw_points) {
-            if (object->additive_blend) glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-            glNormalPointer(GL_FLOAT, 0, object->normals);
-            glEnableClientState(GL_NORMAL_ARRAY);
-            object->lighting_enabled? glEnable(GL_LIGHTING) : glDisable(GL_LIGHTING);
-            object->smooth_shading? glShadeModel(GL_SMOOTH) : glShadeModel(GL_FLAT);
+            glstate_blend_func(GL_SRC_ALPHA, object->additive_blend? GL_ONE : GL_ONE_MINUS_SRC_ALPHA);
+            glstate_enable_client(GL_NORMAL_ARRAY);
+            glstate_set(GL_LIGHTING, object->lighting_enabled);
+            glstate_shade_model(object->smooth_shading? GL_SMOOTH : GL_FLAT);
             if (object->materials_enabled) {
-                glDisable(GL_COLOR_MATERIAL);
-                glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, COLORFA(object->ambient));
-                glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, COLORFA(object->diffuse));
-                glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, COLORFA(object->specular));
-                glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, COLORFA(object->emission));
-                glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, &object->shininess);
+                glstate_disable(GL_COLOR_MATERIAL);
+                object3d_apply_material(object);
             } else {
-                glEnable(GL_COLOR_MATERIAL);
+                // color tracking rewrites the material
+                glstate_enable(GL_COLOR_MATERIAL);
+                applied.material_valid = FALSE;
                 glColor4f(COLORFL(object->color));
             }
             if (object->texture && object->textures_enabled) {
                 texture_activate(object->texture);
-                glTexCoordPointer(2, GL_FLOAT, 0, object->uvs);
-                glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+                glstate_enable_client(GL_TEXTURE_COORD_ARRAY);
             } else {
-                glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+                glstate_disable_client(GL_TEXTURE_COORD_ARRAY);
             }
 
             glFrontFace(GL_CCW);
-            if (object->double_sided)
-                glDisable(GL_CULL_FACE);
-            else
-                glEnable(GL_CULL_FACE);
+            glstate_set(GL_CULL_FACE, !object->double_sided);
         } else {
-            glEnable(GL_COLOR_MATERIAL);
+            glstate_enable(GL_COLOR_MATERIAL);
+            applied.material_valid = FALSE;
             glColor4f(COLORFL(object->color));
-            glNormalPointer(GL_FLOAT, 0, object->normals);
-            glDisable(GL_LIGHTING);
-            glEnable(GL_LINE_SMOOTH);
+            glstate_disable(GL_LIGHTING);
+            glstate_enable(GL_LINE_SMOOTH);
             glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
             glLineWidth(object->line_width);
             glPointSize(object->point_size);
         }
     }
-    if (orient) {
-        glPushMatrix();
-        glTranslatef(object->position.x, object->position.y, object->position.z);
-        glMultMatrixf(object->rotation);
-        glScalef(object->scale.x, object->scale.y, object->scale.z);
-    }
+    if (orient)
+        object3d_push_transform(object);
+}
+
+/* Objects draw under their world matrix, so children of a group can be
+ * drawn on their own as well as through the group.
+ */
+static void object3d_push_transform(const Object3D *object) {
+    matrix_push();
+    matrix_mult(OBJ3D_WORLD(object));
+}
+
+static int object3d_draw_mode(const Object3D *object) {
+    if (object->wireframe)
+        return GL_LINES;
+    else if (object->draw_points)
+        return GL_POINTS;
+    return GL_TRIANGLES;
 }
 
 static void object3d_render(const Object3D *object) {
     object3d_render_setup(object, TRUE);
-    glVertexPointer(3, GL_FLOAT, 0, object->vertices);
-    int draw_mode;
-    if (object->wireframe) {
-        draw_mode = GL_LINES;
-    } else if (object->draw_points) {
-        draw_mode = GL_POINTS;
-    } else {
-        draw_mode = GL_TRIANGLES;
-    }
-    glDrawElements(draw_mode, object->face_count*3, GL_UNSIGNED_SHORT, object->faces);
+    object3d_bind_geometry(object);
+    object3d_draw_elements(object, object3d_draw_mode(object));
     object3d_render_cleanup(object, TRUE);
     if (object->render_aabb) {
         Number3D verts[8] = {{object->aabb.min.x, object->aabb.min.y, object->aabb.max.z},
@@ -136,20 +253,13 @@ static void object3d_render(const Object3D *object) {
                              {object->aabb.max.x, object->aabb.max.y, object->aabb.max.z},
                              {object->aabb.max.x, object->aabb.max.y, object->aabb.min.z},
                              {object->aabb.min.x, object->aabb.max.y, object->aabb.min.z}};
-        float rot[16];
-        dupmx(rot, object->rotation);
-        invmx(rot);
-        int i;
-        for (i=0; i<8; i++) {
-            trmx3d(&verts[i], rot);
-            mul3d(&verts[i], object->scale);
-            add3d(&verts[i], object->position);
-        }
-        glDisable(GL_DEPTH_TEST);
-        glDisable(GL_LIGHTING);
-        glEnable(GL_COLOR_MATERIAL);
+        // drawn in the object's own frame, so the corners need no transforming
+        object3d_push_transform(object);
+        glstate_disable(GL_DEPTH_TEST);
+        glstate_disable(GL_LIGHTING);
+        glstate_enable(GL_COLOR_MATERIAL);
         glColor4f(COLORFL(object->color));
-        glEnable(GL_LINE_SMOOTH);
+        glstate_enable(GL_LINE_SMOOTH);
         glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
         glLineWidth(object->line_width);
         glPointSize(object->point_size);
@@ -167,12 +277,325 @@ static void object3d_render(const Object3D *object) {
         v[7] = verts[7];
         glVertexPointer(3, GL_FLOAT, 0, v);
         glDrawArrays(GL_LINES, 0, 8);
+        matrix_pop();
+        object3d_reset_render_state();
     }
 }
 
+/* True if b can be drawn in the same batch as a: both draw the same mesh
+ * through the default renderer with identical material and render state,
+ * so only the transform differs.
+ */
+int object3d_can_instance(const Object3D *a, const Object3D *b) {
+    return a->mesh != NULL && a->mesh == b->mesh &&
+           a->render == (Object3DFPtr)object3d_render && b->render == a->render &&
+           !a->render_aabb && !b->render_aabb &&
+           a->texture == b->texture && a->textures_enabled == b->textures_enabled &&
+           a->buffers == b->buffers && OBJ3D_STATE(a, lod) == OBJ3D_STATE(b, lod) &&
+           COLORLV(a->color) == COLORLV(b->color) &&
+           COLORLV(a->ambient) == COLORLV(b->ambient) &&
+           COLORLV(a->diffuse) == COLORLV(b->diffuse) &&
+           COLORLV(a->specular) == COLORLV(b->specular) &&
+           COLORLV(a->emission) == COLORLV(b->emission) &&
+           a->shininess == b->shininess &&
+           a->double_sided == b->double_sided &&
+           a->lighting_enabled == b->lighting_enabled &&
+           a->materials_enabled == b->materials_enabled &&
+           a->smooth_shading == b->smooth_shading &&
+           a->wireframe == b->wireframe &&
+           a->draw_points == b->draw_points &&
+           a->additive_blend == b->additive_blend &&
+           a->no_depth_test == b->no_depth_test &&
+           a->line_width == b->line_width &&
+           a->point_size == b->point_size;
+}
+
+/* Pick the coarsest level of detail whose error, scaled by the radius in
+ * pixels of the object's projected bounding sphere, stays within
+ * pixel_error pixels. Levels only change once the error passes the limit
+ * by a fraction hysteresis either way, so an object hovering at a switch
+ * distance does not pop back and forth.
+ */
+int object3d_select_lod(Object3D *object, float projected_radius, float pixel_error, float hysteresis) {
+    int lod = object->lod;
+    if (object->lod_count < 2)
+        return object->lod = 0;
+    if (lod >= object->lod_count)
+        lod = object->lod_count-1;
+    while (lod+1 < object->lod_count &&
+           object->lods[lod+1].error*projected_radius <= pixel_error*(1.0f-hysteresis))
+        lod++;
+    while (lod > 0 && object->lods[lod].error*projected_radius > pixel_error*(1.0f+hysteresis))
+        lod--;
+    return object->lod = lod;
+}
+
+/* Draw several instances of one mesh that object3d_can_instance() accepts.
+ * State and geometry are set up once from the first object and only the
+ * matrix changes between draws, which is the fixed-function stand-in for
+ * hardware instancing.
+ */
+void object3d_render_instances(Object3D **objects, int count) {
+    const Object3D *first = objects[0];
+    int mode = object3d_draw_mode(first);
+    int i;
+    object3d_render_setup(first, FALSE);
+    object3d_bind_geometry(first);
+    for (i=0; i<count; i++) {
+        object3d_push_transform(objects[i]);
+        object3d_draw_elements(first, mode);
+        matrix_pop();
+    }
+    object3d_render_cleanup(first, FALSE);
+}
+
 static void object3d_render_cleanup(const Object3D *object, int pop) {
+#if SG3_BUFFER_OBJECTS
+    if (object->buffers) {
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+#endif
     if (object->texture) texture_deactivate(object->texture);
-    if (pop) glPopMatrix();
+    if (pop) matrix_pop();
+}
+
+/* Point the vertex, normal and UV arrays at the object's geometry, either
+ * in its buffer objects (uploading first if the geometry changed) or in
+ * client memory.
+ */
+static void object3d_bind_geometry(const Object3D *object) {
+#if SG3_BUFFER_OBJECTS
+    if (object->buffers && object->interleaved) {
+        if (object->buffers->dirty)
+            object3d_upload_geometry((Object3D*)object);
+        glBindBuffer(GL_ARRAY_BUFFER, object->buffers->ids[GEOMETRY_VERTEX_BUFFER]);
+        object3d_bind_vertices(object, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, object->buffers->ids[GEOMETRY_INDEX_BUFFER]);
+        return;
+    }
+    if (object->buffers) {
+        if (object->buffers->dirty)
+            object3d_upload_geometry((Object3D*)object);
+        if (object->normals) {
+            glBindBuffer(GL_ARRAY_BUFFER, object->buffers->ids[GEOMETRY_NORMAL_BUFFER]);
+            glNormalPointer(GL_FLOAT, 0, NULL);
+        } else {
+            glstate_disable_client(GL_NORMAL_ARRAY);
+        }
+        if (object->uvs) {
+            glBindBuffer(GL_ARRAY_BUFFER, object->buffers->ids[GEOMETRY_UV_BUFFER]);
+            glTexCoordPointer(2, GL_FLOAT, 0, NULL);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, object->buffers->ids[GEOMETRY_VERTEX_BUFFER]);
+        glVertexPointer(3, GL_FLOAT, 0, NULL);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, object->buffers->ids[GEOMETRY_INDEX_BUFFER]);
+        return;
+    }
+#endif
+    if (object->interleaved) {
+        object3d_bind_vertices(object, 0);
+        return;
+    }
+    if (object->normals)
+        glNormalPointer(GL_FLOAT, 0, object->normals);
+    else
+        glstate_disable_client(GL_NORMAL_ARRAY);
+    if (object->uvs)
+        glTexCoordPointer(2, GL_FLOAT, 0, object->uvs);
+    glVertexPointer(3, GL_FLOAT, 0, object->vertices);
+}
+
+/* Point the arrays at interleaved vertices from base on, in the bound
+ * vertex buffer or in client memory.
+ */
+static void object3d_bind_vertices(const Object3D *object, int base) {
+    const char *v = (const char*)(object->interleaved+base);
+#if SG3_BUFFER_OBJECTS
+    if (object->buffers)
+        v = (const char*)(size_t)(sizeof(InterleavedVertex)*base);
+#endif
+    glNormalPointer(GL_FLOAT, sizeof(InterleavedVertex), v+offsetof(InterleavedVertex, normal));
+    glTexCoordPointer(2, GL_FLOAT, sizeof(InterleavedVertex), v+offsetof(InterleavedVertex, uv));
+    glVertexPointer(3, GL_FLOAT, sizeof(InterleavedVertex), v+offsetof(InterleavedVertex, position));
+}
+
+static void object3d_draw_elements(const Object3D *object, int mode) {
+    const char *indices = object->draw_faces ? (const char*)object->draw_faces : (const char*)object->faces;
+    int first = 0, count = object->face_count, lod = OBJ3D_STATE(object, lod);
+    int i;
+#if SG3_BUFFER_OBJECTS
+    if (object->buffers)
+        indices = NULL;
+#endif
+    if (object->batch_count > 1) {
+        for (i=0; i<object->batch_count; i++) {
+            const IndexBatch *batch = &object->batches[i];
+            if (i > 0)
+                object3d_bind_vertices(object, batch->base_vertex);
+            glDrawElements(mode, batch->face_count*3, GL_UNSIGNED_SHORT, indices+sizeof(Face16)*batch->first_face);
+        }
+        if (i > 1)
+            object3d_bind_vertices(object, 0);
+        return;
+    }
+    if (lod > 0) {
+        first = object->lods[lod].first_face;
+        count = object->lods[lod].face_count;
+    }
+    if (object->draw_faces)
+        glDrawElements(mode, count*3, GL_UNSIGNED_SHORT, indices+sizeof(Face16)*first);
+    else
+        glDrawElements(mode, count*3, GL_UNSIGNED_INT, indices+sizeof(Face)*first);
+}
+
+/* Keep a 16-bit copy of the faces of objects that own small enough
+ * geometry, which every target can draw.
+ */
+static void object3d_build_draw_faces(Object3D *object) {
+    int i;
+    if (object->draw_faces) {
+        free(object->draw_faces);
+        object->draw_faces = NULL;
+    }
+    if (object->faces == NULL || object->vertex_count > 65536)
+        return;
+    object->draw_faces = malloc(sizeof(Face16)*object->face_count);
+    for (i=0; i<object->face_count; i++)
+        object->draw_faces[i] = (Face16){object->faces[i].a, object->faces[i].b, object->faces[i].c};
+}
+
+static void object3d_upload_geometry(Object3D *object) {
+#if SG3_BUFFER_OBJECTS
+    GeometryBuffers *b = object->buffers;
+    if (b->ids[GEOMETRY_VERTEX_BUFFER] == 0) {
+        glGenBuffers(GEOMETRY_BUFFERS, b->ids);
+        LOGDEBUG("created buffers %u-%u for object %p\n", b->ids[0], b->ids[GEOMETRY_BUFFERS-1], object);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, b->ids[GEOMETRY_VERTEX_BUFFER]);
+    if (object->interleaved) {
+        // one buffer holds positions, normals and uvs; split meshes carry
+        // extra copies of the vertices their batches share
+        int count = object->batch_count ? object->batches[object->batch_count-1].base_vertex+
+                                           object->batches[object->batch_count-1].vertex_count : object->vertex_count;
+        glBufferData(GL_ARRAY_BUFFER, sizeof(InterleavedVertex)*count, object->interleaved, GL_STATIC_DRAW);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Number3D)*object->vertex_count, object->vertices, GL_STATIC_DRAW);
+    }
+    if (object->normals && !object->interleaved) {
+        glBindBuffer(GL_ARRAY_BUFFER, b->ids[GEOMETRY_NORMAL_BUFFER]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Number3D)*object->vertex_count, object->normals, GL_STATIC_DRAW);
+    }
+    if (object->uvs && !object->interleaved) {
+        glBindBuffer(GL_ARRAY_BUFFER, b->ids[GEOMETRY_UV_BUFFER]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(UV)*object->vertex_count, object->uvs, GL_STATIC_DRAW);
+    }
+    // levels of detail follow the full faces in the same index buffer
+    int face_count = object->lod_count > 1 ? object->lods[object->lod_count-1].first_face+
+                                             object->lods[object->lod_count-1].face_count : object->face_count;
+    if (object->draw_faces) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, b->ids[GEOMETRY_INDEX_BUFFER]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Face16)*face_count, object->draw_faces, GL_STATIC_DRAW);
+    } else if (object->faces) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, b->ids[GEOMETRY_INDEX_BUFFER]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Face)*face_count, object->faces, GL_STATIC_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    b->dirty = FALSE;
+#endif
+}
+
+static void object3d_release_geometry(Object3D *object) {
+    if (object->mesh) {
+        object->buffers = NULL;
+    } else if (object->buffers) {
+#if SG3_BUFFER_OBJECTS
+        if (object->buffers->ids[GEOMETRY_VERTEX_BUFFER])
+            glDeleteBuffers(GEOMETRY_BUFFERS, object->buffers->ids);
+#endif
+        free(object->buffers);
+        object->buffers = NULL;
+    }
+}
+
+/* Set whether newly created objects keep their geometry in buffer objects.
+ */
+void object3d_set_default_buffered(int buffered) {
+    default_buffered = buffered;
+}
+
+/* Opt an object in or out of buffer-object rendering. Geometry is uploaded
+ * on the next render; disabling frees the buffers, so call from the GL thread.
+ */
+void object3d_set_buffered(Object3D *object, int buffered) {
+    object->buffered = buffered;
+#if SG3_BUFFER_OBJECTS
+    if (buffered && object->buffers == NULL) {
+        GeometryBuffers **buffers = object->mesh ? &object->mesh->buffers : &object->buffers;
+        if (*buffers == NULL) {
+            *buffers = calloc(1, sizeof(GeometryBuffers));
+            (*buffers)->dirty = TRUE;
+        }
+        object->buffers = *buffers;
+    } else if (!buffered) {
+        object3d_release_geometry(object);
+    }
+#endif
+}
+
+/* Draw an object from a shared mesh instead of its own geometry. The object
+ * takes a reference to the mesh and must not have geometry of its own.
+ */
+void object3d_set_mesh(Object3D *object, Mesh *mesh) {
+    Mesh *previous = object->mesh;
+    object3d_release_geometry(object);
+    object->mesh = mesh_retain(mesh);
+    if (previous) mesh_release(previous);
+    object->vertices = mesh->vertices;
+    object->normals = mesh->normals;
+    object->uvs = mesh->uvs;
+    object->faces = mesh->faces;
+    object->draw_faces = mesh->draw_faces;
+    object->batches = mesh->batches;
+    object->batch_count = mesh->batch_count;
+    object->lods = mesh->lods;
+    object->lod_count = mesh->lod_count;
+    object->lod = 0;
+    object->vertex_count = mesh->vertex_count;
+    object->face_count = mesh->face_count;
+    object->interleaved = mesh->interleaved;
+    object->texture = mesh->texture;
+    object->aabb = mesh->aabb;
+    object->radius = mesh->radius;
+    object->bvh = mesh->bvh;
+    object3d_invalidate_bounds(object);
+    object3d_set_buffered(object, object->buffered);
+}
+
+/* Flag an object's geometry as changed so buffered objects re-upload it.
+ */
+void object3d_invalidate_geometry(Object3D *object) {
+    if (object->mesh == NULL) object3d_build_draw_faces(object);
+    if (object->buffers) object->buffers->dirty = TRUE;
+}
+
+/* Reorder an object's own triangles and vertices for the vertex cache and
+ * fetch, and for overdraw when overdraw_threshold is above 0. Meshes are
+ * optimized when they are cooked, so mesh-backed objects are left alone.
+ */
+void object3d_optimize_geometry(Object3D *object, float overdraw_threshold) {
+    MeshOptStats stats;
+    if (object->mesh || object->faces == NULL || object->vertices == NULL)
+        return;
+    meshopt_optimize(object->vertices, object->normals, object->uvs, object->vertex_count,
+                     object->faces, NULL, object->face_count, overdraw_threshold, &stats);
+    LOG("object %p: ACMR %.3f -> %.3f\n", object, stats.acmr_before, stats.acmr_after);
+    if (object->bvh) {
+        bvh_destroy(object->bvh);
+        object->bvh = bvh_build_mesh(object->vertices, object->faces, object->face_count);
+    }
+    object3d_invalidate_geometry(object);
 }
 
 static int object3d_add_vertex(Object3D *object, Number3D coord, UV uv, Number3D normal) {
@@ -184,7 +607,7 @@ static int object3d_add_vertex(Object3D *object, Number3D coord, UV uv, Number3D
 }
 
 static void object3d_add_face(Object3D *object, int a, int b, int c) {
-    object->faces[object->face_count] = (Face){(short)a, (short)b, (short)c};
+    object->faces[object->face_count] = (Face){a, b, c};
     object->face_count++;
 }
 
@@ -193,30 +616,44 @@ static void object3d_add_quad_face(Object3D *object, int ul, int ur, int lr, int
     object3d_add_face(object, ul, ll, lr);
 }
 
-int object3d_ray_intersects(Object3D *object, Line3D ray, Number3D *where) {
-    if (object->face_count == 0) return FALSE;
-    Number3D dx = nvec3d(ray.p0, object->position);
-    if (dot3d(dx, ray.p1) < 0.0f) return FALSE;
-    trmx3d(&ray.p0, object->rotation);
-    trmx3d(&ray.p1, object->rotation);
-    sub3d(&ray.p0, object->position);
-    div3d(&ray.p0, object->scale);
-    Number3D w;
-    if (isxcube3d(ray, object->aabb, &w)) {
-        int i;
-        for (i=0; i<object->face_count; i++) {
-            Triangle3D face;
-            face.a = object->vertices[object->faces[i].a];
-            face.b = object->vertices[object->faces[i].b];
-            face.c = object->vertices[object->faces[i].c];
-            Number3D n = cross3d(vec3d(face.a, face.b), vec3d(face.a, face.c));
-            norm3d(&n);
-            float a = dot3d(ray.p1, n);
-            if (a < 0.0f) {
-                if (isxtri3d(ray, face, where)) return TRUE;
-            }
+/* Cast a ray (origin p0, direction p1) against an object's triangles.
+ * The ray is carried into the object's local space by the cached world
+ * inverse, with a direction that keeps t in world units, then traced
+ * through the model's BVH when it has one. With any_hit the first
+ * triangle found ends the search.
+ */
+int object3d_ray_cast(const Object3D *object, Line3D ray, float tmax, int any_hit, float *t) {
+    if (object->face_count == 0 || object->vertices == NULL) return FALSE;
+    const float *inverse = object3d_world_inverse(object);
+    trpt3d(&ray.p0, inverse);
+    trdir3d(&ray.p1, inverse);
+    float tnear = 0.0f, tfar = tmax;
+    if (!raycube3d(ray, object->aabb, &tnear, &tfar)) return FALSE;
+    if (object->bvh != NULL)
+        return bvh_intersect_mesh(object->bvh, object->vertices, object->faces, ray, tmax, any_hit, t) >= 0;
+    int i, hit = FALSE;
+    for (i=0; i<object->face_count; i++) {
+        float th;
+        if (raytri3d(ray, object->vertices[object->faces[i].a],
+                     object->vertices[object->faces[i].b],
+                     object->vertices[object->faces[i].c], &th) && th <= tmax) {
+            tmax = th;
+            hit = TRUE;
+            if (any_hit) break;
         }
     }
+    if (hit) *t = tmax;
+    return hit;
+}
+
+int object3d_ray_intersects(Object3D *object, Line3D ray, Number3D *where) {
+    float t;
+    if (object3d_ray_cast(object, ray, FLT_MAX, TRUE, &t)) {
+        *where = ray.p1;
+        muls3d(where, t);
+        add3d(where, ray.p0);
+        return TRUE;
+    }
     return FALSE;
 }
 
@@ -231,6 +668,7 @@ static void object3d_build_aabb(Object3D *object) {
         if (object->vertices[i].z < object->aabb.min.z) object->aabb.min.z = object->vertices[i].z;
     }
     object3d_calculate_radius(object);
+    object3d_invalidate_bounds(object);
 }
 
 static void object3d_calculate_radius(Object3D *object) {
@@ -249,6 +687,200 @@ static void object3d_calculate_radius(Object3D *object) {
     }
 }
 
+/* The world transform is translate*rotate*scale under the parent's world
+ * transform, rebuilt when a setter has marked it dirty or the parent's has
+ * been rebuilt since. The caches are filled in on demand, so the const
+ * accessors write to them.
+ */
+static void object3d_update_transform(Object3D *object) {
+    if (object->parent)
+        object3d_update_transform(object->parent);
+    object3d_refresh_transform(object);
+}
+
+/* Rebuild the world transform if needed, taking the parent's as up to
+ * date. Walking a hierarchy parents first brings it all up to date.
+ */
+void object3d_refresh_transform(Object3D *object) {
+    Object3D *parent = object->parent;
+    if (parent && object->parent_generation != parent->transform_generation)
+        object->transform_flags |= OBJ3D_TRANSFORM_DIRTY;
+    if (!(object->transform_flags & OBJ3D_TRANSFORM_DIRTY))
+        return;
+    float *m = object->world;
+    int i;
+    dupmx(m, object->rotation);
+    for (i=0; i<4; i++) {
+        m[i] *= object->scale.x;
+        m[4+i] *= object->scale.y;
+        m[8+i] *= object->scale.z;
+    }
+    for (i=0; i<4; i++) {
+        m[4*i] += object->position.x*m[4*i+3];
+        m[4*i+1] += object->position.y*m[4*i+3];
+        m[4*i+2] += object->position.z*m[4*i+3];
+    }
+    if (parent) {
+        mulmx(m, parent->world);
+        object->parent_generation = parent->transform_generation;
+    }
+    dupmx(object->world_inverse, m);
+    invmx(object->world_inverse);
+    object->transform_generation++;
+    object->transform_flags = (object->transform_flags&~OBJ3D_TRANSFORM_DIRTY)|OBJ3D_BOUNDS_DIRTY;
+}
+
+const float *object3d_world_matrix(const Object3D *object) {
+    object3d_update_transform((Object3D*)object);
+    return object->world;
+}
+
+const float *object3d_world_inverse(const Object3D *object) {
+    object3d_update_transform((Object3D*)object);
+    return object->world_inverse;
+}
+
+/* World-space bounding sphere and AABB of an object as it will be rendered.
+ */
+void object3d_world_bounds(const Object3D *object, Number3D *center, float *radius, AABB *box) {
+    Object3D *o = (Object3D*)object;
+    object3d_update_transform(o);
+    if (o->transform_flags & (OBJ3D_BOUNDS_DIRTY|OBJ3D_BOUNDS_VOLATILE)) {
+        o->bounds(o, &o->world_center, &o->world_radius, &o->world_box);
+        o->transform_flags &= ~OBJ3D_BOUNDS_DIRTY;
+    }
+    *center = o->world_center;
+    *radius = o->world_radius;
+    *box = o->world_box;
+}
+
+void object3d_set_position(Object3D *object, Number3D position) {
+    object->position = position;
+    object3d_invalidate_transform(object);
+}
+
+void object3d_set_scale(Object3D *object, Number3D scale) {
+    object->scale = scale;
+    object3d_invalidate_transform(object);
+}
+
+void object3d_set_rotation(Object3D *object, const float *rotation) {
+    dupmx(object->rotation, rotation);
+    object3d_invalidate_transform(object);
+}
+
+/* Flag the world transform as stale after position, scale or rotation
+ * have been written directly.
+ */
+void object3d_invalidate_transform(Object3D *object) {
+    object->transform_flags |= OBJ3D_TRANSFORM_DIRTY;
+    object3d_invalidate_bounds(object);
+}
+
+/* Flag the world bounds of an object, and of the groups holding it, as
+ * stale after its geometry has changed.
+ */
+void object3d_invalidate_bounds(Object3D *object) {
+    for (; object; object=object->parent)
+        object->transform_flags |= OBJ3D_BOUNDS_DIRTY;
+}
+
+/* Make child's transform relative to parent, moving it and its subtree
+ * from wherever it was. Children keep the order they were attached in.
+ * Attaching an object under itself or one of its descendants is refused.
+ */
+void object3d_attach(Object3D *parent, Object3D *child) {
+    Object3D *p;
+    for (p=parent; p; p=p->parent) {
+        if (p == child) {
+            LOGERR("can't attach object %p under its own subtree\n", child);
+            return;
+        }
+    }
+    if (child->parent)
+        object3d_detach(child);
+    child->parent = parent;
+    child->next_sibling = NULL;
+    if (parent->first_child) {
+        child->prev_sibling = parent->first_child->prev_sibling;
+        parent->first_child->prev_sibling->next_sibling = child;
+        parent->first_child->prev_sibling = child;
+    } else {
+        child->prev_sibling = child;
+        parent->first_child = child;
+    }
+    if (child->transform_flags & OBJ3D_BOUNDS_VOLATILE)
+        for (p=parent; p; p=p->parent)
+            p->transform_flags |= OBJ3D_BOUNDS_VOLATILE;
+    object3d_invalidate_transform(child);
+    hierarchy_generation++;
+}
+
+/* Cut child and its subtree loose from its parent, leaving it in world
+ * space at its local transform.
+ */
+void object3d_detach(Object3D *child) {
+    Object3D *parent = child->parent;
+    if (parent == NULL)
+        return;
+    if (child->prev_sibling == child) {
+        parent->first_child = NULL;
+    } else if (child == parent->first_child) {
+        child->next_sibling->prev_sibling = child->prev_sibling;
+        parent->first_child = child->next_sibling;
+    } else {
+        child->prev_sibling->next_sibling = child->next_sibling;
+        if (child->next_sibling)
+            child->next_sibling->prev_sibling = child->prev_sibling;
+        else
+            parent->first_child->prev_sibling = child->prev_sibling;
+    }
+    object3d_invalidate_bounds(parent);
+    child->parent = NULL;
+    child->next_sibling = child->prev_sibling = NULL;
+    object3d_invalidate_transform(child);
+    hierarchy_generation++;
+}
+
+/* Bumped by every attach and detach, for code keeping its own view of
+ * object hierarchies.
+ */
+unsigned int object3d_hierarchy_generation() {
+    return hierarchy_generation;
+}
+
+/* Largest scale the world transform applies along any local axis.
+ */
+static float world_scale(const float *m) {
+    float s = len3d(NUM3D(m[M00], m[M01], m[M02]));
+    float t = len3d(NUM3D(m[M10], m[M11], m[M12]));
+    if (t > s) s = t;
+    t = len3d(NUM3D(m[M20], m[M21], m[M22]));
+    return t > s ? t : s;
+}
+
+static void object3d_bounds(const Object3D *object, Number3D *center, float *radius, AABB *box) {
+    *center = NUM3D(object->world[M30], object->world[M31], object->world[M32]);
+    *radius = object->radius*world_scale(object->world);
+    object3d_transform_box(object->world, object->aabb, box);
+}
+
+/* Transform a local box by a world matrix, returning the world-aligned box
+ * that encloses it.
+ */
+static void object3d_transform_box(const float *m, AABB local, AABB *box) {
+    Number3D c = NUM3D((local.min.x+local.max.x)*0.5f, (local.min.y+local.max.y)*0.5f, (local.min.z+local.max.z)*0.5f);
+    Number3D e = NUM3D((local.max.x-local.min.x)*0.5f, (local.max.y-local.min.y)*0.5f, (local.max.z-local.min.z)*0.5f);
+    Number3D we = NUM3D(fabsf(m[M00])*e.x+fabsf(m[M10])*e.y+fabsf(m[M20])*e.z,
+                        fabsf(m[M01])*e.x+fabsf(m[M11])*e.y+fabsf(m[M21])*e.z,
+                        fabsf(m[M02])*e.x+fabsf(m[M12])*e.y+fabsf(m[M22])*e.z);
+    trpt3d(&c, m);
+    box->min = c;
+    sub3d(&box->min, we);
+    box->max = c;
+    add3d(&box->max, we);
+}
+
 #define BASE ((Object3D*)group)
 
 ObjectGroup *objectgroup_create() {
@@ -256,45 +888,64 @@ ObjectGroup *objectgroup_create() {
     object3d_init(BASE);
     BASE->render = (Object3DFPtr)objectgroup_render;
     BASE->destroy = (Object3DFPtr)objectgroup_destroy;
+    BASE->bounds = (Object3DBoundsFPtr)objectgroup_bounds;
     return group;
 }
 
 void objectgroup_add_object(ObjectGroup *group, Object3D *object) {
-    Object3DList *e = malloc(sizeof(Object3DList));
-    e->object = object;
-    LL_APPEND(group->objects, e);
-    group->size++;
+    object3d_attach(BASE, object);
 }
 
 void objectgroup_remove_object(ObjectGroup *group, Object3D *object) {
-    Object3DList *e, *t;
-    LL_FOREACH_SAFE(group->objects, e, t) {
-        if (e->object == object) {
-            LL_DELETE(group->objects, e);
-        }
-    }
+    if (object->parent == BASE)
+        object3d_detach(object);
 }
 
 static void objectgroup_render(const ObjectGroup *group) {
-    Object3DList *e;
-    if (BASE->visible) {
-        glPushMatrix();
-        glTranslatef(BASE->position.x, BASE->position.y, BASE->position.z);
-        glMultMatrixf(BASE->rotation);
-        glScalef(BASE->scale.x, BASE->scale.y, BASE->scale.z);
-        LL_FOREACH(group->objects, e) {
-            e->object->render(e->object);
+    Object3D *child;
+    if (OBJ3D_STATE(BASE, visible)) {
+        for (child=BASE->first_child; child; child=child->next_sibling)
+            child->render(child);
+    }
+}
+
+/* The box around the children's world boxes, which already include the
+ * group's transform.
+ */
+static void objectgroup_bounds(const ObjectGroup *group, Number3D *center, float *radius, AABB *box) {
+    Object3D *child;
+    int first = TRUE;
+    for (child=BASE->first_child; child; child=child->next_sibling) {
+        Number3D c;
+        float r;
+        AABB b;
+        object3d_world_bounds(child, &c, &r, &b);
+        if (first) {
+            *box = b;
+            first = FALSE;
+        } else {
+            if (b.min.x < box->min.x) box->min.x = b.min.x;
+            if (b.min.y < box->min.y) box->min.y = b.min.y;
+            if (b.min.z < box->min.z) box->min.z = b.min.z;
+            if (b.max.x > box->max.x) box->max.x = b.max.x;
+            if (b.max.y > box->max.y) box->max.y = b.max.y;
+            if (b.max.z > box->max.z) box->max.z = b.max.z;
         }
-        glPopMatrix();
     }
+    if (first) {
+        object3d_bounds(BASE, center, radius, box);
+        return;
+    }
+    *center = NUM3D((box->min.x+box->max.x)*0.5f, (box->min.y+box->max.y)*0.5f, (box->min.z+box->max.z)*0.5f);
+    *radius = len3d(vec3d(box->min, box->max))*0.5f;
 }
 
 static void objectgroup_destroy(ObjectGroup *group) {
-    Object3DList *e, *t;
-    LL_FOREACH_SAFE(group->objects, e, t) {
-        e->object->destroy(e->object);
-        free(e);
-    }
+    if (object3d_defer_destroy(BASE))
+        return;
+    // each child detaches itself as it goes
+    while (BASE->first_child)
+        BASE->first_child->destroy(BASE->first_child);
     object3d_cleanup(BASE);
     free(group);
 }
@@ -308,7 +959,7 @@ WireLine *wireline_create(Line3D line, Color color) {
     BASE->wireframe = TRUE;
     BASE->color = color;
     obj->line = line;
-    BASE->vertices = malloc(sizeof(Line3D));
+    object3d_alloc_geometry(BASE, 2, 0, 0, 0);
     BASE->vertex_count = 2;
     memcpy(BASE->vertices, &line, sizeof(Line3D));
     BASE->render = (Object3DFPtr)wireline_render;
@@ -319,12 +970,14 @@ WireLine *wireline_create(Line3D line, Color color) {
 
 static void wireline_render(const WireLine *obj) {
     object3d_render_setup(BASE, TRUE);
-    glVertexPointer(3, GL_FLOAT, 0, BASE->vertices);
+    object3d_bind_geometry(BASE);
     glDrawArrays(GL_LINES, 0, 2);
     object3d_render_cleanup(BASE, TRUE);
 }
 
 static void wireline_destroy(WireLine *obj) {
+    if (object3d_defer_destroy(BASE))
+        return;
     object3d_cleanup(BASE);
     free(obj);
 }
@@ -338,7 +991,7 @@ WireTriangle *wiretriangle_create(float width, float height, Color color) {
     BASE->color = color;
     obj->width = width;
     obj->height = height;
-    BASE->vertices = malloc(sizeof(Number3D)*3);
+    object3d_alloc_geometry(BASE, 3, 0, 0, 0);
     BASE->vertex_count = 3;
     SET3D(BASE->vertices[0], w, -h, 0.0f);
     SET3D(BASE->vertices[1], 0.0f, h, 0.0f);
@@ -351,12 +1004,14 @@ WireTriangle *wiretriangle_create(float width, float height, Color color) {
 
 static void wiretriangle_render(const WireTriangle *obj) {
     object3d_render_setup(BASE, TRUE);
-    glVertexPointer(3, GL_FLOAT, 0, BASE->vertices);
+    object3d_bind_geometry(BASE);
     glDrawArrays(GL_LINE_LOOP, 0, 3);
     object3d_render_cleanup(BASE, TRUE);
 }
 
 static void wiretriangle_destroy(WireTriangle *obj) {
+    if (object3d_defer_destroy(BASE))
+        return;
     object3d_cleanup(BASE);
     free(obj);
 }
@@ -370,7 +1025,7 @@ WireRectangle *wirerectangle_create(float width, float height, Color color) {
     BASE->color = color;
     obj->width = width;
     obj->height = height;
-    BASE->vertices = malloc(sizeof(Number3D)*4);
+    object3d_alloc_geometry(BASE, 4, 0, 0, 0);
     BASE->vertex_count = 4;
     SET3D(BASE->vertices[0], -w,  h, 0.0f);
     SET3D(BASE->vertices[1],  w,  h, 0.0f);
@@ -384,12 +1039,14 @@ WireRectangle *wirerectangle_create(float width, float height, Color color) {
 
 static void wirerectangle_render(const WireRectangle *obj) {
     object3d_render_setup(BASE, TRUE);
-    glVertexPointer(3, GL_FLOAT, 0, BASE->vertices);
+    object3d_bind_geometry(BASE);
     glDrawArrays(GL_LINES, 0, 4);
     object3d_render_cleanup(BASE, TRUE);
 }
 
 static void wirerectangle_destroy(WireRectangle *obj) {
+    if (object3d_defer_destroy(BASE))
+        return;
     object3d_cleanup(BASE);
     free(obj);
 }
@@ -405,7 +1062,7 @@ WireCube *wirecube_create(float width, float height, float depth, Color color) {
     obj->width = width;
     obj->height = height;
     obj->depth = depth;
-    BASE->vertices = malloc(sizeof(Number3D)*16);
+    object3d_alloc_geometry(BASE, 16, 0, 0, 0);
     BASE->vertex_count = 16;
     SET3D(BASE->vertices[ 0], -w,  h, -d);
     SET3D(BASE->vertices[ 1],  w,  h, -d);
@@ -431,7 +1088,7 @@ WireCube *wirecube_create(float width, float height, float depth, Color color) {
 
 static void wirecube_render(const WireCube *obj) {
     object3d_render_setup(BASE, TRUE);
-    glVertexPointer(3, GL_FLOAT, 0, BASE->vertices);
+    object3d_bind_geometry(BASE);
     glDrawArrays(GL_LINE_LOOP, 0, 4);
     glDrawArrays(GL_LINE_LOOP, 4, 4);
     glDrawArrays(GL_LINES, 8, 8);
@@ -439,6 +1096,8 @@ static void wirecube_render(const WireCube *obj) {
 }
 
 static void wirecube_destroy(WireCube *obj) {
+    if (object3d_defer_destroy(BASE))
+        return;
     object3d_cleanup(BASE);
     free(obj);
 }
@@ -455,10 +1114,7 @@ int panel_init(Panel *obj, float width, float height, Texture *texture) {
     obj->height = height;
     float w = width/2.0f;
     float h = height/2.0f;
-    BASE->vertices = malloc(sizeof(Number3D)*4);
-    BASE->uvs = malloc(sizeof(UV)*4);
-    BASE->normals = malloc(sizeof(Number3D)*4);
-    BASE->faces = malloc(sizeof(Face)*2);
+    object3d_alloc_geometry(BASE, 4, 4, 4, 2);
     int ul, ur, lr, ll;
     ur = object3d_add_vertex(BASE, (Number3D){ w,  h, 0.0f}, (UV){1.0f, 0.0f}, (Number3D){0.0f, 0.0f, 1.0f});
     ul = object3d_add_vertex(BASE, (Number3D){-w,  h, 0.0f}, (UV){0.0f, 0.0f}, (Number3D){0.0f, 0.0f, 1.0f});
@@ -469,10 +1125,13 @@ int panel_init(Panel *obj, float width, float height, Texture *texture) {
     BASE->render = (Object3DFPtr)object3d_render;
     BASE->destroy = (Object3DFPtr)panel_destroy;
     object3d_build_aabb(BASE);
+    object3d_build_draw_faces(BASE);
     return TRUE;
 }
 
 static void panel_destroy(Panel *obj) {
+    if (object3d_defer_destroy(BASE))
+        return;
     object3d_cleanup(BASE);
     free(obj);
 }
@@ -486,10 +1145,7 @@ Cube *cube_create(float width, float height, float depth, Texture *texture) {
     BASE->texture = texture;
     BASE->render = (Object3DFPtr)object3d_render;
     BASE->destroy = (Object3DFPtr)cube_destroy;
-    BASE->vertices = malloc(sizeof(Number3D)*24);
-    BASE->normals = malloc(sizeof(Number3D)*24);
-    BASE->uvs = malloc(sizeof(Number3D)*24);
-    BASE->faces = malloc(sizeof(Face)*12);
+    object3d_alloc_geometry(BASE, 24, 24, 24, 12);
     float w = width/2.0f;
     float h = height/2.0f;
     float d = depth/2.0f;
@@ -525,10 +1181,13 @@ Cube *cube_create(float width, float height, float depth, Texture *texture) {
     ll = object3d_add_vertex(BASE, (Number3D){-w, -h, -d}, (UV){0.0f, 1.0f}, (Number3D){0, -1.0f, 0.0f});
     object3d_add_quad_face(BASE, ul, ur, lr, ll);
     object3d_build_aabb(BASE);
+    object3d_build_draw_faces(BASE);
     return obj;
 }
 
 static void cube_destroy(Cube *obj) {
+    if (object3d_defer_destroy(BASE))
+        return;
     object3d_cleanup(BASE);
     free(obj);
 }
@@ -537,46 +1196,70 @@ Billboard *billboard_create(float width, float height, Texture *texture, Camera
     Billboard *obj = calloc(1, sizeof(Billboard));
     panel_init((Panel*)obj, width, height, texture);
     BASE->render = (Object3DFPtr)billboard_render;
+    BASE->bounds = (Object3DBoundsFPtr)billboard_bounds;
     BASE->materials_enabled = FALSE;
     BASE->color = COLOR(255, 255, 255, 255);
     obj->type = type;
     obj->camera = camera;
+    // fixed_proximity billboards follow the camera
+    BASE->transform_flags |= OBJ3D_BOUNDS_VOLATILE;
     object3d_build_aabb(BASE);
     return obj;
 }
 
 static void billboard_render(Billboard *obj) {
+    const float *world = OBJ3D_WORLD(BASE);
+    Number3D position = NUM3D(world[M30], world[M31], world[M32]);
+    Number3D eye = CAMERA_STATE(obj->camera, position);
+    Number3D up = CAMERA_STATE(obj->camera, up);
     object3d_render_setup(BASE, FALSE);
-    glPushMatrix();
+    matrix_push();
     if (obj->fixed_proximity)
-        glTranslatef(NUM3DFL(obj->camera->position));
+        matrix_translate(NUM3DFL(eye));
     switch(obj->type) {
     case BB_SCREEN_ALIGNED: {
-        float m[16];
-        glTranslatef(NUM3DFL(BASE->position));
-        glGetFloatv(GL_MODELVIEW_MATRIX, m);
+        ALIGNED_MATRIX(m);
+        matrix_translate(NUM3DFL(position));
+        dupmx(m, matrix_top());
         m[1] = m[2] = m[4] = m[6] = m[8] = m[9] = 0.0f;
         m[0] = m[5] = m[10] = 1.0f;
-        glLoadMatrixf(m);
+        matrix_load(m);
         break; }
     case BB_SPHERICAL: {
-        Number3D look = nvec3d(BASE->position, obj->camera->position);
-        Number3D right = cross3d(obj->camera->up, look);
+        Number3D look = nvec3d(position, eye);
+        Number3D right = cross3d(up, look);
         norm3d(&right);
-        look = cross3d(right, obj->camera->up);
+        look = cross3d(right, up);
         float m[16] = { NUM3DFL(right), 0.0f,
-                        NUM3DFL(obj->camera->up), 0.0f,
+                        NUM3DFL(up), 0.0f,
                         NUM3DFL(look), 0.0f,
-                        NUM3DFL(BASE->position), 1.0f };
-        glMultMatrixf(m);
+                        NUM3DFL(position), 1.0f };
+        matrix_mult(m);
         break; }
     }
-    glVertexPointer(3, GL_FLOAT, 0, BASE->vertices);
-    glDrawElements(GL_TRIANGLES, BASE->face_count*3, GL_UNSIGNED_SHORT, BASE->faces);
+    object3d_bind_geometry(BASE);
+    object3d_draw_elements(BASE, GL_TRIANGLES);
     object3d_render_cleanup(BASE, TRUE);
 }
 
+/* Billboards turn to face the camera, so only the bounding sphere is
+ * meaningful; the box is the cube around it.
+ */
+static void billboard_bounds(const Billboard *obj, Number3D *center, float *radius, AABB *box) {
+    *center = NUM3D(BASE->world[M30], BASE->world[M31], BASE->world[M32]);
+    if (obj->fixed_proximity)
+        add3d(center, obj->camera->position);
+    *radius = BASE->radius*world_scale(BASE->world);
+    box->min = *center;
+    subs3d(&box->min, *radius);
+    box->max = *center;
+    adds3d(&box->max, *radius);
+}
+
 Model *model_create(const char *resources, const char *mesh_name) {
+    Mesh *mesh = mesh_load(resources, mesh_name);
+    if (mesh == NULL)
+        return NULL;
     Model *obj = calloc(1, sizeof(Model));
     object3d_init(BASE);
     BASE->materials_enabled = TRUE;
@@ -585,140 +1268,14 @@ Model *model_create(const char *resources, const char *mesh_name) {
     obj->mesh_name = strdup(mesh_name);
     BASE->render = (Object3DFPtr)object3d_render;
     BASE->destroy = (Object3DFPtr)model_destroy;
-    int pathlen = (int)(strlen(resources)+strlen(mesh_name)+5);
-    char *texpath = alloca(pathlen);
-    sprintf(texpath, "%s.png", mesh_name);
-    BASE->texture = texture_create(resources, texpath, TRUE, TRUE);
-    if (BASE->texture == NULL) {
-        LOGERR("could not load texture: %s\n", texpath);
-        //model_destroy(obj);
-        //return NULL;
-    }
-    char *meshpath = alloca(pathlen);
-    sprintf(meshpath, "%s%s.3ds", resources, mesh_name);
-    FILE *mesh = fopen(meshpath, "rb");
-    if (mesh == NULL) {
-        LOGERR("%s not found\n", meshpath);
-        model_destroy(obj);
-        return NULL;
-    }
-    struct stat fst;
-    fstat(fileno(mesh), &fst);
-    unsigned short chunkid;
-    unsigned int chunklen;
-    int i;
-    unsigned short uvcount = 0;
-    unsigned char ch;
-    while (ftell(mesh) < fst.st_size) {
-        fread(&chunkid, 2, 1, mesh);
-        fread(&chunklen, 4, 1, mesh);
-        LOG("chunkid: %x len: %d\n", chunkid, chunklen);
-        switch(chunkid) {
-        case 0x4d4d:
-        case 0x3d3d:
-        case 0x4100:
-            break;
-        case 0x4000:
-            i = 0;
-            do {
-                fread(&ch, 1, 1, mesh);
-                i++;
-            } while (ch != '\0' && i<20);
-            break;
-        case 0x4110:
-            if (BASE->vertices != NULL) {
-                LOGERR("%s: multiple vertex chunks not supported\n", meshpath);
-                fclose(mesh);
-                model_destroy(obj);
-                return NULL;
-            }
-            fread(&BASE->vertex_count, 2, 1, mesh);
-            BASE->vertices = malloc(sizeof(Number3D)*BASE->vertex_count);
-            for (i=0; i<BASE->vertex_count; i++)
-                fread(&BASE->vertices[i], sizeof(Number3D), 1, mesh);
-            break;
-        case 0x4120:
-            if (BASE->faces != NULL) {
-                LOGERR("%s: multiple face chunks not supported\n", meshpath);
-                fclose(mesh);
-                model_destroy(obj);
-                return NULL;
-            }
-            fread(&BASE->face_count, 2, 1, mesh);
-            BASE->faces = malloc(sizeof(Face)*BASE->face_count);
-            for (i=0; i<BASE->face_count; i++) {
-                fread(&BASE->faces[i], sizeof(Face), 1, mesh);
-                fseek(mesh, 2, SEEK_CUR);
-            }
-            break;
-        case 0x4140:
-            if (BASE->uvs != NULL) {
-                LOGERR("%s: multiple UV chunks not supported\n", meshpath);
-                fclose(mesh);
-                model_destroy(obj);
-                return NULL;
-            }
-            fread(&uvcount, 2, 1, mesh);
-            BASE->uvs = malloc(sizeof(UV)*uvcount);
-            for (i=0; i<uvcount; i++)
-                fread(&BASE->uvs[i], sizeof(UV), 1, mesh);
-            break;
-        default:
-            fseek(mesh, chunklen-6, SEEK_CUR);
-            break;
-        }
-    }
-    fclose(mesh);
-    if (BASE->vertex_count == 0 || BASE->face_count == 0 || uvcount != BASE->vertex_count) {
-        LOGERR("%s: invalid counts: vertices=%d, uvs=%d, faces=%d\n", meshpath, BASE->vertex_count, uvcount, BASE->face_count);
-        //model_destroy(obj);
-        //return NULL;
-    }
-    LOG("%s: read vertices=%d, uvs=%d, faces=%d\n", meshpath, BASE->vertex_count, uvcount, BASE->face_count);
-    BASE->normals = malloc(sizeof(Number3D)*BASE->vertex_count);
-    Number3D *face_normals = alloca(sizeof(Number3D)*BASE->face_count);
-    Number3D v1, v2, v3, n1, n2;
-    for (i=0; i<BASE->face_count; i++) {
-        v1 = BASE->vertices[BASE->faces[i].a];
-        v2 = BASE->vertices[BASE->faces[i].b];
-        v3 = BASE->vertices[BASE->faces[i].c];
-        n1 = nvec3d(v1, v2);
-        n2 = nvec3d(v1, v3);
-        face_normals[i] = cross3d(n1, n2);
-        norm3d(&face_normals[i]);
-    }
-    Number3D sum;
-    int j;
-    float max_x = 0.0f, min_x = 0.0f, max_y = 0.0f, min_y = 0.0f, max_z = 0.0f, min_z = 0.0f;
-    for (i=0; i<BASE->vertex_count; i++) {
-        sum = NUM3D(0.0f, 0.0f, 0.0f);
-        for (j=0; j<BASE->face_count; j++) {
-            if ((BASE->faces[j].a == i) ||
-                (BASE->faces[j].b == i) ||
-                (BASE->faces[j].c == i)) {
-                add3d(&sum, face_normals[j]);
-            }
-        }
-        norm3d(&sum);
-        BASE->normals[i] = sum;
-        if (BASE->vertices[i].x > max_x) max_x = BASE->vertices[i].x;
-        if (BASE->vertices[i].x < min_x) min_x = BASE->vertices[i].x;
-        if (BASE->vertices[i].y > max_y) max_y = BASE->vertices[i].y;
-        if (BASE->vertices[i].y < min_y) min_y = BASE->vertices[i].y;
-        if (BASE->vertices[i].z > max_z) max_z = BASE->vertices[i].z;
-        if (BASE->vertices[i].z < min_z) min_z = BASE->vertices[i].z;
-    }
-    BASE->aabb.min.x = min_x;
-    BASE->aabb.max.x = max_x;
-    BASE->aabb.min.y = min_y;
-    BASE->aabb.max.y = max_y;
-    BASE->aabb.min.z = min_z;
-    BASE->aabb.max.z = max_z;
-    object3d_calculate_radius(BASE);
+    object3d_set_mesh(BASE, mesh);
+    mesh_release(mesh);
     return obj;
 }
 
 static void model_destroy(Model *obj) {
+    if (object3d_defer_destroy(BASE))
+        return;
     object3d_cleanup(BASE);
     free(obj->mesh_name);
     free(obj);
@@ -9,20 +9,103 @@
 #include "types.h"
 #include "camera.h"
 #include "texture.h"
+#include "bvh.h"
+#include "handles.h"
+#include "alloc.h"
 
 #define OBJ3D(x) ((Object3D*)x)
 
 struct _Object3D;
+struct _Mesh;
 typedef void (*Object3DFPtr)(struct _Object3D *);
 
 // Axially-Aligned Bounding Box
 typedef Cube3D AABB;
 
-// Base 3D object
+typedef void (*Object3DBoundsFPtr)(const struct _Object3D *, Number3D *center, float *radius, AABB *box);
+
+// Transform and world bounds captured for the render thread by scene_publish()
+typedef struct _ObjectState {
+    struct _Object3D *object;
+    Number3D position;
+    Number3D scale;
+    ALIGNED_MATRIX(rotation);
+    ALIGNED_MATRIX(world);
+    int visible;
+    Number3D center;
+    float radius;
+    AABB box;
+    AABB subtree_box;       // box around the object and everything attached to it
+    int subtree_end;        // index in the published objects past its subtree
+    int lod;                // level of detail to draw
+} ObjectState;
+
+// Read a published field as the render thread should see it
+#define OBJ3D_STATE(o, field) ((o)->state ? (o)->state->field : (o)->field)
+#define OBJ3D_WORLD(o) ((o)->state ? (o)->state->world : object3d_world_matrix(o))
+
+// Buffers in GeometryBuffers.ids
+#define GEOMETRY_VERTEX_BUFFER 0
+#define GEOMETRY_NORMAL_BUFFER 1
+#define GEOMETRY_UV_BUFFER 2
+#define GEOMETRY_INDEX_BUFFER 3
+#define GEOMETRY_BUFFERS 4
+
+// GPU-resident copy of an object's geometry
+typedef struct _GeometryBuffers {
+    unsigned int ids[GEOMETRY_BUFFERS];
+    int dirty;
+} GeometryBuffers;
+
+// Interleaved vertex layout of cooked meshes
+typedef struct _InterleavedVertex {
+    Number3D position;
+    Number3D normal;
+    UV uv;
+} InterleavedVertex;
+
+// Run of faces drawn with 16-bit indices relative to base_vertex, for
+// meshes too big for 16-bit indices on targets without 32-bit ones
+typedef struct _IndexBatch {
+    int base_vertex;
+    int vertex_count;
+    int first_face;
+    int face_count;
+} IndexBatch;
+
+// Level of detail: a run of faces over the same vertices, following the
+// full-detail faces in the index list. error is the furthest the level
+// strays from the full surface, as a fraction of the mesh radius.
+typedef struct _MeshLOD {
+    int first_face;
+    int face_count;
+    float error;
+} MeshLOD;
+
+// Object3D transform_flags
+#define OBJ3D_TRANSFORM_DIRTY   1   // world and world_inverse need rebuilding
+#define OBJ3D_BOUNDS_DIRTY      2   // world bounds need rebuilding
+#define OBJ3D_BOUNDS_VOLATILE   4   // world bounds move with more than the transform
+
+// Base 3D object. Set position, scale and rotation through the setters, or
+// call object3d_invalidate_transform() after writing them directly, so the
+// cached world transform and bounds get rebuilt.
 typedef struct _Object3D {
     Number3D position;
     Number3D scale;
-    float rotation[16];
+    ALIGNED_MATRIX(rotation);
+    ALIGNED_MATRIX(world);              // cached, see object3d_world_matrix()
+    ALIGNED_MATRIX(world_inverse);
+    Number3D world_center;              // cached, see object3d_world_bounds()
+    float world_radius;
+    AABB world_box;
+    int transform_flags;
+    unsigned int transform_generation;  // bumped each time world is rebuilt
+    unsigned int parent_generation;     // parent's generation world was built from
+    struct _Object3D *parent;           // object the transform is relative to, if any
+    struct _Object3D *first_child;      // children, first_child->prev_sibling being the last
+    struct _Object3D *next_sibling;
+    struct _Object3D *prev_sibling;
     Color color;
     Color ambient;
     Color diffuse;
@@ -45,14 +128,32 @@ typedef struct _Object3D {
     Number3D *normals;
     UV *uvs;
     Face *faces;
+    Face16 *draw_faces;     // 16-bit copy of faces to draw, NULL to draw faces as 32-bit
+    Arena *geometry;        // block holding vertices, normals, uvs and faces, if allocated together
+    IndexBatch *batches;    // sub-batches of split meshes
+    int batch_count;
+    const MeshLOD *lods;    // levels of detail, lods[0] being the full faces
+    int lod_count;
+    int lod;                // level picked when the object was last published
     int vertex_count;
     int face_count;
+    InterleavedVertex *interleaved;     // draw data, normals and uvs included; normals and uvs are then NULL
     Texture *texture;
     float radius;
     AABB aabb;
     int render_aabb;
+    int buffered;
+    GeometryBuffers *buffers;
     Object3DFPtr render;
-    Object3DFPtr destroy;;
+    Object3DFPtr destroy;
+    Object3DBoundsFPtr bounds;          // world bounds, given an up to date world matrix
+    BVH *bvh;
+    struct _Mesh *mesh;         // shared geometry, NULL if the object owns its own
+    struct _OctreeNode *octree_node;
+    Handle scene_handle;        // in the scene's object array, see scene_add_object()
+    const ObjectState *state;   // published snapshot, render thread only
+    int holds;                  // published states that may still draw the object
+    int destroy_pending;        // destroyed while held, freed with the last hold
 } Object3D;
 
 // Object List
@@ -62,11 +163,9 @@ typedef struct _Object3DList {
     struct _Object3DList *prev;
 } Object3DList;
 
-// A group of objects rendered as one
+// A transform node with no geometry of its own, drawing its children
 typedef struct _ObjectGroup {
     Object3D _base;
-    Object3DList *objects;
-    int size;
 } ObjectGroup;
 
 // Simple wire-frame objects
@@ -125,7 +224,31 @@ typedef struct _Model {
     char *mesh_name;
 } Model;
 
+int object3d_ray_cast(const Object3D *object, Line3D ray, float tmax, int any_hit, float *t);
 int object3d_ray_intersects(Object3D *object, Line3D ray, Number3D *where);
+void object3d_world_bounds(const Object3D *object, Number3D *center, float *radius, AABB *box);
+const float *object3d_world_matrix(const Object3D *object);
+const float *object3d_world_inverse(const Object3D *object);
+void object3d_set_position(Object3D *object, Number3D position);
+void object3d_set_scale(Object3D *object, Number3D scale);
+void object3d_set_rotation(Object3D *object, const float *rotation);
+void object3d_invalidate_transform(Object3D *object);
+void object3d_invalidate_bounds(Object3D *object);
+void object3d_refresh_transform(Object3D *object);
+void object3d_attach(Object3D *parent, Object3D *child);
+void object3d_detach(Object3D *child);
+unsigned int object3d_hierarchy_generation();
+void object3d_set_default_buffered(int buffered);
+void object3d_set_buffered(Object3D *object, int buffered);
+void object3d_invalidate_geometry(Object3D *object);
+void object3d_optimize_geometry(Object3D *object, float overdraw_threshold);
+void object3d_reset_render_state();
+void object3d_set_mesh(Object3D *object, struct _Mesh *mesh);
+int object3d_can_instance(const Object3D *a, const Object3D *b);
+int object3d_select_lod(Object3D *object, float projected_radius, float pixel_error, float hysteresis);
+void object3d_hold(Object3D *object);
+void object3d_release(Object3D *object);
+void object3d_render_instances(Object3D **objects, int count);
 ObjectGroup *objectgroup_create();
 void objectgroup_add_object(ObjectGroup *group, Object3D *object);
 void objectgroup_remove_object(ObjectGroup *group, Object3D *object);
@@ -4,10 +4,13 @@
  */
 
 #include "gl.h"
+#include "glstate.h"
 #include "overlay.h"
+#include "matrix.h"
 #include "math.h"
 #include <log/log.h>
 
+static void overlayobject_alloc_geometry(OverlayObject *object, int vertex_count, size_t extra);
 static void overlayobject_destroy(OverlayObject *object);
 static void overlayline_render(OverlayLine *object);
 static void overlayrectangle_render(OverlayRectangle *object);
@@ -18,6 +21,8 @@ static void overlayimage_destroy(OverlayImage *object);
 static void overlaytext_render(OverlayText *object);
 static void overlaytext_destroy(OverlayText *object);
 
+static Pool list_pool = POOL_INIT(OverlayObjectList);
+
 Overlay *overlay_create() {
     LOG("creating overlay\n");
     Overlay *overlay = calloc(1, sizeof(Overlay));
@@ -26,37 +31,38 @@ Overlay *overlay_create() {
 }
 
 void overlay_destroy(Overlay *overlay) {
-    LOG("destroying overlay %x\n", overlay);
+    LOG("destroying overlay %p\n", overlay);
     OverlayObjectList *eo, *to;
     LL_FOREACH_SAFE(overlay->objects, eo, to) {
         LL_DELETE(overlay->objects, eo);
         eo->object->destroy(eo->object);
-        free(eo);
+        pool_free(&list_pool, eo);
     }
     free(overlay);
 }
 
 void overlay_render(Overlay *overlay) {
     OverlayObjectList *o;
+    ALIGNED_MATRIX(ortho);
+    orthmx(ortho, -overlay->viewport_width/2, overlay->viewport_width/2, overlay->viewport_height/2, -overlay->viewport_height/2, -1.0f, 1.0f);
     glMatrixMode(GL_PROJECTION);
     glPushMatrix();
-    glLoadIdentity();
-    glOrtho(-overlay->viewport_width/2, overlay->viewport_width/2, overlay->viewport_height/2, -overlay->viewport_height/2, -1.0f, 1.0f);
+    glLoadMatrixf(ortho);
     glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
-    glLoadIdentity();
-    glDisable(GL_LIGHTING);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glEnable(GL_COLOR_MATERIAL);
+    matrix_push();
+    matrix_load_identity();
+    glstate_disable(GL_LIGHTING);
+    glstate_blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glstate_enable(GL_COLOR_MATERIAL);
     glClear(GL_DEPTH_BUFFER_BIT);
-    glDisable(GL_DEPTH_TEST);
+    glstate_disable(GL_DEPTH_TEST);
     LL_FOREACH(overlay->objects, o) {
         o->object->render(o->object);
     }
     glMatrixMode(GL_PROJECTION);
     glPopMatrix();
     glMatrixMode(GL_MODELVIEW);
-    glPopMatrix();
+    matrix_pop();
 }
 
 void overlay_reshape_viewport(Overlay *overlay, int width, int height) {
@@ -65,8 +71,8 @@ void overlay_reshape_viewport(Overlay *overlay, int width, int height) {
 }
 
 void overlay_add_object(Overlay *overlay, OverlayObject *object) {
-    LOG("adding object %x\n", object);
-    OverlayObjectList *e = malloc(sizeof(OverlayObjectList));
+    LOGDEBUG("adding object %p\n", object);
+    OverlayObjectList *e = pool_alloc(&list_pool);
     e->object = object;
     LL_APPEND(overlay->objects, e);
 }
@@ -76,7 +82,7 @@ void overlay_remove_object(Overlay *overlay, OverlayObject *object) {
     LL_FOREACH_SAFE(overlay->objects, e, t) {
         if (e->object == object) {
             LL_DELETE(overlay->objects, e);
-            free(e);
+            pool_free(&list_pool, e);
             return;
         }
     }
@@ -88,7 +94,7 @@ void overlay_clear_objects(Overlay *overlay) {
     LL_FOREACH_SAFE(overlay->objects, eo, to) {
         LL_DELETE(overlay->objects, eo);
         eo->object->destroy(eo->object);
-        free(eo);
+        pool_free(&list_pool, eo);
     }
 }
 
@@ -97,7 +103,7 @@ OverlayLine *overlayline_create(int x1, int y1, int x2, int y2) {
     SETCOLOR(object->color, 255, 255, 255, 255);
     object->scale = NUM2D(1.0f, 1.0f);
     object->vertex_count = 2;
-    object->vertices = calloc(2, sizeof(Number2D));
+    overlayobject_alloc_geometry(object, 2, 0);
     object->vertices[0] = NUM2D((float)x1, (float)y1);
     object->vertices[1] = NUM2D((float)x2, (float)y2);
     object->render = overlayline_render;
@@ -106,15 +112,15 @@ OverlayLine *overlayline_create(int x1, int y1, int x2, int y2) {
 }
 
 static void overlayline_render(OverlayLine *object) {
-    glPushMatrix();
-    glRotatef(object->rotation, 0.0f, 0.0f, 1.0f);
-    glTranslatef(object->position.x, object->position.y, 0.0f);
-    glScalef(object->scale.x, object->scale.y, 1.0f);
+    matrix_push();
+    matrix_rotate(object->rotation, 0.0f, 0.0f, 1.0f);
+    matrix_translate(object->position.x, object->position.y, 0.0f);
+    matrix_scale(object->scale.x, object->scale.y, 1.0f);
     glColor4f(COLORFL(object->color));
     glLineWidth(1.0f);
     glVertexPointer(2, GL_FLOAT, 0, object->vertices);
     glDrawArrays(GL_LINES, 0, 2);
-    glPopMatrix();
+    matrix_pop();
 }
 
 OverlayTriangle *overlaytriangle_create(int width, int height, int filled) {
@@ -122,7 +128,7 @@ OverlayTriangle *overlaytriangle_create(int width, int height, int filled) {
     SETCOLOR(object->color, 255, 255, 255, 255);
     object->scale = NUM2D(1.0f, 1.0f);
     object->vertex_count = 3;
-    object->vertices = calloc(3, sizeof(Number2D));
+    overlayobject_alloc_geometry(object, 3, 0);
     object->vertices[0] = NUM2D(0.0f, (float)-(height/2));
     object->vertices[1] = NUM2D((float)-(width/2), (float)height/2);
     object->vertices[2] = NUM2D((float)width/2, (float)height/2);
@@ -133,15 +139,15 @@ OverlayTriangle *overlaytriangle_create(int width, int height, int filled) {
 }
 
 static void overlaytriangle_render(OverlayTriangle *object) {
-    glPushMatrix();
-    glRotatef(object->rotation, 0.0f, 0.0f, 1.0f);
-    glTranslatef(object->position.x, object->position.y, 0.0f);
-    glScalef(object->scale.x, object->scale.y, 1.0f);
+    matrix_push();
+    matrix_rotate(object->rotation, 0.0f, 0.0f, 1.0f);
+    matrix_translate(object->position.x, object->position.y, 0.0f);
+    matrix_scale(object->scale.x, object->scale.y, 1.0f);
     glColor4f(COLORFL(object->color));
     glLineWidth(1.0f);
     glVertexPointer(2, GL_FLOAT, 0, object->vertices);
     glDrawArrays(object->filled?GL_TRIANGLE_FAN:GL_LINE_LOOP, 0, 3);
-    glPopMatrix();
+    matrix_pop();
 }
 
 OverlayRectangle *overlayrectangle_create(int width, int height, int filled) {
@@ -149,7 +155,7 @@ OverlayRectangle *overlayrectangle_create(int width, int height, int filled) {
     SETCOLOR(object->color, 255, 255, 255, 255);
     object->scale = NUM2D(1.0f, 1.0f);
     object->vertex_count = 4;
-    object->vertices = calloc(4, sizeof(Number2D));
+    overlayobject_alloc_geometry(object, 4, 0);
     if (!filled) {
         object->vertices[0] = NUM2D((float)-(width/2), (float)-(height/2));
         object->vertices[1] = NUM2D((float)-(width/2), (float)(height/2));
@@ -168,15 +174,15 @@ OverlayRectangle *overlayrectangle_create(int width, int height, int filled) {
 }
 
 static void overlayrectangle_render(OverlayRectangle *object) {
-    glPushMatrix();
-    glRotatef(object->rotation, 0.0f, 0.0f, 1.0f);
-    glTranslatef(object->position.x, object->position.y, 0.0f);
-    glScalef(object->scale.x, object->scale.y, 1.0f);
+    matrix_push();
+    matrix_rotate(object->rotation, 0.0f, 0.0f, 1.0f);
+    matrix_translate(object->position.x, object->position.y, 0.0f);
+    matrix_scale(object->scale.x, object->scale.y, 1.0f);
     glColor4f(COLORFL(object->color));
     glLineWidth(1.0f);
     glVertexPointer(2, GL_FLOAT, 0, object->vertices);
     glDrawArrays(object->filled?GL_TRIANGLE_STRIP:GL_LINE_LOOP, 0, 4);
-    glPopMatrix();
+    matrix_pop();
 }
 
 OverlayCircle *overlaycircle_create(int radius, int filled) {
@@ -184,7 +190,7 @@ OverlayCircle *overlaycircle_create(int radius, int filled) {
     SETCOLOR(object->color, 255, 255, 255, 255);
     object->scale = NUM2D(1.0f, 1.0f);
     object->vertex_count = 360;
-    object->vertices = calloc(360, sizeof(Number2D));
+    overlayobject_alloc_geometry(object, 360, 0);
     int i;
     for (i=0; i<360; i++) {
         object->vertices[359-i] = NUM2D(0.0f, (float)radius);
@@ -197,21 +203,21 @@ OverlayCircle *overlaycircle_create(int radius, int filled) {
 }
 
 static void overlaycircle_render(OverlayCircle *object) {
-    glPushMatrix();
-    glTranslatef(object->position.x, object->position.y, 0.0f);
-    glScalef(object->scale.x, object->scale.y, 1.0f);
+    matrix_push();
+    matrix_translate(object->position.x, object->position.y, 0.0f);
+    matrix_scale(object->scale.x, object->scale.y, 1.0f);
     glColor4f(COLORFL(object->color));
     glLineWidth(1.0f);
     glVertexPointer(2, GL_FLOAT, 0, object->vertices);
     glDrawArrays(object->filled?GL_TRIANGLE_FAN:GL_LINE_LOOP, 0, object->vertex_count);
-    glPopMatrix();
+    matrix_pop();
 }
 
 OverlayImage *overlayimage_create(int width, int height, const char *resources, const char *image_name) {
     OverlayImage *object = calloc(1, sizeof(OverlayImage));
     SETCOLOR(((OverlayObject*)object)->color, 255, 255, 255, 255);
     ((OverlayObject*)object)->scale = NUM2D(1.0f, 1.0f);
-    ((OverlayObject*)object)->vertices = calloc(4, sizeof(Number2D));
+    overlayobject_alloc_geometry((OverlayObject*)object, 4, ARENA_SIZE(sizeof(UV)*4)+ARENA_SIZE(sizeof(Face16)*2));
     ((OverlayObject*)object)->vertices[0] = NUM2D((float)(width/2), (float)-(height/2));
     ((OverlayObject*)object)->vertices[1] = NUM2D((float)-(width/2), (float)-(height/2));
     ((OverlayObject*)object)->vertices[2] = NUM2D((float)-(width/2), (float)(height/2));
@@ -219,42 +225,48 @@ OverlayImage *overlayimage_create(int width, int height, const char *resources,
     ((OverlayObject*)object)->render = (OverlayObjectFPtr)overlayimage_render;
     ((OverlayObject*)object)->destroy = (OverlayObjectFPtr)overlayimage_destroy;
     object->bitmap = texture_create(resources, image_name, TRUE, FALSE);
-    object->uvs = calloc(4, sizeof(UV));
-    object->faces = malloc(sizeof(Face)*2);
+    object->uvs = arena_alloc(OVERLAYOBJ(object)->geometry, sizeof(UV)*4);
+    object->faces = arena_alloc(OVERLAYOBJ(object)->geometry, sizeof(Face16)*2);
     object->uvs[0] = (UV){1.0f, 0.0f};
     object->uvs[1] = (UV){0.0f, 0.0f};
     object->uvs[2] = (UV){0.0f, 1.0f};
     object->uvs[3] = (UV){1.0f, 1.0f};
-    object->faces[0] = (Face){0, 1, 2};
-    object->faces[1] = (Face){0, 2, 3};
+    object->faces[0] = (Face16){0, 1, 2};
+    object->faces[1] = (Face16){0, 2, 3};
     return object;
 }
 
 static void overlayimage_render(OverlayImage *object) {
-    glPushMatrix();
-    glRotatef(((OverlayObject*)object)->rotation, 0.0f, 0.0f, 1.0f);
-    glTranslatef(((OverlayObject*)object)->position.x, ((OverlayObject*)object)->position.y, 0.0f);
-    glScalef(((OverlayObject*)object)->scale.x, ((OverlayObject*)object)->scale.y, 1.0f);
+    matrix_push();
+    matrix_rotate(((OverlayObject*)object)->rotation, 0.0f, 0.0f, 1.0f);
+    matrix_translate(((OverlayObject*)object)->position.x, ((OverlayObject*)object)->position.y, 0.0f);
+    matrix_scale(((OverlayObject*)object)->scale.x, ((OverlayObject*)object)->scale.y, 1.0f);
     glColor4f(COLORFL(((OverlayObject*)object)->color));
     glVertexPointer(2, GL_FLOAT, 0, ((OverlayObject*)object)->vertices);
     glTexCoordPointer(2, GL_FLOAT, 0, object->uvs);
-    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glstate_enable_client(GL_TEXTURE_COORD_ARRAY);
     texture_activate(object->bitmap);
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, object->faces);;
     texture_deactivate(object->bitmap);
-    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-    glPopMatrix();
+    glstate_disable_client(GL_TEXTURE_COORD_ARRAY);
+    matrix_pop();
 }
 
 static void overlayimage_destroy(OverlayImage *object) {
     if (object->bitmap) texture_destroy(object->bitmap);
-    if (object->uvs) free(object->uvs);
-    if (object->faces) free(object->faces);
     overlayobject_destroy((OverlayObject*)object);
 }
 
+/* Put an object's vertices in an arena, with extra bytes for any other
+ * arrays it has, which are taken from the arena after them.
+ */
+static void overlayobject_alloc_geometry(OverlayObject *object, int vertex_count, size_t extra) {
+    object->geometry = arena_create(ARENA_SIZE(sizeof(Number2D)*vertex_count)+extra);
+    object->vertices = arena_alloc(object->geometry, sizeof(Number2D)*vertex_count);
+}
+
 static void overlayobject_destroy(OverlayObject *object) {
-    if (object->vertices) free(object->vertices);
+    arena_destroy(object->geometry);
     free(object);
 }
 
@@ -266,12 +278,13 @@ OverlayText *overlaytext_create(Font *font, const char *text, int max_len) {
     OVERLAYOBJ(object)->destroy = (OverlayObjectFPtr)overlaytext_destroy;
     if (max_len < 0) max_len = (int)strlen(text);
     object->max_len = max_len;
-    object->text = malloc(max_len+1);
     int vertex_count = max_len*4;
     OVERLAYOBJ(object)->vertex_count = vertex_count;
-    OVERLAYOBJ(object)->vertices = malloc(sizeof(Number2D)*vertex_count);
-    object->uvs = malloc(sizeof(UV)*vertex_count);
-    object->faces = malloc(sizeof(Face)*2*max_len);
+    overlayobject_alloc_geometry(OVERLAYOBJ(object), vertex_count, ARENA_SIZE(sizeof(UV)*vertex_count)+
+                                 ARENA_SIZE(sizeof(Face16)*2*max_len)+ARENA_SIZE(max_len+1));
+    object->uvs = arena_alloc(OVERLAYOBJ(object)->geometry, sizeof(UV)*vertex_count);
+    object->faces = arena_alloc(OVERLAYOBJ(object)->geometry, sizeof(Face16)*2*max_len);
+    object->text = arena_alloc(OVERLAYOBJ(object)->geometry, max_len+1);
     object->font = font;
     overlaytext_set_text(object, text);
     return object;
@@ -300,31 +313,28 @@ void overlaytext_set_text(OverlayText *object, const char *text) {
         OVERLAYOBJ(object)->vertices[i*4+1] = NUM2D(cursorx+xoffset, yoffset);
         OVERLAYOBJ(object)->vertices[i*4+2] = NUM2D(cursorx+xoffset, yoffset+height);
         OVERLAYOBJ(object)->vertices[i*4+3] = NUM2D(cursorx+xoffset+width, yoffset+height);
-        object->faces[i*2] = (Face){i*4, i*4+1, i*4+2};
-        object->faces[i*2+1] = (Face){i*4, i*4+2, i*4+3};
+        object->faces[i*2] = (Face16){i*4, i*4+1, i*4+2};
+        object->faces[i*2+1] = (Face16){i*4, i*4+2, i*4+3};
         cursorx += (float)object->font->chars[(int)text[i]].xadvance;
     }
 }
 
 static void overlaytext_render(OverlayText *object) {
-    glPushMatrix();
-    glRotatef(((OverlayObject*)object)->rotation, 0.0f, 0.0f, 1.0f);
-    glTranslatef(OVERLAYOBJ(object)->position.x, OVERLAYOBJ(object)->position.y, 0.0f);
-    glScalef(OVERLAYOBJ(object)->scale.x, OVERLAYOBJ(object)->scale.y, 1.0f);
+    matrix_push();
+    matrix_rotate(((OverlayObject*)object)->rotation, 0.0f, 0.0f, 1.0f);
+    matrix_translate(OVERLAYOBJ(object)->position.x, OVERLAYOBJ(object)->position.y, 0.0f);
+    matrix_scale(OVERLAYOBJ(object)->scale.x, OVERLAYOBJ(object)->scale.y, 1.0f);
     glColor4f(COLORFL(OVERLAYOBJ(object)->color));
     glVertexPointer(2, GL_FLOAT, 0, OVERLAYOBJ(object)->vertices);
     glTexCoordPointer(2, GL_FLOAT, 0, object->uvs);
-    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glstate_enable_client(GL_TEXTURE_COORD_ARRAY);
     texture_activate(object->font->texture);
     glDrawElements(GL_TRIANGLES, object->face_count*3, GL_UNSIGNED_SHORT, object->faces);
     texture_deactivate(object->font->texture);
-    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-    glPopMatrix();
+    glstate_disable_client(GL_TEXTURE_COORD_ARRAY);
+    matrix_pop();
 }
 
 static void overlaytext_destroy(OverlayText *object) {
-    if (object->uvs) free(object->uvs);
-    if (object->text) free(object->text);
-    if (object->faces) free(object->faces);
     overlayobject_destroy((OverlayObject*)object);
 }
@@ -9,6 +9,7 @@
 #include "types.h"
 #include "texture.h"
 #include "font.h"
+#include "alloc.h"
 
 #define OVERLAYOBJ(x) ((OverlayObject*)x)
 
@@ -22,6 +23,7 @@ typedef struct _OverlayObject {
     Color color;
     Number2D *vertices;
     int vertex_count;
+    Arena *geometry;        // block holding vertices and the other arrays
     int filled;
     OverlayObjectFPtr render;
     OverlayObjectFPtr destroy;
@@ -45,14 +47,14 @@ typedef struct _OverlayImage {
     OverlayObject base;
     Texture *bitmap;
     UV *uvs;
-    Face *faces;
+    Face16 *faces;
 } OverlayImage;
 
 typedef struct _OverlayText {
     OverlayObject base;
     UV *uvs;
     int face_count;
-    Face *faces;
+    Face16 *faces;
     Font *font;
     char *text;
     int text_len;
@@ -0,0 +1,146 @@
+/* renderqueue.c - sorted draw submission
+ * Orders draws to minimize state changes
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <log/log.h>
+#include "renderqueue.h"
+#include "mesh.h"
+
+RenderQueue *renderqueue_create() {
+    RenderQueue *queue = calloc(1, sizeof(RenderQueue));
+    queue->capacity = RENDERQUEUE_INITIAL_SIZE;
+    queue->items = malloc(sizeof(RenderItem)*queue->capacity);
+    queue->scratch = malloc(sizeof(RenderItem)*queue->capacity);
+    queue->batch = malloc(sizeof(Object3D*)*queue->capacity);
+    return queue;
+}
+
+void renderqueue_destroy(RenderQueue *queue) {
+    free(queue->items);
+    free(queue->scratch);
+    free(queue->batch);
+    free(queue);
+}
+
+/* Objects that blend with what is behind them must be drawn after the
+ * opaque geometry, farthest first.
+ */
+static int is_blended(const Object3D *object) {
+    if (object->additive_blend || object->no_depth_test)
+        return TRUE;
+    if (object->materials_enabled && !object->wireframe && !object->draw_points)
+        return object->diffuse.a < 255;
+    return object->color.a < 255;
+}
+
+// Fold the material inputs into 12 bits so equal materials sort together
+static unsigned int material_key(const Object3D *object) {
+    unsigned int h = 2166136261u;
+    unsigned int v[7];
+    int i;
+    v[0] = COLORLV(object->ambient);
+    v[1] = COLORLV(object->diffuse);
+    v[2] = COLORLV(object->specular);
+    v[3] = COLORLV(object->emission);
+    v[4] = object->materials_enabled ? 0 : COLORLV(object->color);
+    memcpy(&v[5], &object->shininess, sizeof(float));
+    v[6] = (object->lighting_enabled ? 1 : 0)|(object->smooth_shading ? 2 : 0)|
+           (object->double_sided ? 4 : 0)|(object->materials_enabled ? 8 : 0);
+    for (i=0; i<7; i++) {
+        h ^= v[i];
+        h *= 16777619u;
+    }
+    return (h^(h>>16))&0xFFF;
+}
+
+/* Queue an object for drawing. depth is its distance from the camera,
+ * quantized against far_clip.
+ */
+void renderqueue_add(RenderQueue *queue, Object3D *object, RenderPass pass, float depth, float far_clip) {
+    if (queue->count == queue->capacity) {
+        queue->capacity *= 2;
+        queue->items = realloc(queue->items, sizeof(RenderItem)*queue->capacity);
+        queue->scratch = realloc(queue->scratch, sizeof(RenderItem)*queue->capacity);
+        queue->batch = realloc(queue->batch, sizeof(Object3D*)*queue->capacity);
+    }
+    unsigned long long d = 0;
+    if (depth > 0.0f && far_clip > 0.0f) {
+        float q = depth/far_clip;
+        d = q >= 1.0f ? (1ULL<<RQ_DEPTH_BITS)-1 : (unsigned long long)(q*(float)(1<<RQ_DEPTH_BITS));
+    }
+    unsigned long long texture = (object->texture && object->textures_enabled) ? (unsigned)object->texture->id&0x3FFF : 0;
+    unsigned long long material = material_key(object);
+    unsigned long long mesh = object->mesh ? (unsigned)object->mesh->id&0x3FF : 0;
+    unsigned long long key = (unsigned long long)pass<<RQ_PASS_SHIFT;
+    if (is_blended(object)) {
+        d = ((1ULL<<RQ_DEPTH_BITS)-1)-d;
+        key |= RQ_BLENDED_BIT|(d<<37)|(texture<<23)|(material<<11)|(mesh<<1);
+    } else {
+        key |= (texture<<47)|(material<<35)|(mesh<<25)|(d<<1);
+    }
+    RenderItem *item = &queue->items[queue->count++];
+    item->key = key;
+    item->object = object;
+}
+
+/* LSD radix sort on the 64-bit keys, one byte per pass. Bytes that are the
+ * same in every key are skipped, which leaves most frames at a few passes.
+ * The sort is stable, so equal keys keep submission order.
+ */
+void renderqueue_sort(RenderQueue *queue) {
+    RenderItem *src = queue->items;
+    RenderItem *dst = queue->scratch;
+    RenderItem *t;
+    int count[256];
+    int n = queue->count;
+    int shift, i;
+    if (n < 2)
+        return;
+    for (shift=0; shift<64; shift+=8) {
+        memset(count, 0, sizeof(count));
+        for (i=0; i<n; i++)
+            count[(src[i].key>>shift)&0xFF]++;
+        if (count[(src[0].key>>shift)&0xFF] == n)
+            continue;
+        int offset = 0;
+        for (i=0; i<256; i++) {
+            int c = count[i];
+            count[i] = offset;
+            offset += c;
+        }
+        for (i=0; i<n; i++)
+            dst[count[(src[i].key>>shift)&0xFF]++] = src[i];
+        t = src;
+        src = dst;
+        dst = t;
+    }
+    queue->items = src;
+    queue->scratch = dst;
+}
+
+/* Sort and draw everything queued, then empty the queue. Consecutive
+ * instances of the same mesh and material are drawn as one batch.
+ */
+void renderqueue_flush(RenderQueue *queue) {
+    int i, n;
+    renderqueue_sort(queue);
+    object3d_reset_render_state();
+    for (i=0; i<queue->count; i+=n) {
+        Object3D *object = queue->items[i].object;
+        n = 1;
+        while (i+n < queue->count && object3d_can_instance(object, queue->items[i+n].object))
+            n++;
+        if (n == 1) {
+            object->render(object);
+        } else {
+            int j;
+            for (j=0; j<n; j++)
+                queue->batch[j] = queue->items[i+j].object;
+            object3d_render_instances(queue->batch, n);
+        }
+    }
+    queue->count = 0;
+}
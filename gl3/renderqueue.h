@@ -0,0 +1,47 @@
+/* renderqueue.h - sorted draw submission
+ * Orders draws to minimize state changes
+ * Copyright 2012 Keath Milligan
+ */
+
+#ifndef RENDERQUEUE_H_
+#define RENDERQUEUE_H_
+
+#include "types.h"
+#include "objects.h"
+
+#define RENDERQUEUE_INITIAL_SIZE 64
+
+// Sort key layout, most significant first
+//   opaque:  pass(2) blended(1)=0 texture(14) material(12) mesh(10) depth(24)
+//   blended: pass(2) blended(1)=1 far-to-near depth(24) texture(14) material(12) mesh(10)
+// Keeping the mesh ahead of depth lines up instances of one mesh so the
+// flush can draw them as a batch.
+#define RQ_PASS_SHIFT 62
+#define RQ_BLENDED_BIT (1ULL<<61)
+#define RQ_DEPTH_BITS 24
+
+typedef enum {
+    RP_BACKGROUND,
+    RP_SCENE
+} RenderPass;
+
+typedef struct _RenderItem {
+    unsigned long long key;
+    Object3D *object;
+} RenderItem;
+
+typedef struct _RenderQueue {
+    RenderItem *items;
+    RenderItem *scratch;
+    Object3D **batch;
+    int count;
+    int capacity;
+} RenderQueue;
+
+RenderQueue *renderqueue_create();
+void renderqueue_destroy(RenderQueue *queue);
+void renderqueue_add(RenderQueue *queue, Object3D *object, RenderPass pass, float depth, float far_clip);
+void renderqueue_sort(RenderQueue *queue);
+void renderqueue_flush(RenderQueue *queue);
+
+#endif /* RENDERQUEUE_H_ */
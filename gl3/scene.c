@@ -12,76 +12,134 @@
 #endif
 
 #include "gl.h"
+#include "glstate.h"
+#include "matrix.h"
 #include <unistd.h>
 #include "scene.h"
 #include "camera.h"
 #include <log/log.h>
 #include "math.h"
 
+typedef struct _RayQuery {
+    Scene *scene;
+    Line3D ray;
+    float tmax;
+    int any_hit;
+    Object3D *object;
+} RayQuery;
+
 static void build_grid(Scene *scene);
 static void build_axis(Scene *scene);
 static void render_grid(Scene *scene);
 static void render_axis(Scene *scene);
 static void light_setup(Light *light, int id);
 static void skybox_render(Skybox *skybox);
+static void scene_render_published_skybox(const SceneState *state, const SkyboxState *skybox);
+static void scene_render_object(Scene *scene, Object3D *object, RenderPass pass);
+static void scene_queue_object(Scene *scene, Object3D *object, RenderPass pass, Number3D center, float radius);
+static void scene_render_effects(Scene *scene, SceneState *state, EffectRenderLevel level);
+static int scene_select_lod(Scene *scene, Object3D *object, Number3D center, float radius);
+static void scene_capture_object(Scene *scene, ObjectState *state, Object3D *object);
+static void scene_capture_octree(Scene *scene, SceneState *state, OctreeNode *node, int *object);
+static void scene_release_state(SceneState *state);
+static void scene_clear_state(SceneState *state);
+static SceneState *scene_acquire_state(Scene *scene);
+static int scene_render_static_object(Object3D *object, void *data);
+static int scene_render_graph_object(Object3D *object, void *data);
+static void scene_render_published_graph(Scene *scene, SceneState *state);
+static int scene_render_published_static(Scene *scene, SceneState *state);
+static int ray_cast_tree(Object3D *object, RayQuery *query);
+static int ray_cast_object(Object3D *object, void *data);
+static int ray_cast_primitive(int primitive, Line3D ray, float tmax, float *t, void *data);
+static void scene_update_bvh(Scene *scene);
+static void scene_release_bvh(Scene *scene);
+static Object3D *scene_ray_cast(Scene *scene, Line3D ray, float tmax, int any_hit, float *t);
+static int octree_classify(Number3D center, float half_width, Camera *camera);
+static OctreeNode *octree_node_create(Octree *octree, OctreeNode *parent, Number3D center, float half_width);
+static void octree_node_destroy(Octree *octree, OctreeNode *node, int destroy_objects);
+static void octree_node_prune(Octree *octree, OctreeNode *node);
+static int octree_node_query_frustum(OctreeNode *node, Camera *camera, int inside, OctreeVisitFPtr visit, void *data, int *visited);
+static int octree_node_query_ray(OctreeNode *node, Line3D ray, OctreeVisitFPtr visit, void *data, int *visited);
+
+static Pool list_pool = POOL_INIT(Object3DList);
+static Pool octree_node_pool = POOL_INIT(OctreeNode);
 
 Scene *scene_create() {
     LOG("creating scene\n");
     Scene *scene = calloc(1, sizeof(Scene));
     scene->camera = camera_create(scene);
+    handles_init(&scene->objects);
+    handles_init(&scene->background_objects);
+    handles_init(&scene->lights);
+    handles_init(&scene->skyboxes);
+    handles_init(&scene->effects);
     scene->fog_start = 1.5f;
     scene->fog_end = 20.0f;
     scene->fog_color = COLORF(0.5f, 0.5f, 0.5f, 1.0f);
     scene->fog_density = 0.001f;
+    scene->culling_enabled = TRUE;
+    scene->lod_enabled = TRUE;
+    scene->lod_pixel_error = 1.0f;
+    scene->lod_hysteresis = 0.2f;
+    scene->bvh_dirty = TRUE;
+    scene->state_back = 0;
+    scene->state_ready = 1;
+    scene->state_front = 2;
+    scene->render_queue = renderqueue_create();
     scene_add_light(scene, light_create());
     build_grid(scene);
     build_axis(scene);
-    //scene->static_objects = octree_build(NUM3D(0.0f, 0.0f, 0.0f), 150.0f, 7, 7);
+    scene->static_objects = octree_create(NUM3D(0.0f, 0.0f, 0.0f), OCTREE_HALF_WIDTH, OCTREE_MAX_DEPTH);
+    scene->graph = scenegraph_create();
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-    glEnable(GL_DEPTH_TEST);
+    glstate_enable(GL_DEPTH_TEST);
     glClearDepth(1.0f);
     glDepthFunc(GL_LESS);
     glDepthRange(0, 1.0f);
     glDepthMask(TRUE);
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glstate_enable_client(GL_VERTEX_ARRAY);
+    glstate_enable(GL_BLEND);
+    glstate_blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     return scene;
 }
 
 void scene_destroy(Scene *scene) {
-    LOG("destroying scene %x\n", scene);
-    Object3DList *eo, *to;
-    LightList *el, *tl;
-    SkyboxList *es, *ts;
-    EffectList *ee, *te;
-    LL_FOREACH_SAFE(scene->objects, eo, to) {
-        LL_DELETE(scene->objects, eo);
-        eo->object->destroy(eo->object);
-        free(eo);
-    }
-    LL_FOREACH_SAFE(scene->background_objects, eo, to) {
-        LL_DELETE(scene->background_objects, eo);
-        eo->object->destroy(eo->object);
-        free(eo);
-    }
-    LL_FOREACH_SAFE(scene->lights, el, tl) {
-        LL_DELETE(scene->lights, el);
-        light_destroy(el->light);
-        free(el);
-    }
-    LL_FOREACH_SAFE(scene->skyboxes, es, ts) {
-        LL_DELETE(scene->skyboxes, es);
-        skybox_destroy(es->skybox);
-        free(es);
-    }
-    LL_FOREACH_SAFE(scene->effects, ee, te) {
-        LL_DELETE(scene->effects, ee);
-        ee->effect->destroy(ee->effect);
-        free(ee);
+    LOG("destroying scene %p\n", scene);
+    int i;
+    // objects destroyed while published are freed here
+    for (i=0; i<SCENE_STATES; i++) {
+        scene_clear_state(&scene->states[i]);
+        scene_release_state(&scene->states[i]);
     }
+    for (i=0; i<scene->objects.count; i++)
+        HANDLES_ITEM(scene->objects, Object3D, i)->destroy(HANDLES_ITEM(scene->objects, Object3D, i));
+    for (i=0; i<scene->background_objects.count; i++)
+        HANDLES_ITEM(scene->background_objects, Object3D, i)->destroy(HANDLES_ITEM(scene->background_objects, Object3D, i));
+    for (i=0; i<scene->lights.count; i++)
+        light_destroy(HANDLES_ITEM(scene->lights, Light, i));
+    for (i=0; i<scene->skyboxes.count; i++)
+        skybox_destroy(HANDLES_ITEM(scene->skyboxes, Skybox, i));
+    for (i=0; i<scene->effects.count; i++)
+        HANDLES_ITEM(scene->effects, Effect, i)->destroy(HANDLES_ITEM(scene->effects, Effect, i));
+    handles_release(&scene->objects);
+    handles_release(&scene->background_objects);
+    handles_release(&scene->lights);
+    handles_release(&scene->skyboxes);
+    handles_release(&scene->effects);
     camera_destroy(scene->camera);
-    if (scene->static_objects) octree_destroy(scene->static_objects);
+    if (scene->static_objects) octree_destroy(scene->static_objects, TRUE);
+    scenegraph_destroy(scene->graph);
+    scene_release_bvh(scene);
+    renderqueue_destroy(scene->render_queue);
+    for (i=0; i<SCENE_STATES; i++) {
+        SceneState *state = &scene->states[i];
+        if (state->objects) free(state->objects);
+        if (state->static_nodes) free(state->static_nodes);
+        if (state->lights) free(state->lights);
+        if (state->skyboxes) free(state->skyboxes);
+        if (state->effects) free(state->effects);
+        if (state->effect_data) free(state->effect_data);
+    }
     free(scene);
 }
 
@@ -92,30 +150,43 @@ void scene_reshape_viewport(Scene *scene, int width, int height) {
     camera_reshape_viewport(scene->camera, width, height);
 }
 
+/* Draw the latest published state, or the live scene while nothing has
+ * been published. A published state supplies the transforms, bounds,
+ * visibility, levels of detail, lights and skyboxes; materials, geometry
+ * and the scene's settings are still read live.
+ */
 void scene_render(Scene *scene) {
+    SceneState *state = scene_acquire_state(scene);
     camera_update_view_frustum(scene->camera);
-    int light_index = 0;
-    LightList *le;
-    SkyboxList *se;
-    Object3DList *oe;
-    EffectList *ee;
+    int i, static_count, static_visible;
+    memset(&scene->cull_stats, 0, sizeof(CullStats));
+    glstate_begin_frame();
+    object3d_reset_render_state();
     glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glEnable(GL_DEPTH_TEST);
-    LL_FOREACH(scene->lights, le) {
-        light_setup(le->light, light_index++);
-    }
-    LL_FOREACH(scene->skyboxes, se) {
-        skybox_render(se->skybox);
+    glstate_blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glstate_enable(GL_DEPTH_TEST);
+    if (state) {
+        for (i=0; i<state->light_count; i++)
+            light_setup(&state->lights[i], i);
+        for (i=0; i<state->skybox_count; i++)
+            scene_render_published_skybox(state, &state->skyboxes[i]);
+    } else {
+        for (i=0; i<scene->lights.count; i++)
+            light_setup(HANDLES_ITEM(scene->lights, Light, i), i);
+        for (i=0; i<scene->skyboxes.count; i++)
+            skybox_render(HANDLES_ITEM(scene->skyboxes, Skybox, i));
     }
     glClear(GL_DEPTH_BUFFER_BIT);
-    LL_FOREACH(scene->background_objects, oe) {
-        oe->object->render(oe->object);
+    if (state) {
+        for (i=0; i<state->background_count; i++)
+            scene_render_object(scene, state->objects[i].object, RP_BACKGROUND);
+    } else {
+        for (i=0; i<scene->background_objects.count; i++)
+            scene_render_object(scene, HANDLES_ITEM(scene->background_objects, Object3D, i), RP_BACKGROUND);
     }
+    renderqueue_flush(scene->render_queue);
     glClear(GL_DEPTH_BUFFER_BIT);
-    LL_FOREACH(scene->effects, ee) {
-        ee->effect->render(ee->effect, EF_BACKGROUND);
-    }
+    scene_render_effects(scene, state, EF_BACKGROUND);
     glClear(GL_DEPTH_BUFFER_BIT);
     if (scene->fog_enabled) {
         glFogf(GL_FOG_MODE, scene->fog_mode);
@@ -123,21 +194,33 @@ void scene_render(Scene *scene) {
         glFogf(GL_FOG_END, scene->fog_end);
         glFogfv(GL_FOG_COLOR, COLORFA(scene->fog_color));
         glFogf(GL_FOG_DENSITY, scene->fog_density);
-        glEnable(GL_FOG);
+        glstate_enable(GL_FOG);
     } else {
-        glDisable(GL_FOG);
+        glstate_disable(GL_FOG);
     }
-    LL_FOREACH(scene->objects, oe) {
-        oe->object->render(oe->object);
+    if (state) {
+        scene_render_published_graph(scene, state);
+    } else {
+        int graph_visible = scenegraph_query_frustum(scene->graph, scene->culling_enabled ? scene->camera : NULL,
+                                                     scene_render_graph_object, scene);
+        scene->cull_stats.tested += scene->graph->drawable_count-graph_visible;
+        scene->cull_stats.culled += scene->graph->drawable_count-graph_visible;
     }
-    LL_FOREACH(scene->effects, ee) {
-        ee->effect->render(ee->effect, EF_SCENE);
+    if (state) {
+        static_count = state->static_count;
+        static_visible = scene_render_published_static(scene, state);
+    } else {
+        static_count = scene->static_objects->root->object_count;
+        static_visible = octree_query_frustum(scene->static_objects, scene->camera, scene_render_static_object, scene);
     }
+    scene->cull_stats.tested += static_count;
+    scene->cull_stats.culled += static_count-static_visible;
+    renderqueue_flush(scene->render_queue);
+    object3d_reset_render_state();
+    scene_render_effects(scene, state, EF_SCENE);
     camera_set_ortho(scene->camera);
     glClear(GL_DEPTH_BUFFER_BIT);
-    LL_FOREACH(scene->effects, ee) {
-        ee->effect->render(ee->effect, EF_OVERLAY);
-    }
+    scene_render_effects(scene, state, EF_OVERLAY);
     camera_clear_ortho(scene->camera);
     if (scene->show_grid)
         render_grid(scene);
@@ -145,156 +228,584 @@ void scene_render(Scene *scene) {
         render_axis(scene);
 }
 
-void scene_update(Scene *scene) {
-    EffectList *ee;
-    LL_FOREACH(scene->effects, ee) {
-        ee->effect->update(scene, ee->effect);
+static void scene_render_effects(Scene *scene, SceneState *state, EffectRenderLevel level) {
+    int i;
+    if (state) {
+        for (i=0; i<state->effect_count; i++)
+            state->effects[i].effect->render(state->effects[i].effect, level);
+    } else {
+        for (i=0; i<scene->effects.count; i++)
+            HANDLES_ITEM(scene->effects, Effect, i)->render(HANDLES_ITEM(scene->effects, Effect, i), level);
     }
 }
 
-void scene_add_object(Scene *scene, Object3D *object) {
-    LOG("adding object %x\n", object);
-    Object3DList *e = malloc(sizeof(Object3DList));
-    e->object = object;
-    LL_APPEND(scene->objects, e);
+/* Capture the scene for the render thread. Called by the update thread
+ * after scene_update(); fills the back state and swaps it with the ready
+ * slot, so the renderer always finds the latest complete state and
+ * neither thread waits on the other. Every object and effect captured is
+ * held until its state comes back as the back state, which happens only
+ * once the renderer has moved on to a newer one; removing or destroying
+ * them meanwhile is safe, destroying them being put off until then.
+ */
+void scene_publish(Scene *scene) {
+    SceneState *state = &scene->states[scene->state_back];
+    SceneGraph *graph = scene->graph;
+    Octree *octree = scene->static_objects;
+    Object3DList *e;
+    int count, size, i, j;
+    scene_release_state(state);
+    if (graph->dirty || graph->hierarchy_generation != object3d_hierarchy_generation())
+        scenegraph_update(graph, (Object3D**)scene->objects.items, scene->objects.count);
+    state->background_count = scene->background_objects.count;
+    count = state->background_count+graph->node_count+octree->root->object_count;
+    for (i=0; i<scene->skyboxes.count; i++)
+        LL_FOREACH(HANDLES_ITEM(scene->skyboxes, Skybox, i)->planes, e)
+            count++;
+    if (count > state->object_capacity) {
+        state->object_capacity = count*2;
+        state->objects = realloc(state->objects, sizeof(ObjectState)*state->object_capacity);
+    }
+    for (i=0; i<state->background_count; i++) {
+        scene_capture_object(scene, &state->objects[i], HANDLES_ITEM(scene->background_objects, Object3D, i));
+        state->objects[i].subtree_box = state->objects[i].box;
+        state->objects[i].subtree_end = i+1;
+    }
+    for (j=0; j<graph->node_count; j++, i++) {
+        scene_capture_object(scene, &state->objects[i], graph->nodes[j]);
+        state->objects[i].subtree_box = graph->bounds[j];
+        state->objects[i].subtree_end = state->background_count+graph->ends[j];
+    }
+    state->drawable_count = graph->drawable_count;
+    state->static_first = i;
+    state->static_count = octree->root->object_count;
+    if (octree->node_count > state->static_node_capacity) {
+        state->static_node_capacity = octree->node_count*2;
+        state->static_nodes = realloc(state->static_nodes, sizeof(OctreeNodeState)*state->static_node_capacity);
+    }
+    state->static_node_count = 0;
+    scene_capture_octree(scene, state, octree->root, &i);
+    if (scene->skyboxes.count > state->skybox_capacity) {
+        state->skybox_capacity = scene->skyboxes.count*2;
+        state->skyboxes = realloc(state->skyboxes, sizeof(SkyboxState)*state->skybox_capacity);
+    }
+    for (j=0; j<scene->skyboxes.count; j++) {
+        Skybox *skybox = HANDLES_ITEM(scene->skyboxes, Skybox, j);
+        SkyboxState *s = &state->skyboxes[j];
+        s->eye = skybox->camera->position;
+        s->fixed_proximity = skybox->fixed_proximity;
+        s->first_plane = i;
+        LL_FOREACH(skybox->planes, e)
+            scene_capture_object(scene, &state->objects[i++], e->object);
+        s->plane_count = i-s->first_plane;
+    }
+    state->skybox_count = scene->skyboxes.count;
+    state->object_count = i;
+    if (scene->lights.count > state->light_capacity) {
+        state->light_capacity = scene->lights.count*2;
+        state->lights = realloc(state->lights, sizeof(Light)*state->light_capacity);
+    }
+    for (i=0; i<scene->lights.count; i++)
+        state->lights[i] = *HANDLES_ITEM(scene->lights, Light, i);
+    state->light_count = scene->lights.count;
+    state->camera.position = scene->camera->position;
+    state->camera.target = scene->camera->target;
+    state->camera.up = scene->camera->up;
+    count = scene->effects.count;
+    for (i=size=0; i<count; i++)
+        size += HANDLES_ITEM(scene->effects, Effect, i)->state_size;
+    if (count > state->effect_capacity) {
+        state->effect_capacity = count*2;
+        state->effects = realloc(state->effects, sizeof(EffectState)*state->effect_capacity);
+    }
+    if (size > state->effect_data_capacity) {
+        state->effect_data_capacity = size*2;
+        state->effect_data = realloc(state->effect_data, state->effect_data_capacity);
+    }
+    for (i=size=0; i<count; i++) {
+        Effect *effect = HANDLES_ITEM(scene->effects, Effect, i);
+        effect_hold(effect);
+        state->effects[i].effect = effect;
+        state->effects[i].offset = size;
+        if (effect->publish)
+            effect->publish(effect, state->effect_data+size);
+        size += effect->state_size;
+    }
+    state->effect_count = count;
+    state->frame = ++scene->state_frame;
+    scene->state_back = __atomic_exchange_n(&scene->state_ready, scene->state_back|SCENE_STATE_FRESH, __ATOMIC_ACQ_REL)&SCENE_STATE_INDEX;
 }
 
-void scene_remove_object(Scene *scene, Object3D *object) {
-    Object3DList *e, *t;
-    LL_FOREACH_SAFE(scene->objects, e, t) {
-        if (e->object == object) {
-            LL_DELETE(scene->objects, e);
-            free(e);
+static void scene_capture_object(Scene *scene, ObjectState *state, Object3D *object) {
+    object3d_hold(object);
+    state->object = object;
+    state->position = object->position;
+    state->scale = object->scale;
+    dupmx(state->rotation, object->rotation);
+    dupmx(state->world, object3d_world_matrix(object));
+    state->visible = object->visible;
+    object3d_world_bounds(object, &state->center, &state->radius, &state->box);
+    state->lod = scene_select_lod(scene, object, state->center, state->radius);
+}
+
+/* Static objects are captured node by node, depth first, skipping empty
+ * subtrees, so the renderer can cull them a subtree at a time as the
+ * octree query does.
+ */
+static void scene_capture_octree(Scene *scene, SceneState *state, OctreeNode *node, int *object) {
+    int index = state->static_node_count++;
+    OctreeNodeState *s = &state->static_nodes[index];
+    Object3DList *e;
+    int i;
+    s->center = node->center;
+    s->half_width = node->half_width;
+    s->root = node->parent == NULL;
+    s->first_object = *object;
+    LL_FOREACH(node->objects, e)
+        scene_capture_object(scene, &state->objects[(*object)++], e->object);
+    s->object_end = *object;
+    for (i=0; i<8; i++)
+        if (node->nodes[i] && node->nodes[i]->object_count > 0)
+            scene_capture_octree(scene, state, node->nodes[i], object);
+    state->static_nodes[index].subtree_end = state->static_node_count;
+}
+
+/* Drop the holds a state took as it was published, freeing whatever was
+ * destroyed since. Update thread only.
+ */
+static void scene_release_state(SceneState *state) {
+    int i;
+    for (i=0; i<state->object_count; i++)
+        object3d_release(state->objects[i].object);
+    for (i=0; i<state->effect_count; i++)
+        effect_release(state->effects[i].effect);
+    state->object_count = 0;
+    state->effect_count = 0;
+}
+
+/* Point the objects and effects captured in a state away from it, as the
+ * renderer leaves it. The state still holds them, so none has been freed.
+ */
+static void scene_clear_state(SceneState *state) {
+    int i;
+    for (i=0; i<state->object_count; i++)
+        state->objects[i].object->state = NULL;
+    for (i=0; i<state->effect_count; i++)
+        state->effects[i].effect->state = NULL;
+}
+
+/* Take the most recently published state, if there is a newer one, and
+ * point the objects, camera and effects at it in place of the last.
+ * Returns NULL while nothing has been published, in which case the live
+ * scene is drawn.
+ */
+static SceneState *scene_acquire_state(Scene *scene) {
+    SceneState *state = &scene->states[scene->state_front];
+    int i;
+    if (__atomic_load_n(&scene->state_ready, __ATOMIC_ACQUIRE)&SCENE_STATE_FRESH) {
+        scene_clear_state(state);
+        scene->state_front = __atomic_exchange_n(&scene->state_ready, scene->state_front, __ATOMIC_ACQ_REL)&SCENE_STATE_INDEX;
+        state = &scene->states[scene->state_front];
+        for (i=0; i<state->object_count; i++)
+            state->objects[i].object->state = &state->objects[i];
+        scene->camera->state = &state->camera;
+        for (i=0; i<state->effect_count; i++)
+            state->effects[i].effect->state = state->effect_data+state->effects[i].offset;
+    }
+    return state->frame ? state : NULL;
+}
+
+/* Queue an object for drawing unless it is hidden or its bounds fall
+ * outside the camera frustum. The sphere test rejects most objects cheaply;
+ * the box test catches long objects whose sphere grazes the frustum.
+ */
+static void scene_render_object(Scene *scene, Object3D *object, RenderPass pass) {
+    Number3D center;
+    float radius;
+    AABB box;
+    if (!OBJ3D_STATE(object, visible))
+        return;
+    if (object->state) {
+        center = object->state->center;
+        radius = object->state->radius;
+        box = object->state->box;
+    } else {
+        object3d_world_bounds(object, &center, &radius, &box);
+    }
+    if (scene->culling_enabled) {
+        scene->cull_stats.tested++;
+        if (!camera_sphere_in_frustrum(scene->camera, center, radius) ||
+            !camera_box_in_frustum(scene->camera, box)) {
+            scene->cull_stats.culled++;
             return;
         }
     }
-    LOGERR("object not found for remove");
+    scene_queue_object(scene, object, pass, center, radius);
 }
 
-void scene_clear_objects(Scene *scene) {
-    Object3DList *e, *t;
-    LL_FOREACH_SAFE(scene->objects, e, t) {
-        LL_DELETE(scene->objects, e);
-        free(e);
-    }
+/* Scene graph objects arrive here with their subtrees' boxes in view.
+ */
+static int scene_render_graph_object(Object3D *object, void *data) {
+    scene_render_object((Scene*)data, object, RP_SCENE);
+    return TRUE;
 }
 
-void scene_add_background_object(Scene *scene, Object3D *object) {
-    LOG("adding background object %x\n", object);
-    Object3DList *e = malloc(sizeof(Object3DList));
-    e->object = object;
-    LL_APPEND(scene->background_objects, e);
+/* The scene graph as published, walked in its depth-first order. A subtree
+ * is passed over when its root is hidden or its box is out of view.
+ */
+static void scene_render_published_graph(Scene *scene, SceneState *state) {
+    int visible = 0;
+    int i = state->background_count;
+    while (i < state->static_first) {
+        const ObjectState *s = &state->objects[i];
+        if (!s->visible || (scene->culling_enabled && !camera_box_in_frustum(scene->camera, s->subtree_box))) {
+            i = s->subtree_end;
+            continue;
+        }
+        if (s->object->vertex_count > 0) {
+            scene_render_object(scene, s->object, RP_SCENE);
+            visible++;
+        }
+        i++;
+    }
+    scene->cull_stats.tested += state->drawable_count-visible;
+    scene->cull_stats.culled += state->drawable_count-visible;
 }
 
-void scene_remove_background_object(Scene *scene, Object3D *object) {
-    Object3DList *e, *t;
-    LL_FOREACH_SAFE(scene->background_objects, e, t) {
-        if (e->object == object) {
-            LL_DELETE(scene->background_objects, e);
-            free(e);
-            return;
+/* Static objects as published, culled node by node as the octree query
+ * does. Returns how many passed the frustum test.
+ */
+static int scene_render_published_static(Scene *scene, SceneState *state) {
+    int visible = 0, inside_end = 0;
+    int i = 0, j;
+    while (i < state->static_node_count) {
+        const OctreeNodeState *node = &state->static_nodes[i];
+        int inside = i < inside_end;
+        // the root also holds objects outside its bounds, so always open it
+        if (!inside && !node->root) {
+            int c = octree_classify(node->center, node->half_width, scene->camera);
+            if (c == 0) {
+                i = node->subtree_end;
+                continue;
+            }
+            if (c == 2) {
+                inside = TRUE;
+                inside_end = node->subtree_end;
+            }
         }
+        for (j=node->first_object; j<node->object_end; j++) {
+            const ObjectState *s = &state->objects[j];
+            if (!inside && !camera_sphere_in_frustrum(scene->camera, s->center, s->radius))
+                continue;
+            visible++;
+            if (s->visible)
+                scene_queue_object(scene, s->object, RP_SCENE, s->center, s->radius);
+        }
+        i++;
     }
-    LOGERR("background object not found for remove");
+    return visible;
 }
 
-void scene_clear_background_objects(Scene *scene) {
-    Object3DList *e, *t;
-    LL_FOREACH_SAFE(scene->background_objects, e, t) {
-        LL_DELETE(scene->background_objects, e);
-        free(e);
+/* Static objects of the live scene arrive here already culled by the
+ * octree query.
+ */
+static int scene_render_static_object(Object3D *object, void *data) {
+    Scene *scene = (Scene*)data;
+    Number3D center;
+    float radius;
+    AABB box;
+    if (object->visible) {
+        object3d_world_bounds(object, &center, &radius, &box);
+        scene_queue_object(scene, object, RP_SCENE, center, radius);
     }
+    return TRUE;
 }
 
-void scene_add_light(Scene *scene, Light *light) {
-    LightList *e = malloc(sizeof(LightList));
-    e->light = light;
-    LL_APPEND(scene->lights, e);
+/* Objects with levels of detail get theirs picked from the size of their
+ * bounding sphere on screen, as they are published or, drawing the live
+ * scene, as they are queued. Returns the level picked.
+ */
+static int scene_select_lod(Scene *scene, Object3D *object, Number3D center, float radius) {
+    if (object->lod_count > 1) {
+        if (scene->lod_enabled)
+            object3d_select_lod(object, camera_projected_radius(scene->camera, center, radius),
+                                scene->lod_pixel_error, scene->lod_hysteresis);
+        else
+            object->lod = 0;
+    }
+    return object->lod;
 }
 
-void scene_remove_light(Scene *scene, Light *light) {
-    LightList *e, *t;
-    LL_FOREACH_SAFE(scene->lights, e, t) {
-        if (e->light == light) {
-            LL_DELETE(scene->lights, e);
-            free(e);
-            return;
-        }
+static void scene_queue_object(Scene *scene, Object3D *object, RenderPass pass, Number3D center, float radius) {
+    float depth = len3d(vec3d(CAMERA_STATE(scene->camera, position), center));
+    if (object->state == NULL)
+        scene_select_lod(scene, object, center, radius);
+    renderqueue_add(scene->render_queue, object, pass, depth, scene->camera->far_clip);
+    scene->cull_stats.drawn++;
+}
+
+void scene_update(Scene *scene) {
+    int i;
+    if (scenegraph_update(scene->graph, (Object3D**)scene->objects.items, scene->objects.count))
+        scene->bvh_dirty = TRUE;
+    scene_update_bvh(scene);
+    for (i=0; i<scene->effects.count; i++)
+        HANDLES_ITEM(scene->effects, Effect, i)->update(scene, HANDLES_ITEM(scene->effects, Effect, i));
+}
+
+/* Scene objects and the other collections below live in handle arrays.
+ * Adding returns a handle that removes the item in constant time;
+ * removing by pointer finds the handle first, which for objects is kept
+ * on the object. Removal moves the last item into the gap, so the order
+ * items were added in is not kept.
+ */
+Handle scene_add_object(Scene *scene, Object3D *object) {
+    LOGDEBUG("adding object %p\n", object);
+    object->scene_handle = handles_add(&scene->objects, object);
+    scenegraph_invalidate(scene->graph);
+    scene->bvh_dirty = TRUE;
+    return object->scene_handle;
+}
+
+Object3D *scene_remove_object_handle(Scene *scene, Handle handle) {
+    Object3D *object = handles_remove(&scene->objects, handle);
+    if (object) {
+        scenegraph_invalidate(scene->graph);
+        scene->bvh_dirty = TRUE;
     }
-    LOGERR("light not found for remove");
+    return object;
+}
+
+static Handle scene_object_handle(const HandleArray *array, const Object3D *object) {
+    if (handles_get(array, object->scene_handle) == object)
+        return object->scene_handle;
+    return handles_find(array, object);
+}
+
+void scene_remove_object(Scene *scene, Object3D *object) {
+    if (!scene_remove_object_handle(scene, scene_object_handle(&scene->objects, object)))
+        LOGERR("object not found for remove");
+}
+
+void scene_clear_objects(Scene *scene) {
+    handles_clear(&scene->objects);
+    scenegraph_invalidate(scene->graph);
+    scene->bvh_dirty = TRUE;
+}
+
+Handle scene_add_background_object(Scene *scene, Object3D *object) {
+    LOGDEBUG("adding background object %p\n", object);
+    object->scene_handle = handles_add(&scene->background_objects, object);
+    return object->scene_handle;
+}
+
+Object3D *scene_remove_background_object_handle(Scene *scene, Handle handle) {
+    return handles_remove(&scene->background_objects, handle);
+}
+
+void scene_remove_background_object(Scene *scene, Object3D *object) {
+    if (!handles_remove(&scene->background_objects, scene_object_handle(&scene->background_objects, object)))
+        LOGERR("background object not found for remove");
+}
+
+void scene_clear_background_objects(Scene *scene) {
+    handles_clear(&scene->background_objects);
+}
+
+/* Static objects are indexed in the scene octree rather than walked every
+ * frame. Call scene_update_static_object after moving one.
+ */
+void scene_add_static_object(Scene *scene, Object3D *object) {
+    LOGDEBUG("adding static object %p\n", object);
+    octree_insert(scene->static_objects, object);
+}
+
+void scene_remove_static_object(Scene *scene, Object3D *object) {
+    octree_remove(scene->static_objects, object);
+}
+
+void scene_update_static_object(Scene *scene, Object3D *object) {
+    octree_update(scene->static_objects, object);
+}
+
+void scene_clear_static_objects(Scene *scene) {
+    Octree *octree = scene->static_objects;
+    scene->static_objects = octree_create(octree->root->center, octree->root->half_width, octree->max_depth);
+    octree_destroy(octree, FALSE);
+}
+
+Handle scene_add_light(Scene *scene, Light *light) {
+    return handles_add(&scene->lights, light);
+}
+
+Light *scene_remove_light_handle(Scene *scene, Handle handle) {
+    return handles_remove(&scene->lights, handle);
+}
+
+void scene_remove_light(Scene *scene, Light *light) {
+    if (!handles_remove(&scene->lights, handles_find(&scene->lights, light)))
+        LOGERR("light not found for remove");
 }
 
 void scene_clear_lights(Scene *scene) {
-    LightList *e, *t;
-    LL_FOREACH_SAFE(scene->lights, e, t) {
-        LL_DELETE(scene->lights, e);
-        free(e);
-    }
+    handles_clear(&scene->lights);
+}
+
+Handle scene_add_skybox(Scene *scene, Skybox *skybox) {
+    return handles_add(&scene->skyboxes, skybox);
 }
 
-void scene_add_skybox(Scene *scene, Skybox *skybox) {
-    SkyboxList *e = malloc(sizeof(SkyboxList));
-    e->skybox = skybox;
-    LL_APPEND(scene->skyboxes, e);
+Skybox *scene_remove_skybox_handle(Scene *scene, Handle handle) {
+    return handles_remove(&scene->skyboxes, handle);
 }
 
 void scene_remove_skybox(Scene *scene, Skybox *skybox) {
-    SkyboxList *e, *t;
-    LL_FOREACH_SAFE(scene->skyboxes, e, t) {
-        if (e->skybox == skybox) {
-            LL_DELETE(scene->skyboxes, e);
-            free(e);
-            return;
-        }
-    }
-    LOGERR("skybox not found for remove");
+    if (!handles_remove(&scene->skyboxes, handles_find(&scene->skyboxes, skybox)))
+        LOGERR("skybox not found for remove");
 }
 
 void scene_clear_skyboxes(Scene *scene) {
-    SkyboxList *e, *t;
-    LL_FOREACH_SAFE(scene->skyboxes, e, t) {
-        LL_DELETE(scene->skyboxes, e);
-        free(e);
-    }
+    handles_clear(&scene->skyboxes);
+}
+
+Handle scene_add_effect(Scene *scene, Effect *effect) {
+    return handles_add(&scene->effects, effect);
 }
 
-void scene_add_effect(Scene *scene, Effect *effect) {
-    EffectList *e = malloc(sizeof(EffectList));
-    e->effect = effect;
-    LL_APPEND(scene->effects, e);
+Effect *scene_remove_effect_handle(Scene *scene, Handle handle) {
+    return handles_remove(&scene->effects, handle);
 }
 
 void scene_remove_effect(Scene *scene, Effect *effect) {
-    EffectList *e, *t;
-    LL_FOREACH_SAFE(scene->effects, e, t) {
-        if (e->effect == effect) {
-            LL_DELETE(scene->effects, e);
-            free(e);
-            return;
-        }
-    }
-    LOGERR("effect not found for remove");
+    if (!handles_remove(&scene->effects, handles_find(&scene->effects, effect)))
+        LOGERR("effect not found for remove");
 }
 
 void scene_clear_effects(Scene *scene) {
-    EffectList *e, *t;
-    LL_FOREACH_SAFE(scene->effects, e, t) {
-        LL_DELETE(scene->effects, e);
-        free(e);
-    }
+    handles_clear(&scene->effects);
 }
 
 int scene_point_occluded(Scene *scene, Camera *camera, Number3D point) {
     Line3D ray;
+    float t;
     ray.p0 = camera->position;
     ray.p1 = nvec3d(camera->position, point);
-    Object3DList *o;
-    Number3D w;
-    LL_FOREACH(scene->objects, o) {
-        if (object3d_ray_intersects(o->object, ray, &w))
-            return TRUE;
+    return scene_ray_cast(scene, ray, len3d(vec3d(camera->position, point)), TRUE, &t) != NULL;
+}
+
+/* Closest object hit by a ray (origin p0, unit direction p1), with the
+ * point of contact in where.
+ */
+Object3D *scene_pick(Scene *scene, Line3D ray, Number3D *where) {
+    float t;
+    Object3D *object = scene_ray_cast(scene, ray, FLT_MAX, FALSE, &t);
+    if (object != NULL && where != NULL) {
+        *where = ray.p1;
+        muls3d(where, t);
+        add3d(where, ray.p0);
+    }
+    return object;
+}
+
+static Object3D *scene_ray_cast(Scene *scene, Line3D ray, float tmax, int any_hit, float *t) {
+    RayQuery query = { scene, ray, tmax, any_hit, NULL };
+    if (scene->object_bvh != NULL && !scene->bvh_dirty &&
+        scene->graph->hierarchy_generation == object3d_hierarchy_generation()) {
+        int i = bvh_intersect(scene->object_bvh, ray, query.tmax, any_hit, ray_cast_primitive, &query, &query.tmax);
+        if (i >= 0) {
+            query.object = scene->bvh_objects[i];
+            if (any_hit) {
+                *t = query.tmax;
+                return query.object;
+            }
+        }
+    } else {
+        // objects changed since the last update, test them directly
+        int i;
+        for (i=0; i<scene->objects.count; i++) {
+            if (!ray_cast_tree(HANDLES_ITEM(scene->objects, Object3D, i), &query))
+                break;
+        }
+    }
+    if (query.object == NULL || !any_hit)
+        octree_query_ray(scene->static_objects, ray, ray_cast_object, &query);
+    if (query.object != NULL)
+        *t = query.tmax;
+    return query.object;
+}
+
+static int ray_cast_object(Object3D *object, void *data) {
+    RayQuery *query = (RayQuery*)data;
+    float t;
+    if (object3d_ray_cast(object, query->ray, query->tmax, query->any_hit, &t)) {
+        query->tmax = t;
+        query->object = object;
+        return !query->any_hit;
+    }
+    return TRUE;
+}
+
+static int ray_cast_tree(Object3D *object, RayQuery *query) {
+    Object3D *child;
+    if (object->vertex_count > 0 && !ray_cast_object(object, query))
+        return FALSE;
+    for (child=object->first_child; child; child=child->next_sibling)
+        if (!ray_cast_tree(child, query))
+            return FALSE;
+    return TRUE;
+}
+
+static int ray_cast_primitive(int primitive, Line3D ray, float tmax, float *t, void *data) {
+    RayQuery *query = (RayQuery*)data;
+    return object3d_ray_cast(query->scene->bvh_objects[primitive], ray, tmax, query->any_hit, t);
+}
+
+/* Keep the top-level hierarchy over the scene graph's objects with geometry
+ * current. Adding, removing, attaching or detaching objects forces a
+ * rebuild; otherwise the tree is refit to the objects' new bounds, with a
+ * periodic rebuild as refitting degrades it.
+ */
+static void scene_update_bvh(Scene *scene) {
+    SceneGraph *graph = scene->graph;
+    Number3D center;
+    float radius;
+    int i, j;
+    if (scene->bvh_dirty || scene->bvh_refits >= SCENE_BVH_REBUILD) {
+        if (scene->bvh_dirty) {
+            scene_release_bvh(scene);
+            scene->bvh_object_count = graph->drawable_count;
+            if (scene->bvh_object_count > 0) {
+                scene->bvh_objects = malloc(sizeof(Object3D*)*scene->bvh_object_count);
+                scene->bvh_bounds = malloc(sizeof(Cube3D)*scene->bvh_object_count);
+            }
+            for (i=j=0; i<graph->node_count; i++) {
+                if (graph->nodes[i]->vertex_count > 0)
+                    scene->bvh_objects[j++] = graph->nodes[i];
+            }
+        } else if (scene->object_bvh != NULL) {
+            bvh_destroy(scene->object_bvh);
+            scene->object_bvh = NULL;
+        }
+        for (i=0; i<scene->bvh_object_count; i++)
+            object3d_world_bounds(scene->bvh_objects[i], &center, &radius, &scene->bvh_bounds[i]);
+        scene->object_bvh = bvh_build(scene->bvh_bounds, scene->bvh_object_count, 1);
+        scene->bvh_dirty = FALSE;
+        scene->bvh_refits = 0;
+    } else if (scene->object_bvh != NULL) {
+        for (i=0; i<scene->bvh_object_count; i++)
+            object3d_world_bounds(scene->bvh_objects[i], &center, &radius, &scene->bvh_bounds[i]);
+        bvh_refit(scene->object_bvh, scene->bvh_bounds);
+        scene->bvh_refits++;
     }
-    return FALSE;
+}
+
+static void scene_release_bvh(Scene *scene) {
+    if (scene->object_bvh) bvh_destroy(scene->object_bvh);
+    if (scene->bvh_objects) free(scene->bvh_objects);
+    if (scene->bvh_bounds) free(scene->bvh_bounds);
+    scene->object_bvh = NULL;
+    scene->bvh_objects = NULL;
+    scene->bvh_bounds = NULL;
+    scene->bvh_object_count = 0;
 }
 
 static void build_grid(Scene *scene) {
@@ -327,20 +838,20 @@ static void build_axis(Scene *scene) {
 static void render_grid(Scene *scene) {
     //glClear(GL_DEPTH_BUFFER_BIT);
     //glEnable(GL_LINE_SMOOTH);
-    glDisable(GL_LINE_SMOOTH);
+    glstate_disable(GL_LINE_SMOOTH);
     //glHint(GL_LINE_SMOOTH_HINT, GL_DONT_CARE);
     glLineWidth(1.0f);
     glColor4f(1.0f, 1.0f, 1.0f, 0.2f);
-    glDisable(GL_LIGHTING);
-    glScalef(3.0f, 3.0f, 3.0f);
+    glstate_disable(GL_LIGHTING);
+    matrix_scale(3.0f, 3.0f, 3.0f);
     glVertexPointer(3, GL_FLOAT, 0, scene->grid_floor_points);
     glDrawArrays(GL_LINES, 0, GRID_LINES*4);
 }
 
 static void render_axis(Scene *scene) {
-    glDisableClientState(GL_NORMAL_ARRAY);
-    glDisable(GL_LIGHTING);
-    glEnable(GL_LINE_SMOOTH);
+    glstate_disable_client(GL_NORMAL_ARRAY);
+    glstate_disable(GL_LIGHTING);
+    glstate_enable(GL_LINE_SMOOTH);
     glHint (GL_LINE_SMOOTH_HINT, GL_NICEST);
     glLineWidth(2.0f);
     //glClear(GL_DEPTH_BUFFER_BIT);
@@ -417,7 +928,8 @@ Skybox *skybox_create(const char *resources, const char *texture, float distance
                 ortmx(OBJ3D(p)->rotation, EULER3D(90, 0, 180));
                 break;
             }
-            Object3DList *pl = calloc(1, sizeof(Object3DList));
+            object3d_invalidate_transform(OBJ3D(p));
+            Object3DList *pl = pool_alloc(&list_pool);
             pl->object = (Object3D*)p;
             LL_APPEND(skybox->planes, pl);
         }
@@ -429,26 +941,38 @@ void skybox_destroy(Skybox *skybox) {
     Object3DList *e, *t;
     LL_FOREACH_SAFE(skybox->planes, e, t) {
         e->object->destroy(e->object);
-        free(e);
+        pool_free(&list_pool, e);
     }
     free(skybox);
 }
 
 static void skybox_render(Skybox *skybox) {
     Object3DList *pl;
-    glPushMatrix();
+    matrix_push();
     if (skybox->fixed_proximity) {
-        glTranslatef(NUM3DFL(skybox->camera->position));
+        matrix_translate(NUM3DFL(CAMERA_STATE(skybox->camera, position)));
     }
     LL_FOREACH(skybox->planes, pl) {
         pl->object->render(pl->object);
     }
-    glPopMatrix();
+    matrix_pop();
+}
+
+/* A skybox as published, its planes drawn from their captured transforms.
+ */
+static void scene_render_published_skybox(const SceneState *state, const SkyboxState *skybox) {
+    int i;
+    matrix_push();
+    if (skybox->fixed_proximity)
+        matrix_translate(NUM3DFL(skybox->eye));
+    for (i=skybox->first_plane; i<skybox->first_plane+skybox->plane_count; i++)
+        state->objects[i].object->render(state->objects[i].object);
+    matrix_pop();
 }
 
 static void light_setup(Light *light, int id) {
     if (light->enabled) {
-        glEnable(GL_LIGHT0+id);
+        glstate_enable(GL_LIGHT0+id);
         glLightfv(GL_LIGHT0+id, GL_AMBIENT, COLORFA(light->ambient));
         glLightfv(GL_LIGHT0+id, GL_DIFFUSE, COLORFA(light->diffuse));
         glLightfv(GL_LIGHT0+id, GL_SPECULAR, COLORFA(light->specular));
@@ -463,40 +987,206 @@ static void light_setup(Light *light, int id) {
         glLightfv(GL_LIGHT0+id, GL_LINEAR_ATTENUATION, &light->linear_attenuation);
         glLightfv(GL_LIGHT0+id, GL_QUADRATIC_ATTENUATION, &light->quadratic_attenuation);
     } else {
-        glDisable(GL_LIGHT0+id);
+        glstate_disable(GL_LIGHT0+id);
     }
 }
 
-OctreeNode *octree_build(Number3D center, float radius, int depth, int max_depth) {
-    static float min_radius = -1.0f;
-    static int count = 0;
-    if (depth < 0) return NULL;
-    if (min_radius < 0.0f || radius < min_radius)
-        min_radius = radius;
-    OctreeNode *node = calloc(1, sizeof(OctreeNode));
-    count++;
+Octree *octree_create(Number3D center, float half_width, int max_depth) {
+    Octree *octree = calloc(1, sizeof(Octree));
+    octree->max_depth = max_depth;
+    octree->root = octree_node_create(octree, NULL, center, half_width);
+    return octree;
+}
+
+void octree_destroy(Octree *octree, int destroy_objects) {
+    octree_node_destroy(octree, octree->root, destroy_objects);
+    free(octree);
+}
+
+static OctreeNode *octree_node_create(Octree *octree, OctreeNode *parent, Number3D center, float half_width) {
+    OctreeNode *node = pool_alloc(&octree_node_pool);
+    memset(node, 0, sizeof(OctreeNode));
     node->center = center;
-    node->half_width = radius;
-    Number3D o;
+    node->half_width = half_width;
+    node->parent = parent;
+    node->depth = parent ? parent->depth+1 : 0;
+    octree->node_count++;
+    return node;
+}
+
+static void octree_node_destroy(Octree *octree, OctreeNode *node, int destroy_objects) {
+    Object3DList *e, *t;
     int i;
-    float step = radius * 0.5f;
-    for (i=0; i<8; i++) {
-        o.x = ((i & 1) ? step : -step);
-        o.y = ((i & 2) ? step : -step);
-        o.z = ((i & 4) ? step : -step);
-        add3d(&o, center);
-        node->nodes[i] = octree_build(o, step, depth-1, max_depth);
+    for (i=0; i<8; i++)
+        if (node->nodes[i]) octree_node_destroy(octree, node->nodes[i], destroy_objects);
+    LL_FOREACH_SAFE(node->objects, e, t) {
+        LL_DELETE(node->objects, e);
+        e->object->octree_node = NULL;
+        if (destroy_objects) e->object->destroy(e->object);
+        pool_free(&list_pool, e);
     }
-    if (depth == max_depth) {
-        LOG("octree: min radius: %f, count: %d, size: %dK\n", min_radius, count, count*sizeof(OctreeNode)/1024);
+    octree->node_count--;
+    pool_free(&octree_node_pool, node);
+}
+
+/* Free empty nodes from a leaf back up towards the root.
+ */
+static void octree_node_prune(Octree *octree, OctreeNode *node) {
+    while (node->parent && node->object_count == 0) {
+        OctreeNode *parent = node->parent;
+        int i;
+        for (i=0; i<8; i++)
+            if (parent->nodes[i] == node) parent->nodes[i] = NULL;
+        octree_node_destroy(octree, node, FALSE);
+        node = parent;
     }
-    return node;
 }
 
-void octree_destroy(OctreeNode *root) {
+void octree_insert(Octree *octree, Object3D *object) {
+    Number3D center;
+    float radius;
+    AABB box;
+    if (object->octree_node) {
+        LOGERR("object %p already in an octree\n", object);
+        return;
+    }
+    object3d_world_bounds(object, &center, &radius, &box);
+    OctreeNode *node = octree->root;
+    node->object_count++;
+    // objects centered outside the root stay in the root
+    while (node->depth < octree->max_depth &&
+           radius <= node->half_width*0.5f &&
+           fabsf(center.x-node->center.x) <= node->half_width &&
+           fabsf(center.y-node->center.y) <= node->half_width &&
+           fabsf(center.z-node->center.z) <= node->half_width) {
+        int i = (center.x > node->center.x ? 1 : 0) |
+                (center.y > node->center.y ? 2 : 0) |
+                (center.z > node->center.z ? 4 : 0);
+        if (node->nodes[i] == NULL) {
+            float step = node->half_width*0.5f;
+            Number3D o = NUM3D((i & 1) ? step : -step, (i & 2) ? step : -step, (i & 4) ? step : -step);
+            add3d(&o, node->center);
+            node->nodes[i] = octree_node_create(octree, node, o, step);
+        }
+        node = node->nodes[i];
+        node->object_count++;
+    }
+    Object3DList *e = pool_alloc(&list_pool);
+    e->object = object;
+    LL_APPEND(node->objects, e);
+    object->octree_node = node;
+}
+
+void octree_remove(Octree *octree, Object3D *object) {
+    OctreeNode *node = object->octree_node;
+    Object3DList *e, *t;
+    if (node == NULL) {
+        LOGERR("object %p not in an octree\n", object);
+        return;
+    }
+    LL_FOREACH_SAFE(node->objects, e, t) {
+        if (e->object == object) {
+            LL_DELETE(node->objects, e);
+            pool_free(&list_pool, e);
+            break;
+        }
+    }
+    object->octree_node = NULL;
+    OctreeNode *n;
+    for (n=node; n; n=n->parent)
+        n->object_count--;
+    octree_node_prune(octree, node);
+}
+
+void octree_update(Octree *octree, Object3D *object) {
+    octree_remove(octree, object);
+    octree_insert(octree, object);
+}
+
+/* Classify an octree node's loose bounds, from its center and half
+ * width, against the frustum: 0 outside, 1 intersecting, 2 fully inside.
+ */
+static int octree_classify(Number3D center, float half_width, Camera *camera) {
+    float hw = half_width*2.0f;
+    int p, result = 2;
+    for (p=0; p<6; p++) {
+        float *f = camera->frustum[p];
+        float d = f[0]*center.x+f[1]*center.y+f[2]*center.z+f[3];
+        float r = hw*(fabsf(f[0])+fabsf(f[1])+fabsf(f[2]));
+        if (d <= -r)
+            return 0;
+        if (d < r)
+            result = 1;
+    }
+    return result;
+}
+
+static int octree_node_query_frustum(OctreeNode *node, Camera *camera, int inside, OctreeVisitFPtr visit, void *data, int *visited) {
+    Object3DList *e;
+    int i;
+    if (node->object_count == 0)
+        return TRUE;
+    // the root also holds objects outside its bounds, so always open it
+    if (!inside && node->parent) {
+        int c = octree_classify(node->center, node->half_width, camera);
+        if (c == 0) return TRUE;
+        inside = (c == 2);
+    }
+    LL_FOREACH(node->objects, e) {
+        if (!inside) {
+            Number3D center;
+            float radius;
+            AABB box;
+            object3d_world_bounds(e->object, &center, &radius, &box);
+            if (!camera_sphere_in_frustrum(camera, center, radius))
+                continue;
+        }
+        (*visited)++;
+        if (!visit(e->object, data)) return FALSE;
+    }
+    for (i=0; i<8; i++)
+        if (node->nodes[i] && !octree_node_query_frustum(node->nodes[i], camera, inside, visit, data, visited))
+            return FALSE;
+    return TRUE;
+}
+
+/* Visit every object whose bounds may be in the camera frustum. Returns the
+ * number of objects visited.
+ */
+int octree_query_frustum(Octree *octree, Camera *camera, OctreeVisitFPtr visit, void *data) {
+    int visited = 0;
+    octree_node_query_frustum(octree->root, camera, FALSE, visit, data, &visited);
+    return visited;
+}
+
+static int octree_node_query_ray(OctreeNode *node, Line3D ray, OctreeVisitFPtr visit, void *data, int *visited) {
+    Object3DList *e;
+    Number3D w;
     int i;
+    if (node->object_count == 0)
+        return TRUE;
+    if (node->parent) {
+        float hw = node->half_width*2.0f;
+        Cube3D bounds = { node->center, node->center };
+        subs3d(&bounds.min, hw);
+        adds3d(&bounds.max, hw);
+        if (!isxcube3d(ray, bounds, &w)) return TRUE;
+    }
+    LL_FOREACH(node->objects, e) {
+        (*visited)++;
+        if (!visit(e->object, data)) return FALSE;
+    }
     for (i=0; i<8; i++)
-        if (root->nodes[i]) octree_destroy(root->nodes[i]);
-    free(root);
+        if (node->nodes[i] && !octree_node_query_ray(node->nodes[i], ray, visit, data, visited))
+            return FALSE;
+    return TRUE;
 }
 
+/* Visit every object in nodes the ray (origin p0, direction p1) passes
+ * through. Returns the number of objects visited.
+ */
+int octree_query_ray(Octree *octree, Line3D ray, OctreeVisitFPtr visit, void *data) {
+    int visited = 0;
+    octree_node_query_ray(octree->root, ray, visit, data, &visited);
+    return visited;
+}
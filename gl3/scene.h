@@ -11,9 +11,18 @@
 #include "texture.h"
 #include "objects.h"
 #include "effects.h"
+#include "renderqueue.h"
+#include "scenegraph.h"
+#include "handles.h"
 
 #define GRID_LINES 50
 #define AXIS_LINE_LEN 10.0f
+#define OCTREE_HALF_WIDTH 150.0f
+#define OCTREE_MAX_DEPTH 7
+#define SCENE_BVH_REBUILD 64
+#define SCENE_STATES 3
+#define SCENE_STATE_INDEX 0x3
+#define SCENE_STATE_FRESH 0x4
 
 // Light
 typedef struct _Light {
@@ -32,12 +41,6 @@ typedef struct _Light {
     int enabled;
 } Light;
 
-typedef struct _LightList {
-    Light *light;
-    struct _LightList *next;
-    struct _LightList *prev;
-} LightList;
-
 // Skybox
 typedef struct _Skybox {
     float distance;
@@ -46,20 +49,88 @@ typedef struct _Skybox {
     Object3DList *planes;
 } Skybox;
 
-typedef struct _SkyboxList {
-    Skybox *skybox;
-    struct _SkyboxList *next;
-    struct _SkyboxList *prev;
-} SkyboxList;
-
-// Octree
+// Loose octree - each node's bounds extend to twice its half width so an
+// object is stored at the depth matching its size, in the child holding
+// its center. Children are allocated on demand and freed when emptied.
 typedef struct _OctreeNode {
     Number3D center;
     float half_width;
+    int depth;
+    int object_count;
     Object3DList *objects;
+    struct _OctreeNode *parent;
     struct _OctreeNode *nodes[8];
 } OctreeNode;
 
+typedef struct _Octree {
+    OctreeNode *root;
+    int max_depth;
+    int node_count;
+} Octree;
+
+// return FALSE to stop a query
+typedef int (*OctreeVisitFPtr)(Object3D *object, void *data);
+
+// Per-frame visibility statistics
+typedef struct _CullStats {
+    int tested;
+    int culled;
+    int drawn;
+} CullStats;
+
+// Effect snapshot - offset of the effect's published state in effect_data
+typedef struct _EffectState {
+    Effect *effect;
+    int offset;
+} EffectState;
+
+// Octree node snapshot - its loose bounds, the range of its objects among
+// the published objects and the index of the node past its subtree
+typedef struct _OctreeNodeState {
+    Number3D center;
+    float half_width;
+    int root;
+    int first_object;
+    int object_end;
+    int subtree_end;
+} OctreeNodeState;
+
+// Skybox snapshot - its planes are published with the scene's objects
+typedef struct _SkyboxState {
+    Number3D eye;               // position of the skybox's camera
+    int fixed_proximity;
+    int first_plane;
+    int plane_count;
+} SkyboxState;
+
+// Everything the render thread reads from the update thread, written by
+// scene_publish() and swapped between the threads without locking
+typedef struct _SceneState {
+    unsigned int frame;
+    ObjectState *objects;       // background objects, the scene graph's nodes, static objects, skybox planes
+    int object_count;
+    int background_count;
+    int static_first;           // index of the first static object, past the scene graph
+    int static_count;
+    int drawable_count;         // scene graph nodes with geometry
+    int object_capacity;
+    OctreeNodeState *static_nodes;  // static objects' octree, depth first
+    int static_node_count;
+    int static_node_capacity;
+    CameraState camera;
+    Light *lights;
+    int light_count;
+    int light_capacity;
+    SkyboxState *skyboxes;
+    int skybox_count;
+    int skybox_capacity;
+    EffectState *effects;
+    int effect_count;
+    int effect_capacity;
+    char *effect_data;
+    int effect_data_capacity;
+} SceneState;
+
 #ifdef __APPLE__
 #define Scene _Scene
 #endif
@@ -71,11 +142,11 @@ typedef struct _Scene {
     Number3D grid_floor_points[2][GRID_LINES][2];
     Number3D axis_lines_points[6];
     Camera *camera;
-    LightList *lights;
-    SkyboxList *skyboxes;
-    Object3DList *background_objects;
-    Object3DList *objects;
-    EffectList *effects;
+    HandleArray lights;                 // of Light
+    HandleArray skyboxes;               // of Skybox
+    HandleArray background_objects;     // of Object3D
+    HandleArray objects;                // of Object3D, roots of the scene graph
+    HandleArray effects;                // of Effect
     int show_grid;
     int show_axis;
     int fog_enabled;
@@ -84,7 +155,25 @@ typedef struct _Scene {
     float fog_end;
     Color fog_color;
     float fog_density;
-    OctreeNode *static_objects;
+    int culling_enabled;
+    CullStats cull_stats;
+    int lod_enabled;
+    float lod_pixel_error;      // screen error allowed for a coarser level of detail
+    float lod_hysteresis;       // margin either side of a level switch
+    Octree *static_objects;
+    SceneGraph *graph;          // scene objects and everything attached to them
+    BVH *object_bvh;
+    Object3D **bvh_objects;
+    Cube3D *bvh_bounds;
+    int bvh_object_count;
+    int bvh_dirty;
+    int bvh_refits;
+    SceneState states[SCENE_STATES];
+    int state_back;     // update thread
+    int state_front;    // render thread
+    int state_ready;    // shared, index of the latest published state
+    unsigned int state_frame;
+    RenderQueue *render_queue;
 } Scene;
 
 Scene *scene_create();
@@ -92,27 +181,43 @@ void scene_destroy(Scene *scene);
 void scene_reshape_viewport(Scene *scene, int width, int height);
 void scene_update(Scene *scene);
 void scene_render(Scene *scene);
-void scene_add_object(Scene *scene, Object3D *object);
+void scene_publish(Scene *scene);
+Handle scene_add_object(Scene *scene, Object3D *object);
+Object3D *scene_remove_object_handle(Scene *scene, Handle handle);
 void scene_remove_object(Scene *scene, Object3D *object);
 void scene_clear_objects(Scene *scene);
-void scene_add_background_object(Scene *scene, Object3D *object);
+Handle scene_add_background_object(Scene *scene, Object3D *object);
+Object3D *scene_remove_background_object_handle(Scene *scene, Handle handle);
 void scene_remove_background_object(Scene *scene, Object3D *object);
 void scene_clear_background_objects(Scene *scene);
-void scene_add_light(Scene *scene, Light *light);
+void scene_add_static_object(Scene *scene, Object3D *object);
+void scene_remove_static_object(Scene *scene, Object3D *object);
+void scene_update_static_object(Scene *scene, Object3D *object);
+void scene_clear_static_objects(Scene *scene);
+Handle scene_add_light(Scene *scene, Light *light);
+Light *scene_remove_light_handle(Scene *scene, Handle handle);
 void scene_remove_light(Scene *scene, Light *light);
 void scene_clear_lights(Scene *scene);
-void scene_add_skybox(Scene *scene, Skybox *skybox);
+Handle scene_add_skybox(Scene *scene, Skybox *skybox);
+Skybox *scene_remove_skybox_handle(Scene *scene, Handle handle);
 void scene_remove_skybox(Scene *scene, Skybox *skybox);
 void scene_clear_skyboxes(Scene *scene);
-void scene_add_effect(Scene *scene, Effect *effect);
+Handle scene_add_effect(Scene *scene, Effect *effect);
+Effect *scene_remove_effect_handle(Scene *scene, Handle handle);
 void scene_remove_effect(Scene *scene, Effect *effect);
 void scene_clear_effects(Scene *scene);
 int scene_point_occluded(Scene *scene, Camera *camera, Number3D point);
+Object3D *scene_pick(Scene *scene, Line3D ray, Number3D *where);
 Light *light_create();
 void light_destroy(Light *light);
 Skybox *skybox_create(const char *resources, const char *texture, float distance, Camera *camera);
 void skybox_destroy(Skybox *skybox);
-OctreeNode *octree_build(Number3D center, float radius, int depth, int max_depth);
-void octree_destroy(OctreeNode *root);
+Octree *octree_create(Number3D center, float half_width, int max_depth);
+void octree_destroy(Octree *octree, int destroy_objects);
+void octree_insert(Octree *octree, Object3D *object);
+void octree_remove(Octree *octree, Object3D *object);
+void octree_update(Octree *octree, Object3D *object);
+int octree_query_frustum(Octree *octree, Camera *camera, OctreeVisitFPtr visit, void *data);
+int octree_query_ray(Octree *octree, Line3D ray, OctreeVisitFPtr visit, void *data);
 
 #endif /* SCENE_H_ */
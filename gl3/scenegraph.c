@@ -0,0 +1,134 @@
+/* scenegraph.c - flattened object hierarchies
+ * Depth-first arrays over trees of attached objects, for updating and
+ * culling them in linear passes
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <stdlib.h>
+#include <log/log.h>
+#include "math.h"
+#include "scenegraph.h"
+
+static void scenegraph_flatten(SceneGraph *graph, Object3D *object);
+
+SceneGraph *scenegraph_create() {
+    SceneGraph *graph = calloc(1, sizeof(SceneGraph));
+    graph->dirty = TRUE;
+    return graph;
+}
+
+/* Only the arrays are freed; the objects belong to whoever added them.
+ */
+void scenegraph_destroy(SceneGraph *graph) {
+    if (graph->nodes) free(graph->nodes);
+    if (graph->ends) free(graph->ends);
+    if (graph->bounds) free(graph->bounds);
+    free(graph);
+}
+
+/* Force the next update to flatten the trees again, after the list of
+ * roots has changed. Attaching and detaching objects is noticed without.
+ */
+void scenegraph_invalidate(SceneGraph *graph) {
+    graph->dirty = TRUE;
+}
+
+static void scenegraph_flatten(SceneGraph *graph, Object3D *object) {
+    Object3D *child;
+    int i = graph->node_count++;
+    if (i == graph->capacity) {
+        graph->capacity = graph->capacity ? graph->capacity*2 : 64;
+        graph->nodes = realloc(graph->nodes, sizeof(Object3D*)*graph->capacity);
+        graph->ends = realloc(graph->ends, sizeof(int)*graph->capacity);
+        graph->bounds = realloc(graph->bounds, sizeof(AABB)*graph->capacity);
+    }
+    graph->nodes[i] = object;
+    if (object->vertex_count > 0)
+        graph->drawable_count++;
+    for (child=object->first_child; child; child=child->next_sibling)
+        scenegraph_flatten(graph, child);
+    graph->ends[i] = graph->node_count;
+}
+
+/* Bring the world transforms and bounds of the trees under roots up to
+ * date: one pass down the array rebuilds transforms parents first, one
+ * pass back up gathers each subtree's box from its children's. The trees
+ * are flattened again first if objects were attached or detached since
+ * the last update. Returns TRUE if they were.
+ */
+int scenegraph_update(SceneGraph *graph, Object3D **roots, int root_count) {
+    Number3D center;
+    float radius;
+    int i, j;
+    int flattened = FALSE;
+    unsigned int generation = object3d_hierarchy_generation();
+    if (graph->dirty || graph->hierarchy_generation != generation) {
+        graph->node_count = graph->drawable_count = 0;
+        for (i=0; i<root_count; i++)
+            scenegraph_flatten(graph, roots[i]);
+        graph->hierarchy_generation = generation;
+        graph->dirty = FALSE;
+        flattened = TRUE;
+    }
+    for (i=0; i<graph->node_count; i++)
+        object3d_refresh_transform(graph->nodes[i]);
+    for (i=graph->node_count-1; i>=0; i--) {
+        AABB *box = &graph->bounds[i];
+        object3d_world_bounds(graph->nodes[i], &center, &radius, box);
+        for (j=i+1; j<graph->ends[i]; j=graph->ends[j]) {
+            const AABB *b = &graph->bounds[j];
+            if (b->min.x < box->min.x) box->min.x = b->min.x;
+            if (b->min.y < box->min.y) box->min.y = b->min.y;
+            if (b->min.z < box->min.z) box->min.z = b->min.z;
+            if (b->max.x > box->max.x) box->max.x = b->max.x;
+            if (b->max.y > box->max.y) box->max.y = b->max.y;
+            if (b->max.z > box->max.z) box->max.z = b->max.z;
+        }
+    }
+    return flattened;
+}
+
+/* Visit the visible objects with geometry whose subtrees' boxes reach
+ * into the camera frustum, or all of them given no camera. Hidden objects
+ * hide their subtrees. Returns the number of objects visited.
+ */
+int scenegraph_query_frustum(const SceneGraph *graph, Camera *camera, SceneGraphVisitFPtr visit, void *data) {
+    int visited = 0;
+    int i = 0;
+    while (i < graph->node_count) {
+        Object3D *object = graph->nodes[i];
+        if (!OBJ3D_STATE(object, visible) || (camera && !camera_box_in_frustum(camera, graph->bounds[i]))) {
+            i = graph->ends[i];
+            continue;
+        }
+        if (object->vertex_count > 0) {
+            visited++;
+            if (!visit(object, data)) break;
+        }
+        i++;
+    }
+    return visited;
+}
+
+/* Visit the objects with geometry whose subtrees' boxes the ray (origin
+ * p0, direction p1) passes through. Returns the number of objects
+ * visited.
+ */
+int scenegraph_query_ray(const SceneGraph *graph, Line3D ray, SceneGraphVisitFPtr visit, void *data) {
+    Number3D w;
+    int visited = 0;
+    int i = 0;
+    while (i < graph->node_count) {
+        Object3D *object = graph->nodes[i];
+        if (!isxcube3d(ray, graph->bounds[i], &w)) {
+            i = graph->ends[i];
+            continue;
+        }
+        if (object->vertex_count > 0) {
+            visited++;
+            if (!visit(object, data)) break;
+        }
+        i++;
+    }
+    return visited;
+}
@@ -0,0 +1,38 @@
+/* scenegraph.h - flattened object hierarchies
+ * Depth-first arrays over trees of attached objects, for updating and
+ * culling them in linear passes
+ * Copyright 2012 Keath Milligan
+ */
+
+#ifndef SCENEGRAPH_H_
+#define SCENEGRAPH_H_
+
+#include "types.h"
+#include "camera.h"
+#include "objects.h"
+
+// Each node is followed by its subtree, which ends before ends[i], so a
+// culled subtree is skipped by jumping to its end. Parents always come
+// before their children.
+typedef struct _SceneGraph {
+    Object3D **nodes;
+    int *ends;
+    AABB *bounds;           // world box around each node's subtree
+    int node_count;
+    int drawable_count;     // nodes with geometry of their own
+    int capacity;
+    int dirty;
+    unsigned int hierarchy_generation;
+} SceneGraph;
+
+// return FALSE to stop a query
+typedef int (*SceneGraphVisitFPtr)(Object3D *object, void *data);
+
+SceneGraph *scenegraph_create();
+void scenegraph_destroy(SceneGraph *graph);
+void scenegraph_invalidate(SceneGraph *graph);
+int scenegraph_update(SceneGraph *graph, Object3D **roots, int root_count);
+int scenegraph_query_frustum(const SceneGraph *graph, Camera *camera, SceneGraphVisitFPtr visit, void *data);
+int scenegraph_query_ray(const SceneGraph *graph, Line3D ray, SceneGraphVisitFPtr visit, void *data);
+
+#endif /* SCENEGRAPH_H_ */
@@ -0,0 +1,234 @@
+/* simplify.c - mesh simplification
+ * Quadric error metric edge collapse for building levels of detail
+ * Copyright 2012 Keath Milligan
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <log/log.h>
+#include "simplify.h"
+#include "math.h"
+
+// Sum of squared distances to a set of planes, weighted by face area.
+// Stored as the upper half of the symmetric 4x4 matrix plus the weight.
+typedef struct _Quadric {
+    double a2, ab, ac, ad;
+    double b2, bc, bd;
+    double c2, cd;
+    double d2;
+    double w;
+} Quadric;
+
+// A candidate collapse of vertex u onto vertex v
+typedef struct _Collapse {
+    int u;
+    int v;
+    double cost;
+} Collapse;
+
+static void quadric_add_plane(Quadric *q, Number3D n, double d, double w) {
+    q->a2 += w*n.x*n.x; q->ab += w*n.x*n.y; q->ac += w*n.x*n.z; q->ad += w*n.x*d;
+    q->b2 += w*n.y*n.y; q->bc += w*n.y*n.z; q->bd += w*n.y*d;
+    q->c2 += w*n.z*n.z; q->cd += w*n.z*d;
+    q->d2 += w*d*d;
+    q->w += w;
+}
+
+static void quadric_add(Quadric *q, const Quadric *o) {
+    q->a2 += o->a2; q->ab += o->ab; q->ac += o->ac; q->ad += o->ad;
+    q->b2 += o->b2; q->bc += o->bc; q->bd += o->bd;
+    q->c2 += o->c2; q->cd += o->cd;
+    q->d2 += o->d2;
+    q->w += o->w;
+}
+
+/* Mean squared distance from p to the planes of q and r together.
+ */
+static double quadric_error(const Quadric *q, const Quadric *r, Number3D p) {
+    double x = p.x, y = p.y, z = p.z;
+    double w = q->w+r->w;
+    double e = (q->a2+r->a2)*x*x+2.0*(q->ab+r->ab)*x*y+2.0*(q->ac+r->ac)*x*z+2.0*(q->ad+r->ad)*x+
+               (q->b2+r->b2)*y*y+2.0*(q->bc+r->bc)*y*z+2.0*(q->bd+r->bd)*y+
+               (q->c2+r->c2)*z*z+2.0*(q->cd+r->cd)*z+
+               (q->d2+r->d2);
+    if (e < 0.0) e = 0.0;
+    return w > 0.0 ? e/w : e;
+}
+
+static Number3D face_normal(Number3D a, Number3D b, Number3D c) {
+    return cross3d(vec3d(a, b), vec3d(a, c));
+}
+
+static int collapse_compare(const void *a, const void *b) {
+    double ca = ((const Collapse*)a)->cost, cb = ((const Collapse*)b)->cost;
+    return ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+/* Triangles around each vertex: offsets[v] to offsets[v+1] in adjacency.
+ */
+static void build_adjacency(const Face *faces, int face_count, int vertex_count, int *offsets, int *adjacency) {
+    int i;
+    memset(offsets, 0, sizeof(int)*(vertex_count+1));
+    for (i=0; i<face_count; i++) {
+        offsets[faces[i].a+1]++;
+        offsets[faces[i].b+1]++;
+        offsets[faces[i].c+1]++;
+    }
+    for (i=0; i<vertex_count; i++)
+        offsets[i+1] += offsets[i];
+    int *fill = malloc(sizeof(int)*vertex_count);
+    memcpy(fill, offsets, sizeof(int)*vertex_count);
+    for (i=0; i<face_count; i++) {
+        adjacency[fill[faces[i].a]++] = i;
+        adjacency[fill[faces[i].b]++] = i;
+        adjacency[fill[faces[i].c]++] = i;
+    }
+    free(fill);
+}
+
+/* Whether some triangle around v has the directed edge v->u, which makes
+ * u->v an interior edge.
+ */
+static int has_edge(const Face *faces, const int *offsets, const int *adjacency, unsigned int v, unsigned int u) {
+    int i;
+    for (i=offsets[v]; i<offsets[v+1]; i++) {
+        const Face *f = &faces[adjacency[i]];
+        if ((f->a == v && f->b == u) || (f->b == v && f->c == u) || (f->c == v && f->a == u))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Whether moving u onto v leaves every surviving triangle around u facing
+ * the way it did.
+ */
+static int collapse_keeps_orientation(const Number3D *vertices, const Face *faces,
+                                      const int *offsets, const int *adjacency, unsigned int u, unsigned int v) {
+    int i;
+    for (i=offsets[u]; i<offsets[u+1]; i++) {
+        Face f = faces[adjacency[i]];
+        if (f.a == v || f.b == v || f.c == v)
+            continue;
+        Number3D before = face_normal(vertices[f.a], vertices[f.b], vertices[f.c]);
+        if (f.a == u) f.a = v;
+        if (f.b == u) f.b = v;
+        if (f.c == u) f.c = v;
+        Number3D after = face_normal(vertices[f.a], vertices[f.b], vertices[f.c]);
+        if (dot3d(before, after) <= 0.0f)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Reduce an indexed triangle list towards target_face_count triangles by
+ * collapsing edges onto one of their own vertices, cheapest first by the
+ * quadric error metric, so the result indexes the same vertex list and can
+ * share its buffers. Collapses that would move a point further than
+ * target_error from the original surface, or flip a triangle, are not made.
+ * Vertices on open edges stay put, which keeps outlines and the seams where
+ * 3ds files repeat vertices for texture coordinates intact.
+ * result must have room for face_count faces; returns the number written
+ * and sets result_error, if given, to the largest error allowed.
+ */
+int simplify_faces(const Number3D *vertices, int vertex_count, const Face *faces, int face_count,
+                   int target_face_count, float target_error, Face *result, float *result_error) {
+    Quadric *quadrics = calloc(vertex_count, sizeof(Quadric));
+    char *locked = calloc(vertex_count, 1);
+    char *touched = malloc(vertex_count);
+    int *remap = malloc(sizeof(int)*vertex_count);
+    int *offsets = malloc(sizeof(int)*(vertex_count+1));
+    int *adjacency = malloc(sizeof(int)*face_count*3);
+    Collapse *collapses = malloc(sizeof(Collapse)*face_count*3);
+    double limit = (double)target_error*target_error;
+    double max_error = 0.0;
+    int count = face_count;
+    int i, j;
+
+    memcpy(result, faces, sizeof(Face)*face_count);
+    for (i=0; i<face_count; i++) {
+        Number3D a = vertices[faces[i].a], b = vertices[faces[i].b], c = vertices[faces[i].c];
+        Number3D n = face_normal(a, b, c);
+        float area = len3d(n);
+        if (area == 0.0f)
+            continue;
+        muls3d(&n, 1.0f/area);
+        quadric_add_plane(&quadrics[faces[i].a], n, -dot3d(n, a), area);
+        quadric_add_plane(&quadrics[faces[i].b], n, -dot3d(n, a), area);
+        quadric_add_plane(&quadrics[faces[i].c], n, -dot3d(n, a), area);
+    }
+    build_adjacency(result, count, vertex_count, offsets, adjacency);
+    for (i=0; i<count; i++) {
+        unsigned int v[3] = { result[i].a, result[i].b, result[i].c };
+        for (j=0; j<3; j++) {
+            if (!has_edge(result, offsets, adjacency, v[(j+1)%3], v[j])) {
+                locked[v[j]] = TRUE;
+                locked[v[(j+1)%3]] = TRUE;
+            }
+        }
+    }
+
+    // each pass collapses the cheapest edges that do not touch one another,
+    // then rebuilds the triangle list
+    while (count > target_face_count) {
+        int candidates = 0, removed = 0, collapsed = 0;
+        build_adjacency(result, count, vertex_count, offsets, adjacency);
+        for (i=0; i<count; i++) {
+            unsigned int v[3] = { result[i].a, result[i].b, result[i].c };
+            for (j=0; j<3; j++) {
+                unsigned int u = v[j], w = v[(j+1)%3];
+                if (locked[u])
+                    continue;
+                collapses[candidates].u = u;
+                collapses[candidates].v = w;
+                collapses[candidates].cost = quadric_error(&quadrics[u], &quadrics[w], vertices[w]);
+                candidates++;
+            }
+        }
+        if (candidates == 0)
+            break;
+        qsort(collapses, candidates, sizeof(Collapse), collapse_compare);
+        memset(touched, 0, vertex_count);
+        for (i=0; i<vertex_count; i++)
+            remap[i] = i;
+        for (i=0; i<candidates && count-removed > target_face_count; i++) {
+            const Collapse *c = &collapses[i];
+            if (c->cost > limit)
+                break;
+            if (touched[c->u] || touched[c->v])
+                continue;
+            if (!collapse_keeps_orientation(vertices, result, offsets, adjacency, c->u, c->v))
+                continue;
+            for (j=offsets[c->u]; j<offsets[c->u+1]; j++) {
+                const Face *f = &result[adjacency[j]];
+                touched[f->a] = touched[f->b] = touched[f->c] = TRUE;
+                if (f->a == (unsigned int)c->v || f->b == (unsigned int)c->v || f->c == (unsigned int)c->v)
+                    removed++;
+            }
+            remap[c->u] = c->v;
+            quadric_add(&quadrics[c->v], &quadrics[c->u]);
+            if (c->cost > max_error)
+                max_error = c->cost;
+            collapsed++;
+        }
+        if (collapsed == 0)
+            break;
+        int kept = 0;
+        for (i=0; i<count; i++) {
+            Face f = { remap[result[i].a], remap[result[i].b], remap[result[i].c] };
+            if (f.a != f.b && f.b != f.c && f.c != f.a)
+                result[kept++] = f;
+        }
+        count = kept;
+    }
+
+    if (result_error)
+        *result_error = (float)sqrt(max_error);
+    free(quadrics);
+    free(locked);
+    free(touched);
+    free(remap);
+    free(offsets);
+    free(adjacency);
+    free(collapses);
+    return count;
+}
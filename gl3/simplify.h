@@ -0,0 +1,15 @@
+/* simplify.h - mesh simplification
+ * Quadric error metric edge collapse for building levels of detail
+ * Copyright 2012 Keath Milligan
+ */
+
+#ifndef SIMPLIFY_H_
+#define SIMPLIFY_H_
+
+#include "types.h"
+#include "texture.h"
+
+int simplify_faces(const Number3D *vertices, int vertex_count, const Face *faces, int face_count,
+                   int target_face_count, float target_error, Face *result, float *result_error);
+
+#endif /* SIMPLIFY_H_ */
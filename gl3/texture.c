@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <soil/SOIL.h>
 #include "texture.h"
+#include "glstate.h"
 #include <log/log.h>
 
 Texture *texture_create(const char *resources, const char *name, int generate_mipmap, int flip_y) {
@@ -39,33 +40,44 @@ int texture_init(Texture *texture, const char *resources, const char *name, int
         return FALSE;
     }
     LOG("texture id %d loaded\n", texture->id);
+    // sampler state lives with the texture object, so set it once here
+    glBindTexture(GL_TEXTURE_2D, texture->id);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, texture->has_MIP_map? GL_LINEAR_MIPMAP_NEAREST : GL_NEAREST);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    texture_set_wrap(texture, texture->repeat_U, texture->repeat_V);
+    glstate_reset();
     return TRUE;
 }
 
+/* Wrap modes are sampler state too; change them through here rather than
+ * on the fields.
+ */
+void texture_set_wrap(Texture *texture, int repeat_U, int repeat_V) {
+    texture->repeat_U = repeat_U;
+    texture->repeat_V = repeat_V;
+    glstate_bind_texture(texture->id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, repeat_U? GL_REPEAT : GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, repeat_V? GL_REPEAT : GL_CLAMP_TO_EDGE);
+}
+
 void texture_destroy(Texture *texture) {
+    glstate_forget_texture(texture->id);
     glDeleteTextures(1, (GLuint*)&texture->id);
     free(texture->name);
     free(texture);
 }
 
 void texture_activate(Texture *texture) {
-    glBindTexture(GL_TEXTURE_2D, texture->id);
-    glEnable(GL_TEXTURE_2D);
-    int minFilter = texture->has_MIP_map? GL_LINEAR_MIPMAP_NEAREST : GL_NEAREST;
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilter);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, texture->repeat_U? GL_REPEAT : GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, texture->repeat_V? GL_REPEAT : GL_CLAMP_TO_EDGE);
-    if (texture->offset_U != 0 || texture->offset_V != 0) {
-        glMatrixMode(GL_TEXTURE);
-        glLoadIdentity();
-        glTranslatef(texture->offset_U, texture->offset_V, 0);
-        glMatrixMode(GL_MODELVIEW);
-    }
+    glstate_bind_texture(texture->id);
+    glstate_enable(GL_TEXTURE_2D);
+    glstate_tex_env_mode(GL_MODULATE);
+    glstate_texture_offset(texture->offset_U, texture->offset_V);
 }
 
+/* Texturing is switched off but the binding is left alone, so drawing the
+ * same texture again does not rebind it.
+ */
 void texture_deactivate(Texture *texture) {
-    glBindTexture(GL_TEXTURE_2D, 0);
+    glstate_disable(GL_TEXTURE_2D);
 }
 
@@ -13,9 +13,14 @@ typedef struct _UV {
 } UV;
 
 typedef struct _Face {
-    short a, b, c;
+    unsigned int a, b, c;
 } Face;
 
+// Face as drawn with GL_UNSIGNED_SHORT indices
+typedef struct _Face16 {
+    unsigned short a, b, c;
+} Face16;
+
 typedef struct _Texture {
     int id;
     char *name;
@@ -35,6 +40,7 @@ typedef struct _TextureList {
 Texture *texture_create(const char *resources, const char *name, int generate_mipmap, int flip_y);
 int texture_init(Texture *texture, const char *resources, const char *name, int generate_mipmap, int flip_y);
 void texture_destroy(Texture *texture);
+void texture_set_wrap(Texture *texture, int repeat_U, int repeat_V);
 void texture_activate(Texture *texture);
 void texture_deactivate(Texture *texture);
 
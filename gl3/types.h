@@ -19,6 +19,11 @@
 #define FALSE 0
 #endif
 
+// 4x4 matrix aligned for the SIMD math kernels, which keeps each row in
+// one cache line. The kernels accept unaligned matrices too.
+#define ALIGN16 __attribute__((aligned(16)))
+#define ALIGNED_MATRIX(name) float name[16] ALIGN16
+
 #define COLOR(r, g, b, a) ((Color){a, r, g, b})
 #define COLORF(r, g, b, a) ((Color){ (unsigned char)(a*255.0f), \
                                      (unsigned char)(r*255.0f), \
@@ -17,10 +17,4 @@ GLint gluUnProjectf(GLfloat winx, GLfloat winy, GLfloat winz,
                     const GLint viewport[4],
                     GLfloat *objx, GLfloat *objy, GLfloat *objz);
 
-#if SG3_OPENGLES
-void gluLookAt(GLfloat eyex, GLfloat eyey, GLfloat eyez,
-               GLfloat centerx, GLfloat centery, GLfloat centerz,
-               GLfloat upx, GLfloat upy, GLfloat upz);
-#endif
-
 #endif /* UTIL_H_ */
@@ -3,17 +3,92 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <log/log.h>
 
-void _log_func(void (*output_func)(const char *msg),
-               const char *file,
-               const char *function,
-               int line,
-               const char *fmt, ...) {
-    char buf[256];
-    int len;
+#define LOG_WRITER_SLEEP 1000   // microseconds to wait when the ring is empty
+
+#define LOG_SPEC_SIZE 32         // longest conversion spec kept deferred
+
+// A line waiting for the writer. Its sequence is the ring position it may
+// next be claimed at, or that position+1 once it is filled in. Deferred
+// records hold fmt's arguments in text, packed by log_pack, and are
+// formatted by the writer; fmt, file and function must be static strings,
+// as __FILE__ and literal formats are.
+typedef struct _LogRecord {
+    volatile unsigned long sequence;
+    void (*output_func)(const char *msg);
+    double time;
+    int thread;
+    const char *fmt;        // NULL if text is already formatted
+    const char *file;
+    const char *function;
+    int line;
+    char text[LOG_LINE_SIZE];
+} LogRecord;
+
+typedef enum _LogArgType {
+    LOG_ARG_NONE,
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LDOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STRING,
+    LOG_ARG_UNSUPPORTED
+} LogArgType;
+
+volatile int _log_level = LOG_LEVEL_INFO;
+
+static LogRecord ring[LOG_RING_SIZE];
+static volatile unsigned long ring_head = 0;    // next position to claim
+static unsigned long ring_tail = 0;             // next position to write, writer only
+static volatile unsigned long drops = 0;
+static volatile int async = 0;
+static volatile int running = 0;
+static volatile int stopping = 0;               // log_stop is draining the ring
+static volatile int producers = 0;              // callers between checking async and publishing
+static pthread_t writer;
+static struct timeval start_time;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static volatile int thread_count = 0;
+static __thread int thread_id = 0;
+
+void log_set_level(int level) {
+    _log_level = level;
+}
+
+static void log_start_clock() {
+    gettimeofday(&start_time, NULL);
+}
+
+/* Seconds since the first line was logged, by any thread.
+ */
+static double log_time() {
+    struct timeval tv;
+    pthread_once(&start_once, log_start_clock);
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec-start_time.tv_sec)+(tv.tv_usec-start_time.tv_usec)/1000000.0;
+}
+
+static int log_thread() {
+    if (thread_id == 0)
+        thread_id = __sync_add_and_fetch(&thread_count, 1);
+    return thread_id;
+}
+
+static const char *log_basename(const char *file) {
 #ifdef WIN32
     const char *p = strrchr(file, '\\');
 #else
@@ -23,16 +98,363 @@ void _log_func(void (*output_func)(const char *msg),
         p++;
     if (p == NULL || *p == '\0')
         p = file;
+    return p;
+}
+
+static void log_terminate(char *buf) {
+    if (buf[strlen(buf)-1] != '\n')
+        buf[strlen(buf)-1] = '\n';
+}
+
+/* Format the file, function and line prefix and the message into buf.
+ * Returns 0 if the prefix alone doesn't fit.
+ */
+static int log_format(char *buf, size_t size, const char *file, const char *function, int line,
+                      const char *fmt, va_list a) {
+    int len = snprintf(buf, size, "%s:%s:%d: ", log_basename(file), function, line);
+    if (len < 0 || (size_t)len >= size)
+        return 0;
+    vsnprintf(buf+len, size-len, fmt, a);
+    log_terminate(buf);
+    return 1;
+}
+
+/* The next conversion in fmt, or NULL if there are none left. Sets type
+ * to the type of argument it takes and len to its length.
+ */
+static const char *log_spec(const char *fmt, LogArgType *type, int *len) {
+    const char *spec = strchr(fmt, '%'), *p;
+    int longs = 0;
+    char size = 0;
+    if (spec == NULL)
+        return NULL;
+    p = spec+1;
+    p += strspn(p, "-+ #0'123456789.");
+    for (; *p && strchr("hlLqjzt", *p); p++) {
+        if (*p == 'l')
+            longs++;
+        else if (*p != 'h')
+            size = *p;
+    }
+    if (longs == 2 || size == 'q')
+        size = 'q';
+    else if (longs == 1)
+        size = 'l';
+    if (*p == '\0') {
+        *type = LOG_ARG_UNSUPPORTED;
+        *len = p-spec;
+        return spec;
+    }
+    switch (*p) {
+    case '%':
+        *type = LOG_ARG_NONE;
+        break;
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+        *type = size == 'l' ? LOG_ARG_LONG : size == 'q' ? LOG_ARG_LLONG : size == 'z' ? LOG_ARG_SIZE :
+                size == 'j' ? LOG_ARG_INTMAX : size == 't' ? LOG_ARG_PTRDIFF : LOG_ARG_INT;
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        *type = size == 'L' ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        *type = size ? LOG_ARG_UNSUPPORTED : LOG_ARG_STRING;
+        break;
+    case 'p':
+        *type = LOG_ARG_PTR;
+        break;
+    default:
+        // %n, %m, '*' widths...
+        *type = LOG_ARG_UNSUPPORTED;
+        break;
+    }
+    *len = p+1-spec;
+    if (*len >= LOG_SPEC_SIZE)
+        *type = LOG_ARG_UNSUPPORTED;
+    return spec;
+}
+
+#define LOG_PACK(args, size, used, type, value) do { \
+        type v = (value); \
+        if ((used)+sizeof(type) > (size)) return 0; \
+        memcpy((args)+(used), &v, sizeof(type)); \
+        (used) += sizeof(type); \
+    } while (0)
+
+#define LOG_UNPACK(buf, size, spec, args, type) do { \
+        type v; \
+        memcpy(&v, args, sizeof(type)); \
+        args += sizeof(type); \
+        n = snprintf(buf, size, spec, v); \
+    } while (0)
+
+/* Copy the arguments fmt takes into args, strings included. Returns 0 if
+ * they don't fit or fmt has conversions that can't be deferred.
+ */
+static int log_pack(char *args, size_t size, const char *fmt, va_list a) {
+    const char *spec, *s;
+    LogArgType type;
+    size_t used = 0, n;
+    int len;
+    for (; (spec = log_spec(fmt, &type, &len)) != NULL; fmt = spec+len) {
+        switch (type) {
+        case LOG_ARG_NONE: break;
+        case LOG_ARG_INT: LOG_PACK(args, size, used, int, va_arg(a, int)); break;
+        case LOG_ARG_LONG: LOG_PACK(args, size, used, long, va_arg(a, long)); break;
+        case LOG_ARG_LLONG: LOG_PACK(args, size, used, long long, va_arg(a, long long)); break;
+        case LOG_ARG_SIZE: LOG_PACK(args, size, used, size_t, va_arg(a, size_t)); break;
+        case LOG_ARG_INTMAX: LOG_PACK(args, size, used, intmax_t, va_arg(a, intmax_t)); break;
+        case LOG_ARG_PTRDIFF: LOG_PACK(args, size, used, ptrdiff_t, va_arg(a, ptrdiff_t)); break;
+        case LOG_ARG_DOUBLE: LOG_PACK(args, size, used, double, va_arg(a, double)); break;
+        case LOG_ARG_LDOUBLE: LOG_PACK(args, size, used, long double, va_arg(a, long double)); break;
+        case LOG_ARG_PTR: LOG_PACK(args, size, used, void*, va_arg(a, void*)); break;
+        case LOG_ARG_STRING:
+            s = va_arg(a, const char*);
+            if (s == NULL)
+                s = "(null)";
+            n = strlen(s)+1;
+            if (used+n > size)
+                return 0;
+            memcpy(args+used, s, n);
+            used += n;
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Format a deferred record's line into buf from its packed arguments.
+ */
+static void log_unpack(char *buf, size_t size, const LogRecord *record) {
+    const char *fmt = record->fmt, *args = record->text, *spec;
+    char spec_buf[LOG_SPEC_SIZE];
+    LogArgType type;
+    size_t out;
+    int len, n;
+    n = snprintf(buf, size, "%s:%s:%d: ", log_basename(record->file), record->function, record->line);
+    out = n < 0 ? 0 : (size_t)n < size ? n : size-1;
+    for (; (spec = log_spec(fmt, &type, &len)) != NULL && out < size-1; fmt = spec+len) {
+        n = spec-fmt < size-1-out ? spec-fmt : size-1-out;
+        memcpy(buf+out, fmt, n);
+        out += n;
+        memcpy(spec_buf, spec, len);
+        spec_buf[len] = '\0';
+        switch (type) {
+        case LOG_ARG_INT: LOG_UNPACK(buf+out, size-out, spec_buf, args, int); break;
+        case LOG_ARG_LONG: LOG_UNPACK(buf+out, size-out, spec_buf, args, long); break;
+        case LOG_ARG_LLONG: LOG_UNPACK(buf+out, size-out, spec_buf, args, long long); break;
+        case LOG_ARG_SIZE: LOG_UNPACK(buf+out, size-out, spec_buf, args, size_t); break;
+        case LOG_ARG_INTMAX: LOG_UNPACK(buf+out, size-out, spec_buf, args, intmax_t); break;
+        case LOG_ARG_PTRDIFF: LOG_UNPACK(buf+out, size-out, spec_buf, args, ptrdiff_t); break;
+        case LOG_ARG_DOUBLE: LOG_UNPACK(buf+out, size-out, spec_buf, args, double); break;
+        case LOG_ARG_LDOUBLE: LOG_UNPACK(buf+out, size-out, spec_buf, args, long double); break;
+        case LOG_ARG_PTR: LOG_UNPACK(buf+out, size-out, spec_buf, args, void*); break;
+        case LOG_ARG_STRING:
+            n = snprintf(buf+out, size-out, spec_buf, args);
+            args += strlen(args)+1;
+            break;
+        default:
+            n = snprintf(buf+out, size-out, "%%");
+            break;
+        }
+        if (n > 0)
+            out = (size_t)n < size-out ? out+n : size-1;
+    }
+    if (spec == NULL) {
+        n = strlen(fmt) < size-1-out ? strlen(fmt) : size-1-out;
+        memcpy(buf+out, fmt, n);
+        out += n;
+    }
+    buf[out] = '\0';
+    log_terminate(buf);
+}
+
+static void log_output(void (*output_func)(const char *msg), double time, int thread, const char *text) {
+    char buf[LOG_LINE_SIZE+32];
+    snprintf(buf, sizeof(buf), "[%.6f t%d] %s", time, thread, text);
+    output_func(buf);
+}
+
+/* Claim the next free record, or NULL if the ring is full.
+ */
+static LogRecord *ring_claim(unsigned long *position) {
+    unsigned long pos = ring_head;
+    LogRecord *record;
+    long diff;
+    for (;;) {
+        record = &ring[pos&(LOG_RING_SIZE-1)];
+        diff = (long)(record->sequence-pos);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&ring_head, pos, pos+1))
+                break;
+            pos = ring_head;
+        } else if (diff < 0) {
+            __sync_fetch_and_add(&drops, 1);
+            return NULL;
+        } else {
+            pos = ring_head;
+        }
+    }
+    __sync_synchronize();
+    *position = pos;
+    return record;
+}
+
+/* Write out every filled record, in order. Returns how many there were.
+ */
+static int ring_drain() {
+    int count = 0;
+    for (;;) {
+        LogRecord *record = &ring[ring_tail&(LOG_RING_SIZE-1)];
+        if (record->sequence != ring_tail+1)
+            return count;
+        __sync_synchronize();
+        if (record->fmt != NULL) {
+            char buf[LOG_LINE_SIZE];
+            log_unpack(buf, sizeof(buf), record);
+            log_output(record->output_func, record->time, record->thread, buf);
+        } else {
+            log_output(record->output_func, record->time, record->thread, record->text);
+        }
+        __sync_synchronize();
+        record->sequence = ring_tail+LOG_RING_SIZE;
+        ring_tail++;
+        count++;
+    }
+}
+
+static void *log_writer(void *data) {
+    unsigned long reported = 0;
+    while (running) {
+        if (ring_drain() == 0)
+            usleep(LOG_WRITER_SLEEP);
+        if (drops != reported) {
+            // written directly: the writer mustn't wait on its own ring
+            char text[64];
+            reported = drops;
+            snprintf(text, sizeof(text), "%lu log records dropped\n", reported);
+            log_output(_log_err_output, log_time(), log_thread(), text);
+        }
+    }
+    ring_drain();
+    return NULL;
+}
+
+static void log_queue(void (*output_func)(const char *msg), const char *file, const char *function,
+                      int line, const char *fmt, va_list a) {
+    unsigned long pos;
+    LogRecord *record = ring_claim(&pos);
+    if (record == NULL)
+        return;
+    record->output_func = output_func;
+    record->time = log_time();
+    record->thread = log_thread();
+    record->fmt = NULL;
+#if SG3_LOG_DEFERRED
+    {
+        va_list b;
+        va_copy(b, a);
+        if (log_pack(record->text, sizeof(record->text), fmt, b)) {
+            record->fmt = fmt;
+            record->file = file;
+            record->function = function;
+            record->line = line;
+        }
+        va_end(b);
+    }
+#endif
+    if (record->fmt == NULL && !log_format(record->text, sizeof(record->text), file, function, line, fmt, a)) {
+        record->output_func = _log_err_output;
+        strcpy(record->text, "log line too long\n");
+    }
+    __sync_synchronize();
+    record->sequence = pos+1;
+}
+
+void _log_func(void (*output_func)(const char *msg),
+               const char *file,
+               const char *function,
+               int line,
+               const char *fmt, ...) {
     va_list a;
     va_start(a, fmt);
-    len = snprintf(buf, sizeof(buf), "%s:%s:%d: ", p, function, line);
-    if (len >= sizeof(buf)) {
-        _log_err_output("log line too long\n");
-    } else {
-        len = vsnprintf(buf+strlen(buf), sizeof(buf)-strlen(buf), fmt, a);
-        if (buf[strlen(buf)-1] != '\n')
-            buf[strlen(buf)-1] = '\n';
-        output_func(buf);
+    if (async) {
+        // counted before async is checked again, so log_stop either sees
+        // this caller or this caller sees async cleared
+        __sync_fetch_and_add(&producers, 1);
+        if (async) {
+            log_queue(output_func, file, function, line, fmt, a);
+            __sync_fetch_and_sub(&producers, 1);
+            va_end(a);
+            return;
+        }
+        __sync_fetch_and_sub(&producers, 1);
+    }
+    // the writer is still the only caller of the output functions until
+    // log_stop has drained the ring
+    while (stopping)
+        usleep(LOG_WRITER_SLEEP/10);
+    {
+        char buf[LOG_LINE_SIZE];
+        if (!log_format(buf, sizeof(buf), file, function, line, fmt, a))
+            _log_err_output("log line too long\n");
+        else
+            log_output(output_func, log_time(), log_thread(), buf);
     }
     va_end(a);
 }
+
+/* Hand log lines to a writer thread from now on, so the output functions
+ * are only ever called from there. Lines are dropped, and counted, while
+ * the ring is full. Anything queued is written at exit.
+ * Returns 0 if the thread can't be started.
+ */
+int log_start() {
+    static int registered = 0;
+    int i;
+    if (running)
+        return 1;
+    for (i=0; i<LOG_RING_SIZE; i++)
+        ring[(ring_head+i)&(LOG_RING_SIZE-1)].sequence = ring_head+i;
+    ring_tail = ring_head;
+    running = 1;
+    if (pthread_create(&writer, NULL, log_writer, NULL) != 0) {
+        running = 0;
+        LOGERR("failed to start log writer\n");
+        return 0;
+    }
+    if (!registered) {
+        registered = 1;
+        atexit(log_stop);
+    }
+    async = 1;
+    return 1;
+}
+
+/* Write out whatever is queued and go back to logging synchronously.
+ * Claims stop first; callers already queueing are waited for, so every
+ * claimed record is published and written before the ring can be
+ * seeded again by log_start.
+ */
+void log_stop() {
+    if (!running)
+        return;
+    stopping = 1;
+    __sync_synchronize();
+    async = 0;
+    __sync_synchronize();
+    while (producers > 0)
+        usleep(LOG_WRITER_SLEEP/10);
+    running = 0;
+    pthread_join(writer, NULL);
+    ring_drain();
+    __sync_synchronize();
+    stopping = 0;
+}
+
+/* Lines lost to a full ring since the start.
+ */
+unsigned long log_dropped() {
+    return drops;
+}
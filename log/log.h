@@ -5,14 +5,56 @@
 #ifndef LOG_H_
 #define LOG_H_
 
-#define LOG(...) _log_func(_log_std_output, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__)
-#define LOGERR(...) _log_func(_log_err_output, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__)
-#define LOGX(file, function, line, ...) _log_func(_log_std_output, file, function, line, __VA_ARGS__)
-#define LOGERRX(file, function, line, ...) _log_func(_log_err_output, file, function, line, __VA_ARGS__)
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// Calls above SG3_LOG_LEVEL are compiled out, arguments and all (make
+// SG3_LOG_LEVEL=1 keeps only errors); those above the level set with
+// log_set_level cost one branch
+#ifndef SG3_LOG_LEVEL
+#define SG3_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// With the writer running, lines are queued as their format and packed
+// arguments and formatted on the writer thread. Formats it can't pack
+// are formatted by the caller as before.
+#ifndef SG3_LOG_DEFERRED
+#define SG3_LOG_DEFERRED 1
+#endif
+
+#define LOG_RING_SIZE 1024      // records, a power of 2
+#define LOG_LINE_SIZE 256
+
+#define LOG_ENABLED(level) ((level) <= SG3_LOG_LEVEL && (level) <= _log_level)
+#define LOG_AT(level, output, file, function, line, ...) \
+    (LOG_ENABLED(level) ? _log_func(output, file, function, line, __VA_ARGS__) : (void)0)
+
+#define LOG(...) LOG_AT(LOG_LEVEL_INFO, _log_std_output, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__)
+#define LOGERR(...) LOG_AT(LOG_LEVEL_ERROR, _log_err_output, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__)
+#define LOGDEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, _log_std_output, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__)
+#define LOGX(file, function, line, ...) LOG_AT(LOG_LEVEL_INFO, _log_std_output, file, function, line, __VA_ARGS__)
+#define LOGERRX(file, function, line, ...) LOG_AT(LOG_LEVEL_ERROR, _log_err_output, file, function, line, __VA_ARGS__)
+
+// Deferred lines are unpacked by the types their conversions name, so let
+// the compiler check the arguments against the format
+#ifdef __GNUC__
+#define LOG_FORMAT(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+#define LOG_FORMAT(fmt, args)
+#endif
+
+extern volatile int _log_level;
 
 void _log_std_output(const char *msg);
 void _log_err_output(const char *msg);
 
-void _log_func(void (*output_func)(const char *msg), const char *file, const char *function, int line, const char *fmt, ...);
+void _log_func(void (*output_func)(const char *msg), const char *file, const char *function, int line, const char *fmt, ...) LOG_FORMAT(5, 6);
+
+void log_set_level(int level);
+int log_start();
+void log_stop();
+unsigned long log_dropped();
 
 #endif /* LOG_H_ */
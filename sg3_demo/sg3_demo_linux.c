@@ -165,6 +165,7 @@ void special_released(int key, int x, int y) {
  */
 int main(int argc, char **argv) {
 	glutInit(&argc, argv);
+	log_start();
 	if (!create_window()) {
 		LOGERR("could not create app window\n");
 		return 1;
@@ -183,6 +184,7 @@ int main(int argc, char **argv) {
 	LOG("terminating\n");
 	//glutDestroyWindow(window);
 	demo_cleanup();
+	log_stop();
 	tcheck();
 	exit(0);
 }
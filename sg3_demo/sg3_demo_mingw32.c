@@ -230,6 +230,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     MSG msg;
 
     backtrace_register();
+    log_start();
 
     LOG("SG3mingw - initializing\n");
 
@@ -283,6 +284,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     destroy_window();
 
     backtrace_unregister();
+    log_stop();
     tcheck();
 
 
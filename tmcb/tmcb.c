@@ -5,6 +5,8 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <log/log.h>
 #include <ut/uthash.h>
 #include "tmcb.h"
@@ -16,82 +18,410 @@
 #undef strdup
 #undef strndup
 
-long total_allocs = 0;
-long total_frees = 0;
+// Build with TMCB_PRODUCTION=1 to track blocks through a header in front
+// of each one instead of a TMCB in the hash
+#ifndef TMCB_PRODUCTION
+#define TMCB_PRODUCTION 0
+#endif
+
+#ifndef TMCB_SAMPLE_RATE
+#define TMCB_SAMPLE_RATE 1
+#endif
+#define TMCB_SITE_BUCKETS 1024
+
+// One per allocating file and line, never freed. Sites are keyed by the
+// __FILE__ pointer, so a header's allocations may be split over a site
+// for each file including it; tdump merges them. In production builds
+// only sampled blocks are counted.
+typedef struct _TMCBSite {
+    const char *file;
+    int line;
+    long allocs;
+    long frees;
+    long live_bytes;
+    long peak_bytes;        // most live_bytes at once
+    long alloc_bytes;       // allocated over the whole run, for churn
+    struct _TMCBSite *next;
+} TMCBSite;
+
+static TMCBSite * volatile sites[TMCB_SITE_BUCKETS];
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int sample_rate = TMCB_SAMPLE_RATE;
+
+/* The site record for file and line, added on first use. Lookups don't
+ * lock: records are complete before they are linked in.
+ */
+static TMCBSite *site_intern(const char *file, int line) {
+    unsigned int bucket = (unsigned int)(((uintptr_t)file>>3)^((unsigned int)line*2654435761u))&(TMCB_SITE_BUCKETS-1);
+    TMCBSite *site;
+    for (site=sites[bucket]; site; site=site->next) {
+        if (site->file == file && site->line == line)
+            return site;
+    }
+    pthread_mutex_lock(&sites_lock);
+    for (site=sites[bucket]; site; site=site->next) {
+        if (site->file == file && site->line == line)
+            break;
+    }
+    if (site == NULL && (site = calloc(1, sizeof(TMCBSite))) != NULL) {
+        site->file = file;
+        site->line = line;
+        site->next = sites[bucket];
+        __sync_synchronize();
+        sites[bucket] = site;
+    }
+    pthread_mutex_unlock(&sites_lock);
+    return site;
+}
+
+static void site_resize(TMCBSite *site, long old_size, long size) {
+    long live, peak;
+    if (site == NULL)
+        return;
+    if (size > old_size)
+        __sync_fetch_and_add(&site->alloc_bytes, size-old_size);
+    live = __sync_add_and_fetch(&site->live_bytes, size-old_size);
+    while (live > (peak = site->peak_bytes) &&
+           !__sync_bool_compare_and_swap(&site->peak_bytes, peak, live))
+        ;
+}
+
+static void site_alloc(TMCBSite *site, long size) {
+    if (site == NULL)
+        return;
+    __sync_fetch_and_add(&site->allocs, 1);
+    site_resize(site, 0, size);
+}
+
+static void site_free(TMCBSite *site, long size) {
+    if (site == NULL)
+        return;
+    __sync_fetch_and_add(&site->frees, 1);
+    __sync_fetch_and_sub(&site->live_bytes, size);
+}
+
+#if TMCB_PRODUCTION
+
+#define TMCB_HEADER_SIZE ((sizeof(TMCBHeader)+15)&~(size_t)15)
+#define TMCB_MAGIC 0x54cb7a11u
+
+// Kept in front of every block; site is NULL if the block wasn't sampled.
+// magic tells our blocks from ones malloc'd elsewhere, and is cleared on
+// free.
+typedef struct _TMCBHeader {
+    TMCBSite *site;
+    size_t size;
+    unsigned int magic;
+} TMCBHeader;
+
+// Written only by the owning thread, summed by tstats
+typedef struct _TMCBCounters {
+    volatile long allocs;
+    volatile long frees;
+    volatile long live_bytes;
+    struct _TMCBCounters *next;
+} TMCBCounters;
+
+static TMCBCounters *counters = NULL;
+static TMCBCounters retired;                // from threads that have exited
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t counters_once = PTHREAD_ONCE_INIT;
+static pthread_key_t counters_key;
+static __thread TMCBCounters *thread_counters = NULL;
+static __thread int sample_countdown = 0;
+
+static void counters_retire(void *data) {
+    TMCBCounters *c = data, **p;
+    pthread_mutex_lock(&counters_lock);
+    for (p=&counters; *p; p=&(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    retired.allocs += c->allocs;
+    retired.frees += c->frees;
+    retired.live_bytes += c->live_bytes;
+    pthread_mutex_unlock(&counters_lock);
+    thread_counters = NULL;
+    free(c);
+}
+
+static void counters_init() {
+    pthread_key_create(&counters_key, counters_retire);
+}
+
+static TMCBCounters *counters_register() {
+    TMCBCounters *c = calloc(1, sizeof(TMCBCounters));
+    if (c == NULL)
+        return &retired;
+    pthread_once(&counters_once, counters_init);
+    pthread_mutex_lock(&counters_lock);
+    c->next = counters;
+    counters = c;
+    pthread_mutex_unlock(&counters_lock);
+    pthread_setspecific(counters_key, c);
+    thread_counters = c;
+    return c;
+}
+
+static inline TMCBCounters *counters_get() {
+    return thread_counters ? thread_counters : counters_register();
+}
+
+/* Fill in a new block's header and count it, sampling one block in
+ * sample_rate for its site.
+ */
+static void *track(TMCBHeader *header, const char *file, int line, size_t size) {
+    TMCBCounters *c = counters_get();
+    header->site = NULL;
+    header->size = size;
+    header->magic = TMCB_MAGIC;
+    if (--sample_countdown <= 0) {
+        sample_countdown = sample_rate;
+        header->site = site_intern(file, line);
+        site_alloc(header->site, size);
+    }
+    c->allocs++;
+    c->live_bytes += size;
+    return (char*)header+TMCB_HEADER_SIZE;
+}
+
+static void untrack(TMCBHeader *header) {
+    TMCBCounters *c = counters_get();
+    site_free(header->site, header->size);
+    c->frees++;
+    c->live_bytes -= header->size;
+}
+
+static inline TMCBHeader *header_of(void *block) {
+    return (TMCBHeader*)((char*)block-TMCB_HEADER_SIZE);
+}
 
 void *tmalloc(const char *file, int line, size_t size) {
-    void *tmp = malloc(size);
-    if (tmp == NULL) {
-        LOGERRX(file, "", line, "malloc failed (request %d bytes)\n", size);
+    TMCBHeader *header = malloc(TMCB_HEADER_SIZE+size);
+    if (header == NULL) {
+        LOGERRX(file, "", line, "malloc failed (request %lu bytes)\n", (unsigned long)size);
         return NULL;
+    }
+    return track(header, file, line, size);
+}
+
+void *tcalloc(const char *file, int line, size_t count, size_t eltsize) {
+    TMCBHeader *header = NULL;
+    size_t size = count*eltsize;
+    if (eltsize == 0 || count <= (SIZE_MAX-TMCB_HEADER_SIZE)/eltsize)
+        header = calloc(1, TMCB_HEADER_SIZE+size);
+    if (header == NULL) {
+        LOGERRX(file, "", line, "cmalloc failed (request %lu bytes)\n", (unsigned long)size);
+        return NULL;
+    }
+    return track(header, file, line, size);
+}
+
+/* A moved block keeps its sampling; its site is charged the change in size.
+ */
+void *trealloc(const char *file, int line, void *block, size_t size) {
+    TMCBHeader *header;
+    long delta;
+    if (block == NULL)
+        return tmalloc(file, line, size);
+    if (header_of(block)->magic != TMCB_MAGIC) {
+        LOGERRX(file, "", line, "realloc of untracked block %p\n", block);
+        return realloc(block, size);
+    }
+    header = realloc(header_of(block), TMCB_HEADER_SIZE+size);
+    if (header == NULL) {
+        LOGERRX(file, "", line, "realloc of block %p failed (request %lu bytes)\n", block, (unsigned long)size);
+        return NULL;
+    }
+    delta = (long)size-(long)header->size;
+    site_resize(header->site, header->size, size);
+    header->size = size;
+    counters_get()->live_bytes += delta;
+    return (char*)header+TMCB_HEADER_SIZE;
+}
+
+void tfree(const char *file, int line, void *block) {
+    if (block != NULL) {
+        TMCBHeader *header = header_of(block);
+        if (header->magic != TMCB_MAGIC) {
+            LOGERRX(file, "", line, "TMCB not found for block: %p\n", block);
+            free(block);
+            return;
+        }
+        header->magic = 0;
+        untrack(header);
+        free(header);
     } else {
-        TMCB *cb = malloc(sizeof(TMCB));
-        if (cb == NULL) {
-            LOGERRX(file, "", line, "failed to allocate TMCB\n");
-        } else {
-        	total_allocs++;
-            cb->block = tmp;
-            cb->file = strdup(file);
-            cb->line = line;
-            cb->size = size;
-            HASH_ADD_PTR(TMCB_list, block, cb);
+        LOGERRX(file, "", line, "refusing to free NULL block\n");
+    }
+}
+
+void tstats(TMCBStats *stats) {
+    TMCBCounters *c;
+    TMCBSite *site;
+    int i;
+    pthread_mutex_lock(&counters_lock);
+    stats->allocs = retired.allocs;
+    stats->frees = retired.frees;
+    stats->live_bytes = retired.live_bytes;
+    for (c=counters; c; c=c->next) {
+        stats->allocs += c->allocs;
+        stats->frees += c->frees;
+        stats->live_bytes += c->live_bytes;
+    }
+    pthread_mutex_unlock(&counters_lock);
+    stats->live_blocks = 0;
+    for (i=0; i<TMCB_SITE_BUCKETS; i++) {
+        for (site=sites[i]; site; site=site->next)
+            stats->live_blocks += site->allocs-site->frees;
+    }
+    stats->sample_rate = sample_rate;
+}
+
+/* Record the site of one block in rate; 1 records every block. Leaks
+ * are only reported for recorded blocks.
+ */
+void tsample(int rate) {
+    sample_rate = rate < 1 ? 1 : rate;
+}
+
+void tcheck() {
+    TMCBStats stats;
+    TMCBSite *site;
+    int i;
+    tstats(&stats);
+    LOG("Total allocs: %ld, total frees: %ld\n", stats.allocs, stats.frees);
+    if (stats.allocs > stats.frees) {
+        LOGERR("Memory leaks detected: %ld blocks, %ld bytes (sampling 1 in %d)\n",
+               stats.allocs-stats.frees, stats.live_bytes, stats.sample_rate);
+        for (i=0; i<TMCB_SITE_BUCKETS; i++) {
+            for (site=sites[i]; site; site=site->next) {
+                if (site->allocs > site->frees)
+                    LOGERRX(site->file, "", site->line, "%ld blocks, %ld bytes\n",
+                            site->allocs-site->frees, site->live_bytes);
+            }
         }
-        return tmp;
     }
 }
 
+#else
+
+#define TMCB_SHARDS 16
+
+// The tracked blocks, split by address so threads seldom share a lock
+typedef struct _TMCBShard {
+    TMCB *list;
+    long allocs;
+    long frees;
+    pthread_mutex_t lock;
+} TMCBShard;
+
+static TMCBShard shards[TMCB_SHARDS] = {
+    [0 ... TMCB_SHARDS-1] = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER }
+};
+
+static inline TMCBShard *shard_of(const void *block) {
+    return &shards[((uintptr_t)block>>4)%TMCB_SHARDS];
+}
+
+static void track(void *block, const char *file, int line, size_t size) {
+    TMCBShard *shard = shard_of(block);
+    TMCB *cb = malloc(sizeof(TMCB));
+    if (cb == NULL) {
+        LOGERRX(file, "", line, "failed to allocate TMCB\n");
+        return;
+    }
+    cb->block = block;
+    cb->size = size;
+    cb->file = file;
+    cb->line = line;
+    cb->site = site_intern(file, line);
+    site_alloc(cb->site, size);
+    pthread_mutex_lock(&shard->lock);
+    HASH_ADD_PTR(shard->list, block, cb);
+    shard->allocs++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Take a block's TMCB out of its shard, before the block goes back to
+ * malloc and its address can be handed out again.
+ */
+static TMCB *untrack(void *block) {
+    TMCBShard *shard = shard_of(block);
+    TMCB *cb;
+    pthread_mutex_lock(&shard->lock);
+    HASH_FIND_PTR(shard->list, &block, cb);
+    if (cb != NULL) {
+        HASH_DEL(shard->list, cb);
+        shard->frees++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return cb;
+}
+
+static void retrack(TMCB *cb) {
+    TMCBShard *shard = shard_of(cb->block);
+    pthread_mutex_lock(&shard->lock);
+    HASH_ADD_PTR(shard->list, block, cb);
+    shard->frees--;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void *tmalloc(const char *file, int line, size_t size) {
+    void *tmp = malloc(size);
+    if (tmp == NULL) {
+        LOGERRX(file, "", line, "malloc failed (request %lu bytes)\n", (unsigned long)size);
+        return NULL;
+    }
+    track(tmp, file, line, size);
+    return tmp;
+}
+
+/* A moved block keeps the TMCB and site it was allocated with.
+ */
 void *trealloc(const char *file, int line, void *block, size_t size) {
-    TMCB *cb = NULL;
+    TMCB *cb;
     void *tmp;
+    if (block == NULL)
+        return tmalloc(file, line, size);
+    cb = untrack(block);
     tmp = realloc(block, size);
-    HASH_FIND_PTR(TMCB_list, &block, cb);
-    if (cb != NULL) HASH_DEL(TMCB_list, cb);
     if (tmp == NULL) {
-        LOGERRX(file, "", line, "realloc of block %x failed (request %d bytes)\n", (unsigned int)block, size);
-        if (cb != NULL) {
-            free(cb->file);
-            free(cb);
-        }
+        LOGERRX(file, "", line, "realloc of block %p failed (request %lu bytes)\n", block, (unsigned long)size);
+        if (cb != NULL) retrack(cb);
+    } else if (cb == NULL) {
+        track(tmp, file, line, size);
     } else {
-        if (cb == NULL) cb = malloc(sizeof(TMCB));
+        site_resize(cb->site, cb->size, size);
         cb->block = tmp;
         cb->size = size;
-        cb->file = strdup(file);
-        cb->line = line;
-        HASH_ADD_PTR(TMCB_list, block, cb);
+        retrack(cb);
     }
     return tmp;
 }
 
 void *tcalloc(const char *file, int line, size_t count, size_t eltsize) {
     size_t size = count*eltsize;
-    TMCB *cb = malloc(sizeof(TMCB));
-    cb->block = calloc(count, eltsize);
-    if (cb->block == NULL) {
-        LOGERRX(file, "", line, "cmalloc failed (request %d bytes)\n", size);
-        free(cb);
+    void *tmp = calloc(count, eltsize);
+    if (tmp == NULL) {
+        LOGERRX(file, "", line, "cmalloc failed (request %lu bytes)\n", (unsigned long)size);
         return NULL;
-    } else {
-    	total_allocs++;
-        cb->size = size;
-        cb->file = strdup(file);
-        cb->line = line;
-        HASH_ADD_PTR(TMCB_list, block, cb);
-        return cb->block;
     }
+    track(tmp, file, line, size);
+    return tmp;
 }
 
 void tfree(const char *file, int line, void *block) {
     TMCB *cb;
     if (block != NULL) {
-        HASH_FIND_PTR(TMCB_list, &block, cb);
+        cb = untrack(block);
         if (cb != NULL) {
-            HASH_DEL(TMCB_list, cb);
-            free(cb->file);
+            site_free(cb->site, cb->size);
             free(cb);
-            total_frees++;
         } else {
-            LOGERRX(file, "", line, "TMCB not found for block: %x\n", (unsigned int)block);
+            LOGERRX(file, "", line, "TMCB not found for block: %p\n", block);
         }
         free(block);
     } else {
@@ -100,15 +430,117 @@ void tfree(const char *file, int line, void *block) {
 }
 
 void tcheck() {
-    int count = HASH_COUNT(TMCB_list);
+    TMCBStats stats;
     TMCB *cb, *tmp;
-    LOG("Total allocs: %ld, total frees: %ld\n", total_allocs, total_frees);
-    if (count > 0) {
-        LOGERR("Memory leaks detected: %d blocks\n", count);
-        HASH_ITER(hh, TMCB_list, cb, tmp) {
-            LOGERRX(cb->file, "", cb->line, "%x %d bytes\n", (unsigned int)cb->block, cb->size);
+    int i;
+    tstats(&stats);
+    LOG("Total allocs: %ld, total frees: %ld\n", stats.allocs, stats.frees);
+    if (stats.live_blocks > 0) {
+        LOGERR("Memory leaks detected: %ld blocks\n", stats.live_blocks);
+        for (i=0; i<TMCB_SHARDS; i++) {
+            pthread_mutex_lock(&shards[i].lock);
+            HASH_ITER(hh, shards[i].list, cb, tmp) {
+                LOGERRX(cb->file, "", cb->line, "%p %lu bytes\n", cb->block, (unsigned long)cb->size);
+            }
+            pthread_mutex_unlock(&shards[i].lock);
+        }
+    }
+}
+
+void tstats(TMCBStats *stats) {
+    TMCB *cb, *tmp;
+    int i;
+    memset(stats, 0, sizeof(TMCBStats));
+    stats->sample_rate = 1;
+    for (i=0; i<TMCB_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        stats->allocs += shards[i].allocs;
+        stats->frees += shards[i].frees;
+        stats->live_blocks += HASH_COUNT(shards[i].list);
+        HASH_ITER(hh, shards[i].list, cb, tmp) {
+            stats->live_bytes += cb->size;
+        }
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
+
+/* Every block is tracked in debug builds.
+ */
+void tsample(int rate) {
+}
+
+#endif
+
+static int site_order(const void *a, const void *b) {
+    const TMCBSite *sa = a, *sb = b;
+    int order = strcmp(sa->file, sb->file);
+    return order ? order : sa->line-sb->line;
+}
+
+static int site_size_order(const void *a, const void *b) {
+    const TMCBSite *sa = a, *sb = b;
+    if (sa->live_bytes != sb->live_bytes)
+        return sa->live_bytes < sb->live_bytes ? 1 : -1;
+    if (sa->alloc_bytes != sb->alloc_bytes)
+        return sa->alloc_bytes < sb->alloc_bytes ? 1 : -1;
+    return site_order(a, b);
+}
+
+/* Write the heap profile to path: one line per allocation site, largest
+ * live size first, giving live bytes and blocks, peak live bytes, and
+ * bytes and blocks allocated and freed over the run. Peaks of sites
+ * merged from several files are summed, so they are upper bounds.
+ * Returns 0, or -1 if the file can't be written.
+ */
+int tdump(const char *path) {
+    TMCBStats stats;
+    TMCBSite *site, *copies;
+    FILE *f;
+    int i, count = 0, merged = 0;
+    for (i=0; i<TMCB_SITE_BUCKETS; i++) {
+        for (site=sites[i]; site; site=site->next)
+            count++;
+    }
+    copies = malloc(sizeof(TMCBSite)*(count ? count : 1));
+    if (copies == NULL)
+        return -1;
+    count = 0;
+    for (i=0; i<TMCB_SITE_BUCKETS; i++) {
+        for (site=sites[i]; site; site=site->next)
+            copies[count++] = *site;
+    }
+    qsort(copies, count, sizeof(TMCBSite), site_order);
+    for (i=0; i<count; i++) {
+        if (merged > 0 && site_order(&copies[merged-1], &copies[i]) == 0) {
+            site = &copies[merged-1];
+            site->allocs += copies[i].allocs;
+            site->frees += copies[i].frees;
+            site->live_bytes += copies[i].live_bytes;
+            site->peak_bytes += copies[i].peak_bytes;
+            site->alloc_bytes += copies[i].alloc_bytes;
+        } else {
+            copies[merged++] = copies[i];
         }
     }
+    qsort(copies, merged, sizeof(TMCBSite), site_size_order);
+    f = fopen(path, "w");
+    if (f == NULL) {
+        LOGERR("can't write heap profile %s\n", path);
+        free(copies);
+        return -1;
+    }
+    tstats(&stats);
+    fprintf(f, "# tmcb heap profile, 1 in %d blocks sampled\n", stats.sample_rate);
+    fprintf(f, "# %ld allocs, %ld frees, %ld live bytes\n", stats.allocs, stats.frees, stats.live_bytes);
+    fprintf(f, "# live_bytes live_blocks peak_bytes alloc_bytes allocs frees site\n");
+    for (i=0; i<merged; i++) {
+        site = &copies[i];
+        fprintf(f, "%ld %ld %ld %ld %ld %ld %s:%d\n", site->live_bytes, site->allocs-site->frees,
+                site->peak_bytes, site->alloc_bytes, site->allocs, site->frees, site->file, site->line);
+    }
+    fclose(f);
+    free(copies);
+    return 0;
 }
 
 char *tstrdup(const char *file, int line, const char *s) {
@@ -122,4 +554,3 @@ char *tstrndup(const char *file, int line, const char *s, size_t size) {
     if (tmp != NULL) strcpy(tmp, s);
     return tmp;
 }
-
@@ -12,13 +12,25 @@
 typedef struct _TMCB {
     void *block;
     int size;
-    char *file;
+    const char *file;
     int line;
+    struct _TMCBSite *site;
     UT_hash_handle hh;
 } TMCB;
 
-TMCB *TMCB_list;
+// Counts merged from every thread. In production builds leaks are only
+// seen through sampled blocks, so live_blocks covers one in sample_rate.
+typedef struct _TMCBStats {
+    long allocs;
+    long frees;
+    long live_bytes;
+    long live_blocks;       // sampled blocks not yet freed
+    int sample_rate;
+} TMCBStats;
 
 void tcheck();
+void tstats(TMCBStats *stats);
+void tsample(int rate);
+int tdump(const char *path);
 
 #endif /* TMCB_H_ */